@@ -16,10 +16,15 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define DBBENCH_NUM_OPT_TYPE (3)
+#define DBBENCH_NUM_OPT_TYPE (4)
 #define DBBENCH_PUT (0)
 #define DBBENCH_GET (1)
 #define DBBENCH_UPDATE (2)
+#define DBBENCH_NEGATIVE_GET (3)
+
+// Random::Next() never sets bit 31, so keys with this bit set
+// are guaranteed to miss (key_length should be at least 4B)
+#define DBBENCH_NEGATIVE_KEY_BIT (1UL << 31)
 
 namespace kv_benchmark {
 // Only Support Single Thread
@@ -58,7 +63,11 @@ private:
 public:
     int get_kv_pair(char* key, size_t& key_length)
     {
-        generate_kv_pair((uint64_t)random_->Next(), key);
+        uint64_t _uid = (uint64_t)random_->Next();
+        if (type_ == DBBENCH_NEGATIVE_GET) {
+            _uid |= DBBENCH_NEGATIVE_KEY_BIT;
+        }
+        generate_kv_pair(_uid, key);
         key_length = key_length_;
         return random_get_put();
     }
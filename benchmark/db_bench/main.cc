@@ -79,6 +79,7 @@ int main(int argc, char* argv[])
     size_t _key_length = 8;
     size_t _num_test = 5000000;
     size_t _num_warmup = 1000000;
+    size_t _num_negative = 0;
 
     char _index_type[128];
     char _pmem_path[128] = "/home/pmem0";
@@ -96,6 +97,12 @@ int main(int argc, char* argv[])
             _num_warmup = n;
         } else if (sscanf(argv[i], "--num_test=%llu%c", &n, &junk) == 1) { // GB
             _num_test = n;
+        } else if (sscanf(argv[i], "--num_negative=%llu%c", &n, &junk) == 1) {
+            _num_negative = n;
+        } else if (sscanf(argv[i], "--pclht_buckets=%llu%c", &n, &junk) == 1) {
+            _options.pclht_num_buckets = n;
+        } else if (sscanf(argv[i], "--htm=%llu%c", &n, &junk) == 1) {
+            _options.htm = (n != 0);
         } else if (sscanf(argv[i], "--pmem_file_size=%llu%c", &n, &junk) == 1) {
             _options.pmem_file_size = n * (1024UL * 1024 * 1024);
         } else if (strncmp(argv[i], "--pmem_file_path=", 17) == 0) {
@@ -111,6 +118,19 @@ int main(int argc, char* argv[])
                 _options.index_type = kRHTREE;
             } else if (!strcmp(_index_type, "WORT")) {
                 _options.index_type = kWORT;
+            } else if (!strcmp(_index_type, "PCLHT")) {
+                _options.index_type = kPCLHT;
+            }
+        } else if (strncmp(argv[i], "--rhtree_leaf=", 14) == 0) {
+            if (!strcmp(argv[i] + 14, "1KB")) {
+                _options.rhtree_leaf = kRHTreeLeaf1KB;
+            } else if (!strcmp(argv[i] + 14, "2KB")) {
+                _options.rhtree_leaf = kRHTreeLeaf2KB;
+            } else if (!strcmp(argv[i] + 14, "4KB")) {
+                _options.rhtree_leaf = kRHTreeLeaf4KB;
+            } else {
+                std::cout << "ERROR PARAMETER [" << argv[i] << "]" << std::endl;
+                exit(1);
             }
         } else if (i > 0) {
             std::cout << "ERROR PARAMETER [" << argv[i] << "]" << std::endl;
@@ -148,5 +168,13 @@ int main(int argc, char* argv[])
     _wopt.type = DBBENCH_GET;
     _wopt.num_test = _num_test;
     start_workload(&_wopt);
+
+    // Lookups of keys that are never inserted
+    if (_num_negative > 0) {
+        strcpy(_wopt.name, "SINGLE_NEGATIVE_GET");
+        _wopt.type = DBBENCH_NEGATIVE_GET;
+        _wopt.num_test = _num_negative;
+        start_workload(&_wopt);
+    }
     return 0;
 }
@@ -0,0 +1,24 @@
+###
+ # Run db_bench on RHTREE for every leaf configuration and key length.
+ # Extra arguments are passed to db_bench, e.g.
+ #   ./rhtree_sweep.sh --pmem_file_path=/home/pmem0/PIE --num_thread=8
+ # The output of each run is kept in $OUT_PATH/<leaf>_<key length>.log
+###
+
+DB_BENCH=./db_bench
+OUT_PATH=rhtree_sweep
+LEAF=('1KB' '2KB' '4KB')
+KEY_LENGTH=(8 16 64 128)
+
+mkdir -p $OUT_PATH
+
+for leaf in ${LEAF[@]}
+do
+    for key_length in ${KEY_LENGTH[@]}
+    do
+        echo "[RHTREE leaf=${leaf} key_length=${key_length}]"
+        $DB_BENCH --index=RHTREE --rhtree_leaf=${leaf} --key_length=${key_length} "$@" > $OUT_PATH/${leaf}_${key_length}.log
+        # Results are saved in directories named by second
+        sleep 1
+    done
+done
@@ -11,7 +11,7 @@ using namespace PIE;
 using namespace kv_benchmark;
 
 // #define RESULT_OUTPUT_TO_FILE
-static char _g_oname[DBBENCH_NUM_OPT_TYPE][32] = { "PUT", "GET", "UPDATE" };
+static char _g_oname[DBBENCH_NUM_OPT_TYPE][32] = { "PUT", "GET", "UPDATE", "NEGATIVE_GET" };
 static int g_numa[] = { 0, 2, 4, 6, 8, 20, 22, 24, 26, 28, 10, 12, 14, 16, 18, 30, 32, 34, 36, 38 };
 
 struct thread_param_t {
@@ -112,6 +112,15 @@ static void thread_task(thread_param_t* param)
             if (__status.ok() && (*(uint64_t*)_key == (uint64_t)_value)) {
                 param->result_success[__type]++;
             }
+        } else if (__type == DBBENCH_NEGATIVE_GET) {
+            Slice __skey(_key, _key_length);
+            _t2.Start();
+            Status __status = _scheme->Search(__skey, &_value);
+            _t2.Stop();
+            param->result_count[__type]++;
+            if (__status.IsNotFound()) {
+                param->result_success[__type]++;
+            }
         }
         _latency = _t2.Get();
         param->result_latency[__type] += _latency;
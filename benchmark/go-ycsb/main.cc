@@ -250,8 +250,9 @@ static void run_thread(thread_context_t* context)
             }
         } else if (__operator->type_ == OPT_TYPE_SCAN) {
             Slice __skey(__operator->skew_);
-            Status __status = _scheme->ScanCount(__skey, __operator->other_, &__value);
-            delete (char*)__value;
+            void** __vec = new void*[__operator->other_];
+            Status __status = _scheme->ScanCount(__skey, __operator->other_, __vec);
+            delete[] __vec;
         }
     }
     _timer.Stop();
@@ -297,6 +298,8 @@ int main(int argc, char** argv)
             kNumThread = n;
         } else if (sscanf(argv[i], "--pmem_file_size=%llu%c", &n, &junk) == 1) {
             _options.pmem_file_size = n * (1024UL * 1024 * 1024);
+        } else if (sscanf(argv[i], "--htm=%llu%c", &n, &junk) == 1) {
+            _options.htm = (n != 0);
         } else if (strncmp(argv[i], "--pmem_file_path=", 17) == 0) {
             strcpy(_pmem_path, argv[i] + 17);
             _options.pmem_file_path.assign(argv[i] + 17);
@@ -310,6 +313,8 @@ int main(int argc, char** argv)
                 _options.index_type = kRHTREE;
             } else if (!strcmp(_index_type, "WORT")) {
                 _options.index_type = kWORT;
+            } else if (!strcmp(_index_type, "PCLHT")) {
+                _options.index_type = kPCLHT;
             }
         } else if (i > 0) {
             std::cout << "ERROR PARAMETER [" << argv[i] << "]" << std::endl;
@@ -0,0 +1,38 @@
+#ifndef PIE_INCLUDE_ITERATOR_HPP__
+#define PIE_INCLUDE_ITERATOR_HPP__
+
+#include "slice.hpp"
+
+namespace PIE {
+
+// A forward-only source of key-value pairs, e.g. the input of BulkLoad.
+// Keys must be produced in strictly ascending order (memcmp order of key
+// bytes), key() is only required to stay valid until the next call of Next()
+class Iterator {
+public:
+    Iterator() { }
+
+    virtual ~Iterator() { }
+
+private: // No copying allowed
+    Iterator(const Iterator&) = delete;
+
+    Iterator& operator=(const Iterator&) = delete;
+
+public:
+    // Return true iff the iterator is positioned at a key-value pair
+    virtual bool Valid() const = 0;
+
+    // Move to the next pair, REQUIRES: Valid()
+    virtual void Next() = 0;
+
+    // Return the key of current pair, REQUIRES: Valid()
+    virtual Slice key() const = 0;
+
+    // Return the value of current pair, REQUIRES: Valid()
+    virtual void* value() const = 0;
+};
+
+};
+
+#endif // PIE_INCLUDE_ITERATOR_HPP__
@@ -19,6 +19,14 @@ enum index_type_t {
     kRHTREE = 2, // RH-Tree
     kFASTFAIR = 3, // B+Tree - FAST-FAIR
     kWORT = 4, // Trie - WORT
+    kPCLHT = 5, // Hashing - P-CLHT
+};
+
+// Leaf configurations of RHTREE, small keys fit many more items into a leaf
+enum rhtree_leaf_t {
+    kRHTreeLeaf2KB = 0, // 32 hash buckets per leaf, 128 initial leaves
+    kRHTreeLeaf1KB = 1, // 16 hash buckets per leaf, 128 initial leaves
+    kRHTreeLeaf4KB = 2, // 64 hash buckets per leaf, 64 initial leaves
 };
 
 enum scheme_type_t {
@@ -32,6 +40,9 @@ public:
         : pmem_file_size(2UL * 1024 * 1024 * 1024)
         , index_type(kCCEH)
         , scheme_type(kSingleScheme)
+        , rhtree_leaf(kRHTreeLeaf2KB)
+        , pclht_num_buckets(64)
+        , htm(false)
     {
         pmem_file_path = "/home/pmem0/PIE";
     }
@@ -54,6 +65,20 @@ public:
     // scheme type
     // default : SingleScheme
     scheme_type_t scheme_type;
+
+    // leaf configuration, only used by RHTREE
+    // default : kRHTreeLeaf2KB
+    rhtree_leaf_t rhtree_leaf;
+
+    // initial number of buckets, rounded up to a power of 2, only used by
+    // P-CLHT. The table doubles on demand
+    // default : 64
+    size_t pclht_num_buckets;
+
+    // elide locks with hardware transactions (Intel RTM), only used by CCEH
+    // searches. Ignored on CPUs without RTM
+    // default : false
+    bool htm;
 };
 };
 
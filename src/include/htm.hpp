@@ -0,0 +1,171 @@
+#ifndef PIE_SRC_INCLUDE_HTM_HPP__
+#define PIE_SRC_INCLUDE_HTM_HPP__
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+namespace PIE {
+
+// Lock elision with Intel RTM. Indexes only start transactions if
+// HTMSupported() holds, thus a build with -mrtm still runs on CPUs without
+// TSX, or with TSX hidden from CPUID. Without -mrtm HTM is never used.
+// Cache line flushes abort a transaction, so only critical sections that do
+// not persist anything benefit from elision
+
+// Reason of an abort, decoded from the status returned by _xbegin()
+enum htm_abort_reason_t {
+  kHTMAbortConflict = 0,  // another thread accessed the read or write set
+  kHTMAbortCapacity = 1,  // the transaction did not fit in the cache
+  kHTMAbortExplicit = 2,  // _xabort(), mostly because the lock was taken
+  kHTMAbortNested = 3,    // abort of a nested transaction
+  kHTMAbortOther = 4,     // interrupts, page faults, flushes, pause, ...
+  kHTMAbortReasons = 5,
+};
+
+// Code of _xabort() when the elided lock turns out to be taken
+constexpr unsigned kHTMLockBusy = 0xff;
+
+// Transactions a critical section tries before it takes the lock
+constexpr int kHTMAttempts = 2;
+
+// Transaction counters of one thread
+struct HTMStats {
+  uint64_t commits = 0;
+  uint64_t aborts[kHTMAbortReasons] = {};
+  uint64_t fallbacks = 0;  // critical sections that took the lock instead
+
+  void Add(const HTMStats &other) {
+    commits += other.commits;
+    for (int i = 0; i < kHTMAbortReasons; i++) {
+      aborts[i] += other.aborts[i];
+    }
+    fallbacks += other.fallbacks;
+  }
+
+  void Print() const {
+    std::cout << "[HTM Commits: " << commits << "][Aborts(conflict/capacity/"
+              << "explicit/nested/other): " << aborts[kHTMAbortConflict] << "/"
+              << aborts[kHTMAbortCapacity] << "/" << aborts[kHTMAbortExplicit]
+              << "/" << aborts[kHTMAbortNested] << "/"
+              << aborts[kHTMAbortOther] << "][Fallbacks: " << fallbacks
+              << "]\n";
+  }
+};
+
+// Check CPUID once for RTM
+inline bool HTMSupported() {
+#ifdef __RTM__
+  static const bool supported = [] {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+    return (ebx & bit_RTM) != 0;
+  }();
+  return supported;
+#else
+  return false;
+#endif
+}
+
+// Counters of every thread that used HTM, they are kept after the thread
+// exits so that totals cover finished threads as well
+inline std::mutex htm_stats_mutex;
+inline std::vector<HTMStats *> htm_stats_list;
+
+// Counters of the calling thread
+inline HTMStats &HTMThreadStats() {
+  thread_local HTMStats *stats = [] {
+    HTMStats *s = new HTMStats;
+    std::lock_guard<std::mutex> guard(htm_stats_mutex);
+    htm_stats_list.push_back(s);
+    return s;
+  }();
+  return *stats;
+}
+
+// Sum of the counters of all threads. Counters of running threads are read
+// without synchronization and may lag behind
+inline HTMStats HTMTotalStats() {
+  HTMStats total;
+  std::lock_guard<std::mutex> guard(htm_stats_mutex);
+  for (const HTMStats *s : htm_stats_list) {
+    total.Add(*s);
+  }
+  return total;
+}
+
+#ifdef __RTM__
+inline void HTMRecordAbort(unsigned int status) {
+  HTMStats &stats = HTMThreadStats();
+  if (status & _XABORT_EXPLICIT) {
+    stats.aborts[kHTMAbortExplicit]++;
+  } else if (status & _XABORT_CONFLICT) {
+    stats.aborts[kHTMAbortConflict]++;
+  } else if (status & _XABORT_CAPACITY) {
+    stats.aborts[kHTMAbortCapacity]++;
+  } else if (status & _XABORT_NESTED) {
+    stats.aborts[kHTMAbortNested]++;
+  } else {
+    stats.aborts[kHTMAbortOther]++;
+  }
+}
+
+// Whether another attempt may commit: the CPU hints at it, or the lock was
+// only held for a short while
+inline bool HTMShouldRetry(unsigned int status) {
+  return (status & _XABORT_RETRY) ||
+         ((status & _XABORT_EXPLICIT) &&
+          _XABORT_CODE(status) == kHTMLockBusy);
+}
+
+// Try to enter the critical section of a lock in a transaction. lock_free
+// reads the lock word inside the transaction, so a thread that takes the
+// lock aborts it. Return true inside the transaction, the caller commits
+// with HTMCommit() where it would release the lock. Return false if the
+// caller has to take the lock
+template <typename LockFree>
+inline bool HTMElide(LockFree lock_free) {
+  for (int attempt = 0; attempt < kHTMAttempts; attempt++) {
+    unsigned int status = _xbegin();
+    if (status == _XBEGIN_STARTED) {
+      if (lock_free()) {
+        return true;
+      }
+      _xabort(kHTMLockBusy);
+    }
+    HTMRecordAbort(status);
+    if (!HTMShouldRetry(status)) {
+      break;
+    }
+    _mm_pause();
+  }
+  HTMThreadStats().fallbacks++;
+  return false;
+}
+
+inline void HTMCommit() {
+  _xend();
+  HTMThreadStats().commits++;
+}
+
+inline bool HTMInTransaction() { return _xtest(); }
+#else
+template <typename LockFree>
+inline bool HTMElide(LockFree lock_free) {
+  return false;
+}
+
+inline void HTMCommit() {}
+
+inline bool HTMInTransaction() { return false; }
+#endif  // __RTM__
+
+}  // namespace PIE
+
+#endif  // PIE_SRC_INCLUDE_HTM_HPP__
@@ -8,6 +8,8 @@
 
 namespace PIE {
 
+class Iterator;
+
 // An abstrat base index that provides basic
 // operation interfaces
 class Index {
@@ -47,6 +49,15 @@ public:
   virtual status_code_t Upsert(const char *key, size_t key_len,
                                void *value) = 0;
 
+  // Remove the key and its value from index.
+  // If the key does not exist in current index, kNotFound would
+  // be returned. Indexes without deletion support return kNotDefined
+  virtual status_code_t Delete(const char *key, size_t key_len) {
+    (void)key;
+    (void)key_len;
+    return kNotDefined;
+  }
+
   // Scan from start key and return its "count" successors
   // Coresponding values are placed in a void* array specified by "vec"
   // However, values are not guaranteed to be SORTED;
@@ -60,6 +71,16 @@ public:
                              const char *endkey, size_t endkey_len,
                              void **vec) = 0;
 
+  // Build the index from pairs in ascending key order, the index must be
+  // empty. "fill_factor" (0, 1] is the fraction of each node that is filled,
+  // leave room for later inserts to avoid splits right after loading.
+  // Indexes without a bulk loading path return kNotDefined
+  virtual status_code_t BulkLoad(Iterator *iter, double fill_factor) {
+    (void)iter;
+    (void)fill_factor;
+    return kNotDefined;
+  }
+
   // Printout Any related index message:
   // such as the height of B+Tree or max height of radix tree
   // The bucket/slot number of hash table
@@ -263,14 +263,14 @@ RETRY:
   }
 
   /* acquire segment shared lock */
-  if (!target->lock()) {
+  if (!target->lock(htm_)) {
     std::this_thread::yield();
     goto RETRY;
   }
 
   auto target_check = (f_hash >> (8 * sizeof(f_hash) - dir->depth));
   if (target != dir->_[target_check]) {
-    target->unlock();
+    target->unlock(htm_);
     std::this_thread::yield();
     goto RETRY;
   }
@@ -285,7 +285,7 @@ RETRY:
       // Do complete key compare
       if (target->_[loc].key == key) {
         auto v = target->_[loc].value;
-        target->unlock();
+        target->unlock(htm_);
         return v;
       }
     }
@@ -303,13 +303,13 @@ RETRY:
       // Do complete key compare
       if (target->_[loc].key == key) {
         auto v = target->_[loc].value;
-        target->unlock();
+        target->unlock(htm_);
         return v;
       }
     }
   }
   // key not found, release segment shared lock
-  target->unlock();
+  target->unlock(htm_);
   // return nullptr to indicate Key is not found
   return nullptr;
 }
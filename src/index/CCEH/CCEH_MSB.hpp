@@ -10,6 +10,7 @@
 
 #include "allocator.hpp"
 #include "ccehhash.hpp"
+#include "htm.hpp"
 #include "index.hpp"
 #include "internal_string.h"
 #include "persist.h"
@@ -123,8 +124,14 @@ struct Segment {
     return true;
   }
 
-  // shared lock
-  bool lock(void) {
+  // shared lock. With htm the lock is elided into a transaction if
+  // possible, then sema is only read, and a suspend() aborts the
+  // transaction. htm must be the same for lock() and unlock(), and must only
+  // be set if HTMSupported()
+  bool lock(bool htm = false) {
+    if (htm && HTMElide([this] { return sema > -1; })) {
+      return true;
+    }
     int64_t val = sema;
     while (val > -1) {
       if (CCEH_CAS(&sema, &val, val + 1)) {
@@ -135,7 +142,11 @@ struct Segment {
     return false;
   }
 
-  void unlock(void) {
+  void unlock(bool htm = false) {
+    if (htm && HTMInTransaction()) {
+      HTMCommit();
+      return;
+    }
     int64_t val = sema;
     while (!CCEH_CAS(&sema, &val, val - 1)) {
       val = sema;
@@ -215,8 +226,10 @@ class CCEHIndex : public Index {
  public:
   // Note: Any constructor of CCEH need to have
   // exactly on memory allocator
-  CCEHIndex(Allocator *nvm_allocator, size_t initCap)
-      : nvm_allocator_(nvm_allocator) {
+  // htm elides the segment locks of searches with RTM if the CPU
+  // supports it
+  CCEHIndex(Allocator *nvm_allocator, size_t initCap, bool htm = false)
+      : nvm_allocator_(nvm_allocator), htm_(htm && HTMSupported()) {
     dir = AllocDirectory(static_cast<size_t>(log2(initCap)));
     for (unsigned i = 0; i < dir->capacity; ++i) {
       dir->_[i] = AllocSegment(static_cast<size_t>(log2(initCap)));
@@ -224,7 +237,8 @@ class CCEHIndex : public Index {
     printf("[CCEH is working!]\n");
   }
 
-  CCEHIndex(Allocator *nvm_allocator) : nvm_allocator_(nvm_allocator) {
+  CCEHIndex(Allocator *nvm_allocator)
+      : nvm_allocator_(nvm_allocator), htm_(false) {
     dir = AllocDirectory(1);
     for (unsigned i = 0; i < dir->capacity; ++i) {
       dir->_[i] = AllocSegment(1);
@@ -281,6 +295,9 @@ class CCEHIndex : public Index {
     std::cout << "[CCEH]"
               << "[Global Depth]"
               << "[" << dir->depth << "]" << std::endl;
+    if (htm_) {
+      HTMTotalStats().Print();
+    }
     return;
   }
 
@@ -301,6 +318,10 @@ class CCEHIndex : public Index {
 
   // nvm_allocator_ is used to allocate any neccessary message
   Allocator *nvm_allocator_;
+
+  // Elide segment locks in get(). insert() persists the slot inside its
+  // critical section, and the flush would abort every transaction
+  const bool htm_;
 };
 
 // Insert key-value pair into CCEH index with provided insert
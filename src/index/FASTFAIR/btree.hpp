@@ -14,29 +14,54 @@
 #ifndef INCLUDE_SRC_INDEX_FASTFAIR_HPP__
 #define INCLUDE_SRC_INDEX_FASTFAIR_HPP__
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <climits>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <deque>
+#include <emmintrin.h>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <iostream>
 #include <mutex>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 
 #include "../../../util/internal_string.h"
 #include "../../include/allocator.hpp"
 #include "../../include/index.hpp"
+#include "iterator.hpp"
 
 // to silence warnings
 #define UNUSED(x) ((void)(x))
 
-#define PAGESIZE 512
+// Node size in bytes, override with -DFASTFAIR_PAGESIZE=256/1024 to
+// evaluate different node sizes
+#ifndef FASTFAIR_PAGESIZE
+#define FASTFAIR_PAGESIZE 512
+#endif
+#define PAGESIZE FASTFAIR_PAGESIZE
+
+// Number of leaf pages a range scan prefetches ahead of the one it reads,
+// 0 disables prefetching
+#ifndef FASTFAIR_SCAN_PREFETCH
+#define FASTFAIR_SCAN_PREFETCH 3
+#endif
+
+// Number of threads a wide range scan is split across, the calling thread
+// included. 0 or 1 scans every range on the calling thread
+#ifndef FASTFAIR_SCAN_THREADS
+#define FASTFAIR_SCAN_THREADS 0
+#endif
 
 #define CPU_FREQ_MHZ (1994)
 #define DELAY_IN_NS (1000)
@@ -45,12 +70,91 @@
 
 #define IS_FORWARD(c) (c % 2 == 0)
 
+// Use -DFASTFAIR_INTKEY to index 8B integer keys instead of strings
+#ifndef FASTFAIR_INTKEY
 #define STRINGKEY
+#endif
 
 #ifdef STRINGKEY
-using entry_key_t = PIE::InternalString;
+namespace PIE {
+namespace FASTFAIR {
+
+// String key as stored in a page entry. The first 8 bytes of the string are
+// inlined as a big-endian integer next to the pointer to the persistent
+// string, so comparisons only dereference the string when prefixes tie.
+// Both words are written with plain 8B stores, a half-written key is
+// covered by the duplicated ptr of its entry like any other shifted key.
+class PrefixedKey {
+  public:
+    PrefixedKey() : prefix(0), raw(0) {}
+
+    PrefixedKey(const InternalString &str) : prefix(0), raw(str.Raw()) {
+        uint64_t bytes = 0;
+        memcpy(&bytes, str.Data(), std::min(str.Length(), sizeof(uint64_t)));
+        prefix = __builtin_bswap64(bytes);
+    }
+
+    void Nullify() {
+        prefix = 0;
+        raw = 0;
+    }
+
+    const PrefixedKey &BorrowFrom(const PrefixedKey &other) {
+        prefix = other.prefix;
+        raw = other.raw;
+        return *this;
+    }
+
+    const uint8_t *Data() const { return InternalString(raw).Data(); }
+    size_t Length() const { return InternalString(raw).Length(); }
+
+    // The persistent string, to hand it back to its allocator
+    void *Record() const { return (void *)raw; }
+
+    // Shorter strings are zero padded, thus a smaller prefix always means a
+    // smaller string and only equal prefixes need the full compare
+    int compare(const PrefixedKey &rhs) const {
+        if (prefix != rhs.prefix) {
+            return prefix < rhs.prefix ? -1 : 1;
+        }
+        if (raw == rhs.raw) {
+            return 0;
+        }
+        return InternalString(raw).compare(InternalString(rhs.raw));
+    }
+
+    bool operator==(const PrefixedKey &rhs) const { return compare(rhs) == 0; }
+    bool operator<(const PrefixedKey &rhs) const { return compare(rhs) < 0; }
+    bool operator>(const PrefixedKey &rhs) const { return compare(rhs) > 0; }
+    bool operator>=(const PrefixedKey &rhs) const { return compare(rhs) >= 0; }
+    bool operator<=(const PrefixedKey &rhs) const { return compare(rhs) <= 0; }
+
+  private:
+    uint64_t prefix; // 8 bytes, first 8 bytes of the string
+    uint64_t raw;    // 8 bytes, InternalString in persistent memory
+};
+
+} // namespace FASTFAIR
+} // namespace PIE
+
+using entry_key_t = PIE::FASTFAIR::PrefixedKey;
+
+// Free the persistent string of a key that never became part of the tree
+inline void free_key(PIE::Allocator *allocator, const entry_key_t &key) {
+    allocator->Free(key.Record());
+}
 #else
 using entry_key_t = int64_t;
+
+inline void free_key(PIE::Allocator *, const entry_key_t &) {}
+#endif
+
+// Use -DFASTFAIR_SIMD together with -mavx2 or -mavx512f to search integer
+// keys of a page with SIMD compares
+#if !defined(STRINGKEY) && defined(FASTFAIR_SIMD) &&                          \
+    (defined(__AVX512F__) || defined(__AVX2__))
+#define FASTFAIR_SIMD_SEARCH
+#include <immintrin.h>
 #endif
 
 namespace PIE {
@@ -94,24 +198,85 @@ inline void clflush(char *data, int len) {
 
 class page;
 
+// Prefetches the leaf pages ahead of a range scan. The leaves following the
+// first one are taken from their parent while the scan descends, after
+// that a cursor runs FASTFAIR_SCAN_PREFETCH pages ahead on the sibling
+// chain. The cursor only reads sibling_ptr of pages requested steps
+// before, thus the misses of consecutive leaves overlap
+class leaf_prefetcher {
+  public:
+    leaf_prefetcher() : ahead(nullptr), distance(0) {}
+
+    // The scan descends from parent to leaf
+    void start(page *parent, page *leaf);
+
+    // The scan is about to read current
+    void step(page *current);
+
+  private:
+    page *ahead;  // last requested page
+    int distance; // requested pages the scan has not read yet
+};
+
+// Worker threads running the partitions of wide range scans, the calling
+// thread runs partitions as well. Scans of several threads share the pool
+class scan_pool {
+  public:
+    explicit scan_pool(int num_workers);
+    ~scan_pool();
+
+    // Number of threads a batch runs on, the caller included
+    int size() const { return (int)workers.size() + 1; }
+
+    // Run all tasks and return once every one of them finished
+    void run(std::vector<std::function<void()>> &tasks);
+
+  private:
+    void work();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> queue;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stop;
+};
+
 class btree {
   private:
     int height;
     char *root;
     PIE::Allocator *allocator;
+    std::mutex smo_mtx; // serializes merges and redistributions
+    // odd while a rebalance runs, bumped twice by each one
+    std::atomic<uint64_t> smo_seq{0};
+    scan_pool *pool;    // nullptr unless FASTFAIR_SCAN_THREADS > 1
+
+    page *scan_leaf(const entry_key_t &, leaf_prefetcher *);
+    uint64_t smo_begin();
+    bool smo_since(uint64_t);
+    void scan_boundaries(const entry_key_t &, const entry_key_t &, int,
+                         std::vector<entry_key_t> *);
 
   public:
     btree(PIE::Allocator *);
+    ~btree();
     void setNewRoot(char *);
     void getNumberOfNodes();
     status_code_t btree_insert(const entry_key_t &, char *);
     void btree_insert_internal(char *, const entry_key_t &, char *, uint32_t);
     status_code_t btree_delete(const entry_key_t &);
-    void btree_delete_internal(const entry_key_t &, char *, uint32_t,
-                               entry_key_t *, bool *, page **);
-    char *btree_search(const entry_key_t &);
+    void rebalance(page *, const entry_key_t &);
+    page *rebalance_page(page *, const entry_key_t &);
+    status_code_t btree_update(const entry_key_t &, char *);
+    status_code_t btree_upsert(const entry_key_t &, char *);
+    status_code_t btree_search(const entry_key_t &, char **);
     status_code_t btree_search_range(const entry_key_t &, const entry_key_t &,
                                      void **);
+    status_code_t btree_search_count(const entry_key_t &, size_t, void **);
+    template <typename Source>
+    status_code_t btree_bulk_load(Source &, double);
+    double fill_factor(size_t *, size_t *);
+    void recover_locks();
     void printAll();
 
     friend class page;
@@ -125,10 +290,11 @@ class header {
     uint8_t switch_counter; // 1 bytes
     uint8_t is_deleted;     // 1 bytes
     int16_t last_index;     // 2 bytes
-    std::mutex *mtx;        // 8 bytes
+    uint64_t version;       // 8 bytes, odd while a writer holds the page
 
     friend class page;
     friend class btree;
+    friend class leaf_prefetcher;
 
   public:
     header() {
@@ -136,21 +302,43 @@ class header {
     }
 
     void init() {
-        mtx = new std::mutex();
-
         leftmost_ptr = nullptr;
         sibling_ptr = nullptr;
         switch_counter = 0;
         last_index = -1;
         is_deleted = false;
+        version = 0;
     }
 
-    ~header() { delete mtx; }
+    // Writers serialize on the version word embedded in the page, thus no
+    // DRAM object is referenced from persistent memory. Readers never touch
+    // it and keep validating their reads with switch_counter. The word is
+    // never flushed, but a cache line written back before a crash may still
+    // persist it odd, btree::recover_locks() has to run before a reopened
+    // tree is written, once there is a path that reopens one
+    void lock() {
+        uint64_t v;
+        while (true) {
+            v = __atomic_load_n(&version, __ATOMIC_ACQUIRE);
+            if (!(v & 1) &&
+                __atomic_compare_exchange_n(&version, &v, v + 1, false,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                return;
+            }
+            asm volatile("pause" ::: "memory");
+        }
+    }
+
+    void unlock() { __atomic_add_fetch(&version, 1, __ATOMIC_RELEASE); }
+
+    // Release a lock whose holder did not survive a restart
+    void reset_lock() { version &= ~1ULL; }
 };
 
 class entry {
   private:
-    entry_key_t key; // 8 bytes
+    entry_key_t key; // 8 bytes, 16 bytes with STRINGKEY
     char *ptr;       // 8 bytes
 
   public:
@@ -158,15 +346,27 @@ class entry {
 
     friend class page;
     friend class btree;
+    friend class leaf_prefetcher;
 };
 
 const int cardinality = (PAGESIZE - sizeof(header)) / sizeof(entry);
+
+// A non-root page with fewer entries after a delete is merged with or
+// borrows entries from its neighbour
+const int min_entries = (cardinality - 1) / 2;
+
+static_assert(PAGESIZE % CACHE_LINE_SIZE == 0,
+              "FAST-FAIR page size must be a multiple of cache line size");
+#ifdef FASTFAIR_SIMD_SEARCH
+static_assert(cardinality <= 64 && cardinality % 2 == 0,
+              "SIMD search keeps one bit per slot in a 64-bit mask");
+#endif
 // const int count_in_line = CACHE_LINE_SIZE / sizeof(entry);
 
 class page {
   private:
     header hdr;                 // header in persistent memory, 16 bytes
-    entry records[cardinality]; // slots in persistent memory, 16 bytes * n
+    entry records[cardinality]; // slots in persistent memory, sizeof(entry) * n
 
     page *new_page(PIE::Allocator *allocator, uint32_t level = 0) {
         page *p = (page *)allocator->Allocate(sizeof(page));
@@ -183,12 +383,17 @@ class page {
 
   public:
     friend class btree;
+    friend class leaf_prefetcher;
 
     void init(uint32_t level = 0) {
         hdr.init();        
         hdr.level = level;
         for (int i = 0; i < cardinality; i++) {
+#ifdef STRINGKEY
             records[i].key.Nullify();
+#else
+            records[i].key = 0;
+#endif
             records[i].ptr = nullptr;
         }
         records[0].ptr = nullptr;
@@ -200,7 +405,11 @@ class page {
         hdr.leftmost_ptr = left;
         hdr.level = level;
         for (int i = 0; i < cardinality; i++) {
+#ifdef STRINGKEY
             records[i].key.Nullify();
+#else
+            records[i].key = 0;
+#endif
             records[i].ptr = nullptr;
         }
         records[0].key = key;
@@ -287,33 +496,64 @@ class page {
         return shift;
     }
 
-    bool remove(btree *bt, const entry_key_t &key, bool only_rebalance = false,
-                bool with_lock = true) {
-        hdr.mtx->lock();
-        UNUSED(bt);
-        UNUSED(only_rebalance);
-        UNUSED(with_lock);
-        bool ret = remove_key(key);
-
-        hdr.mtx->unlock();
-
+    // Remove key from this page, fails if the key is not (or no longer) here
+    // or the page has been merged into its left neighbour
+    bool remove(const entry_key_t &key, bool with_lock = true) {
+        if (with_lock) {
+            hdr.lock();
+        }
+        bool ret = !hdr.is_deleted && remove_key(key);
+        if (with_lock) {
+            hdr.unlock();
+        }
         return ret;
     }
 
-    /*
-     * Although we implemented the rebalancing of B+-Tree, it is currently
-     * blocked for the performance. Please refer to the follow. Chi, P., Lee, W.
-     * C., & Xie, Y. (2014, August). Making B+-tree efficient in PCM-based main
-     * memory. In Proceedings of the 2014 international symposium on Low power
-     * electronics and design (pp. 69-74). ACM.
-     *
-     * PIE: since this function is never called, we remove it for clear code
-     */
-    /*
-      bool remove_rebalancing(btree *bt, entry_key_t key, bool only_rebalance =
-      false, bool with_lock = true) {
-      }
-    */
+    // Return the slot index of key in this page, or -1 if it does not exist.
+    // Only used by writers holding the page lock, so no switch_counter
+    // validation is needed here
+    inline int find_key(const entry_key_t &key) {
+        for (int i = 0; records[i].ptr != nullptr; ++i) {
+            if (records[i].key == key) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Replace the value of an existing key in place. The 8B pointer store is
+    // failure-atomic, thus flushing the entry once is enough
+    status_code_t update(const entry_key_t &key, char *ptr,
+                         bool with_lock = true) {
+        if (with_lock) {
+            hdr.lock();
+        }
+        if (hdr.is_deleted) {
+            if (with_lock) {
+                hdr.unlock();
+            }
+            return kFailed;
+        }
+
+        // The key may have been moved to the sibling by a concurrent split
+        if (hdr.sibling_ptr && key >= hdr.sibling_ptr->records[0].key) {
+            if (with_lock) {
+                hdr.unlock();
+            }
+            return hdr.sibling_ptr->update(key, ptr, with_lock);
+        }
+
+        int i = find_key(key);
+        if (i >= 0) {
+            records[i].ptr = ptr;
+            clflush((char *)&records[i].ptr, sizeof(char *));
+        }
+
+        if (with_lock) {
+            hdr.unlock();
+        }
+        return (i >= 0) ? kOk : kNotFound;
+    }
 
     inline void insert_key(const entry_key_t &key, char *ptr, int *num_entries,
                            bool flush = true, bool update_last_index = true) {
@@ -407,16 +647,18 @@ class page {
     }
 
     // Insert a new key - FAST and FAIR
+    // If upsert is set and key already exists in this leaf, its value is
+    // swapped in place instead while still holding the write lock
     page *store(PIE::Allocator *allocator, btree *bt, char *left,
                 const entry_key_t &key, char *right, bool flush, bool with_lock,
-                page *invalid_sibling = nullptr) {
+                page *invalid_sibling = nullptr, bool upsert = false) {
         UNUSED(left);
         if (with_lock) {
-            hdr.mtx->lock(); // Lock the write lock
+            hdr.lock(); // Lock the write lock
         }
         if (hdr.is_deleted) {
             if (with_lock) {
-                hdr.mtx->unlock();
+                hdr.unlock();
             }
 
             return nullptr;
@@ -427,11 +669,23 @@ class page {
             // Compare this key with the first key of the sibling
             if (key > hdr.sibling_ptr->records[0].key) {
                 if (with_lock) {
-                    hdr.mtx->unlock(); // Unlock the write lock
+                    hdr.unlock(); // Unlock the write lock
                 }
                 return hdr.sibling_ptr->store(allocator, bt, nullptr, key,
                                               right, true, with_lock,
-                                              invalid_sibling);
+                                              invalid_sibling, upsert);
+            }
+        }
+
+        if (upsert && hdr.leftmost_ptr == nullptr) {
+            int i = find_key(key);
+            if (i >= 0) {
+                records[i].ptr = right;
+                clflush((char *)&records[i].ptr, sizeof(char *));
+                if (with_lock) {
+                    hdr.unlock();
+                }
+                return this;
             }
         }
 
@@ -442,7 +696,7 @@ class page {
             insert_key(key, right, &num_entries, flush);
 
             if (with_lock) {
-                hdr.mtx->unlock(); // Unlock the write lock
+                hdr.unlock(); // Unlock the write lock
             }
 
             return this;
@@ -511,11 +765,11 @@ class page {
                 bt->setNewRoot((char *)new_root);
 
                 if (with_lock) {
-                    hdr.mtx->unlock(); // Unlock the write lock
+                    hdr.unlock(); // Unlock the write lock
                 }
             } else {
                 if (with_lock) {
-                    hdr.mtx->unlock(); // Unlock the write lock
+                    hdr.unlock(); // Unlock the write lock
                 }
                 bt->btree_insert_internal(nullptr, split_key, (char *)sibling,
                                           hdr.level + 1);
@@ -525,107 +779,391 @@ class page {
         }
     }
 
-    // Search keys with linear search
+    // Issue a prefetch for every cache line of this page
+    void prefetch() const {
+        for (int i = 0; i < PAGESIZE; i += CACHE_LINE_SIZE) {
+            __builtin_prefetch((const char *)this + i);
+        }
+    }
+
+    // Copy values of the keys of this leaf within [min, max) to buf in key
+    // order and return their number. *end is set if a key no smaller than
+    // max is met, the scan does not need to go on to the sibling
+    int collect_range(const entry_key_t &min, const entry_key_t &max,
+                      char **buf, bool *end) {
+        uint8_t previous_switch_counter;
+        int n;
+        do {
+            previous_switch_counter = hdr.switch_counter;
+            n = 0;
+            *end = false;
+
+            entry_key_t tmp_key;
+            char *tmp_ptr;
+
+            if (IS_FORWARD(previous_switch_counter)) {
+                bool past_min = false;
+                for (int i = 0; records[i].ptr != nullptr; ++i) {
+#ifdef STRINGKEY
+                    tmp_key.BorrowFrom(records[i].key);
+#else
+                    tmp_key = records[i].key;
+#endif
+                    if (tmp_key >= max) {
+                        *end = true;
+                        break;
+                    }
+                    // keys are sorted, no need to compare after the first
+                    // one within range
+                    if (!past_min && tmp_key < min) {
+                        continue;
+                    }
+                    past_min = true;
+                    tmp_ptr = records[i].ptr;
+                    if (i > 0 && tmp_ptr == records[i - 1].ptr) {
+                        continue;
+                    }
+                    if (tmp_ptr && tmp_key == records[i].key) {
+                        buf[n++] = tmp_ptr;
+                    }
+                }
+            } else {
+                for (int i = count() - 1; i >= 0; --i) {
+#ifdef STRINGKEY
+                    tmp_key.BorrowFrom(records[i].key);
+#else
+                    tmp_key = records[i].key;
+#endif
+                    if (tmp_key >= max) {
+                        *end = true;
+                        continue;
+                    }
+                    if (tmp_key < min) {
+                        continue;
+                    }
+                    tmp_ptr = records[i].ptr;
+                    if (i > 0 && tmp_ptr == records[i - 1].ptr) {
+                        continue;
+                    }
+                    if (tmp_ptr && tmp_key == records[i].key) {
+                        buf[n++] = tmp_ptr;
+                    }
+                }
+                // collected from right to left, restore key order
+                std::reverse(buf, buf + n);
+            }
+        } while (previous_switch_counter != hdr.switch_counter);
+        return n;
+    }
+
+    // Append keys of this internal page within (min, max) to keys, in no
+    // particular order. Return true if a key no smaller than max is met
+    bool collect_separators(const entry_key_t &min, const entry_key_t &max,
+                            std::vector<entry_key_t> *keys) {
+        uint8_t previous_switch_counter;
+        size_t old_size = keys->size();
+        bool end;
+        do {
+            previous_switch_counter = hdr.switch_counter;
+            keys->resize(old_size);
+            end = false;
+
+            entry_key_t tmp_key;
+            for (int i = 0; i < cardinality && records[i].ptr != nullptr;
+                 ++i) {
+#ifdef STRINGKEY
+                tmp_key.BorrowFrom(records[i].key);
+#else
+                tmp_key = records[i].key;
+#endif
+                if (tmp_key >= max) {
+                    end = true;
+                } else if (tmp_key > min && tmp_key == records[i].key) {
+                    keys->push_back(tmp_key);
+                }
+            }
+        } while (previous_switch_counter != hdr.switch_counter);
+        return end;
+    }
+
+    // Pass values of the keys within [min, max) to out(values, n) one leaf
+    // at a time, walking the leaf chain from this page
+    template <typename Out>
     void linear_search_range(const entry_key_t &min, const entry_key_t &max,
-                             void **buf) {
-        int i, off = 0;
+                             leaf_prefetcher *pf, Out &&out) {
+        char *local[cardinality];
+        bool end = false;
+        page *current = this;
+
+        while (current && !end) {
+            pf->step(current);
+            int n = current->collect_range(min, max, local, &end);
+            out(local, n);
+            current = current->hdr.sibling_ptr;
+        }
+    }
+
+    // Collect values of the first "count" keys that are no smaller than min,
+    // walking the leaf chain from this page. Values are placed in key order;
+    // return the number of collected values
+    size_t linear_search_count(const entry_key_t &min, size_t count,
+                               leaf_prefetcher *pf, void **buf) {
+        char *local[cardinality];
+        size_t off = 0;
         uint8_t previous_switch_counter;
         page *current = this;
 
-        while (current) {
-            int old_off = off;
+        while (current && off < count) {
+            int n;
+            pf->step(current);
             do {
                 previous_switch_counter = current->hdr.switch_counter;
-                off = old_off;
+                n = 0;
 
                 entry_key_t tmp_key;
                 char *tmp_ptr;
 
                 if (IS_FORWARD(previous_switch_counter)) {
+                    for (int i = 0; current->records[i].ptr != nullptr; ++i) {
 #ifdef STRINGKEY
-                    if ((tmp_key.BorrowFrom(current->records[0].key)) > min) {
-#else
-                    if ((tmp_key = current->records[0].key) > min) {
-#endif
-                        if (tmp_key < max) {
-                            if ((tmp_ptr = current->records[0].ptr) !=
-                                nullptr) {
-                                if (tmp_key == current->records[0].key) {
-                                    if (tmp_ptr) {
-                                        buf[off++] = (void *)tmp_ptr;
-                                    }
-                                }
-                            }
-                        } else
-                            return;
-                    }
-
-                    for (i = 1; current->records[i].ptr != nullptr; ++i) {
-#ifdef STRINGKEY
-                        if ((tmp_key.BorrowFrom(current->records[i].key)) >
+                        if ((tmp_key.BorrowFrom(current->records[i].key)) >=
                             min) {
 #else
-                        if ((tmp_key = current->records[i].key) > min) {
+                        if ((tmp_key = current->records[i].key) >= min) {
 #endif
-                            if (tmp_key < max) {
-                                if ((tmp_ptr = current->records[i].ptr) !=
-                                    current->records[i - 1].ptr) {
-                                    if (tmp_key == current->records[i].key) {
-                                        if (tmp_ptr)
-                                            buf[off++] = (void *)tmp_ptr;
-                                    }
-                                }
-                            } else
-                                return;
+                            tmp_ptr = current->records[i].ptr;
+                            if (i > 0 && tmp_ptr == current->records[i - 1].ptr) {
+                                continue;
+                            }
+                            if (tmp_ptr && tmp_key == current->records[i].key) {
+                                local[n++] = tmp_ptr;
+                            }
                         }
                     }
                 } else {
-                    for (i = count() - 1; i > 0; --i) {
+                    for (int i = current->count() - 1; i >= 0; --i) {
 #ifdef STRINGKEY
-                        if ((tmp_key.BorrowFrom(current->records[i].key)) >
+                        if ((tmp_key.BorrowFrom(current->records[i].key)) >=
                             min) {
 #else
-                        if ((tmp_key = current->records[i].key) > min) {
+                        if ((tmp_key = current->records[i].key) >= min) {
 #endif
-                            if (tmp_key < max) {
-
-                                if ((tmp_ptr = current->records[i].ptr) !=
-                                    current->records[i - 1].ptr) {
-                                    if (tmp_key == current->records[i].key) {
-                                        if (tmp_ptr)
-                                            buf[off++] = (void *)tmp_ptr;
-                                    }
-                                }
-                            } else
-                                return;
+                            tmp_ptr = current->records[i].ptr;
+                            if (i > 0 && tmp_ptr == current->records[i - 1].ptr) {
+                                continue;
+                            }
+                            if (tmp_ptr && tmp_key == current->records[i].key) {
+                                local[n++] = tmp_ptr;
+                            }
                         }
                     }
+                    // collected from right to left, restore key order
+                    std::reverse(local, local + n);
+                }
+            } while (previous_switch_counter != current->hdr.switch_counter);
 
-#ifdef STRINGKEY
-                    if ((tmp_key.BorrowFrom(current->records[0].key)) > min) {
+            for (int i = 0; i < n && off < count; ++i) {
+                buf[off++] = (void *)local[i];
+            }
+            current = current->hdr.sibling_ptr;
+        }
+        return off;
+    }
+
+#ifdef FASTFAIR_SIMD_SEARCH
+    // Compare key against the slots of this page one cache line at a time
+    // (slot 0 and 1 share the first line with the header, every following
+    // line holds four slots) and stop at the first line that holds a key
+    // greater than key or the nullptr end mark, thus no more lines are
+    // touched than by the scalar search. Bit i of *eq (*gt) is set iff
+    // records[i].key == key (> key), as keys are sorted only the last two
+    // lines are checked for equality. *num is the index of the end mark, or
+    // the number of scanned slots if it is not met
+    inline void key_mask(int64_t key, uint64_t *eq, uint64_t *gt, int *num) {
+        int i = 0, prev = 0, step = 2;
+        uint64_t ce, cg, cz, pe;
+#ifdef __AVX512F__
+        // even lanes hold keys and odd lanes hold ptrs
+        auto slot_bits = [](uint64_t m) {
+            return (m & 1) | ((m >> 1) & 2) | ((m >> 2) & 4) | ((m >> 3) & 8);
+        };
+        const __m512i k = _mm512_set1_epi64(key);
+        const __m512i zero = _mm512_setzero_si512();
+        __mmask8 ld = 0x0F, pld = 0;
+        __m512i v, pv = zero;
+        while (true) {
+            v = _mm512_maskz_loadu_epi64(ld, &records[i]);
+            if ((_mm512_mask_cmpgt_epi64_mask(ld & 0x55, v, k) |
+                 _mm512_mask_cmpeq_epi64_mask(ld & 0xAA, v, zero)) ||
+                i + step >= cardinality) {
+                break;
+            }
+            pv = v;
+            pld = ld;
+            prev = i;
+            i += step;
+            step = 4;
+            ld = 0xFF;
+        }
+        ce = slot_bits(_mm512_mask_cmpeq_epi64_mask(ld & 0x55, v, k));
+        cg = slot_bits(_mm512_mask_cmpgt_epi64_mask(ld & 0x55, v, k));
+        cz = slot_bits(_mm512_mask_cmpeq_epi64_mask(ld & 0xAA, v, zero) >> 1);
+        pe = slot_bits(_mm512_mask_cmpeq_epi64_mask(pld & 0x55, pv, k));
 #else
-                    if ((tmp_key = current->records[0].key) > min) {
+        // unpacked lanes are ordered as slot 0, 2, 1, 3
+        auto slot_bits = [](uint64_t m) {
+            return (m & 9) | ((m & 2) << 1) | ((m & 4) >> 1);
+        };
+        const __m256i k = _mm256_set1_epi64x(key);
+        const __m256i zero = _mm256_setzero_si256();
+        // stands for slot 2 and 3 in the first line, neither greater than
+        // any key nor an end mark
+        const __m256i pad = _mm256_set_epi64x(-1, INT64_MIN, -1, INT64_MIN);
+        __m256i keys, ptrs, pkeys = pad;
+        while (true) {
+            __m256i v0 = _mm256_loadu_si256((const __m256i *)&records[i]);
+            __m256i v1 =
+                (step == 4)
+                    ? _mm256_loadu_si256((const __m256i *)&records[i + 2])
+                    : pad;
+            keys = _mm256_unpacklo_epi64(v0, v1);
+            ptrs = _mm256_unpackhi_epi64(v0, v1);
+            __m256i stop = _mm256_or_si256(_mm256_cmpgt_epi64(keys, k),
+                                           _mm256_cmpeq_epi64(ptrs, zero));
+            if (!_mm256_testz_si256(stop, stop) || i + step >= cardinality) {
+                break;
+            }
+            pkeys = keys;
+            prev = i;
+            i += step;
+            step = 4;
+        }
+        ce = slot_bits(_mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpeq_epi64(keys, k))));
+        cg = slot_bits(_mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(keys, k))));
+        cz = slot_bits(_mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpeq_epi64(ptrs, zero))));
+        pe = slot_bits(_mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpeq_epi64(pkeys, k))));
 #endif
-                        if (tmp_key < max) {
-                            if ((tmp_ptr = current->records[0].ptr) !=
-                                nullptr) {
-                                if (tmp_key == current->records[0].key) {
-                                    if (tmp_ptr) {
-                                        buf[off++] = (void *)tmp_ptr;
-                                    }
-                                }
-                            }
-                        } else
-                            return;
+        uint64_t lane = (1ULL << step) - 1;
+        *num = (cz & lane) ? i + __builtin_ctzll(cz & lane) : i + step;
+        uint64_t valid = (1ULL << *num) - 1;
+        *eq = (((ce & lane) << i) | (pe << prev)) & valid;
+        *gt = ((cg & lane) << i) & valid;
+    }
+
+    // SIMD version of linear_search. Keys of a page stay sorted even in the
+    // middle of a FAST shift (a shifted slot is a duplicate of its neighbor),
+    // so only the slots up to the first greater key need to be compared.
+    // Candidates are visited in the current search direction and pass the
+    // same duplicated-ptr check as the scalar version. Return nullptr and
+    // set *done to false if no internal candidate passes the check
+    char *linear_search_simd(const entry_key_t &key, bool *done,
+                             bool *to_sibling) {
+        uint8_t previous_switch_counter;
+        char *ret = nullptr;
+        char *t;
+        uint64_t eq, gt;
+        int num;
+
+        *done = true;
+        if (hdr.leftmost_ptr == nullptr) { // Search a leaf node
+            do {
+                previous_switch_counter = hdr.switch_counter;
+                ret = nullptr;
+                *to_sibling = false;
+
+                key_mask(key, &eq, &gt, &num);
+                while (eq) {
+                    int i = IS_FORWARD(previous_switch_counter)
+                                ? __builtin_ctzll(eq)
+                                : 63 - __builtin_clzll(eq);
+                    eq &= ~(1ULL << i);
+
+                    t = records[i].ptr;
+                    if (t != nullptr && (i == 0 || records[i - 1].ptr != t) &&
+                        records[i].key == key) {
+                        ret = t;
+                        break;
                     }
                 }
-            } while (previous_switch_counter != current->hdr.switch_counter);
 
-            current = current->hdr.sibling_ptr;
+                if (!ret && (t = (char *)hdr.sibling_ptr) &&
+                    key >= ((page *)t)->records[0].key) {
+                    ret = t;
+                    *to_sibling = true;
+                }
+            } while (hdr.switch_counter != previous_switch_counter);
+
+            return ret;
+        } else { // internal node
+            do {
+                previous_switch_counter = hdr.switch_counter;
+                ret = nullptr;
+
+                key_mask(key, &eq, &gt, &num);
+                if (IS_FORWARD(previous_switch_counter)) {
+                    // child on the left of the first key greater than key
+                    if (gt == 0 && num > 0) {
+                        ret = records[num - 1].ptr;
+                    }
+                    while (gt) {
+                        int i = __builtin_ctzll(gt);
+                        gt &= gt - 1;
+                        t = (i == 0) ? (char *)hdr.leftmost_ptr
+                                     : records[i - 1].ptr;
+                        if (t != records[i].ptr) {
+                            ret = t;
+                            break;
+                        }
+                    }
+                } else {
+                    // child of the last key no greater than key
+                    uint64_t le = ~gt & ((1ULL << num) - 1);
+                    while (le) {
+                        int i = 63 - __builtin_clzll(le);
+                        le &= ~(1ULL << i);
+                        t = records[i].ptr;
+                        if (((i == 0) ? (char *)hdr.leftmost_ptr
+                                      : records[i - 1].ptr) != t) {
+                            ret = t;
+                            break;
+                        }
+                    }
+                }
+            } while (hdr.switch_counter != previous_switch_counter);
+
+            if ((t = (char *)hdr.sibling_ptr) != nullptr) {
+                if (key >= ((page *)t)->records[0].key)
+                    return t;
+            }
+
+            *done = (ret != nullptr);
+            return ret;
         }
     }
+#endif
 
-    char *linear_search(const entry_key_t &key) {
+    // Search a leaf for the value of key or the child of an internal page
+    // to descend to. Either may be the sibling page when key is moved there,
+    // for a leaf this is reported through "to_sibling". The sibling check of
+    // a leaf is validated by switch_counter as well, so a reader that scanned
+    // the page before entries were merged into it does not follow a sibling
+    // pointer that already skips them.
+    char *linear_search(const entry_key_t &key, bool *to_sibling = nullptr) {
+        bool sibling;
+        if (!to_sibling) {
+            to_sibling = &sibling;
+        }
+#ifdef FASTFAIR_SIMD_SEARCH
+        bool done;
+        char *simd_ret = linear_search_simd(key, &done, to_sibling);
+        if (done) {
+            return simd_ret;
+        }
+#endif
         int i = 1;
         uint8_t previous_switch_counter;
         char *ret = nullptr;
@@ -636,6 +1174,7 @@ class page {
             do {
                 previous_switch_counter = hdr.switch_counter;
                 ret = nullptr;
+                *to_sibling = false;
 
                 // search from left ro right
                 if (IS_FORWARD(previous_switch_counter)) {
@@ -698,17 +1237,15 @@ class page {
                         }
                     }
                 }
-            } while (hdr.switch_counter != previous_switch_counter);
 
-            if (ret) {
-                return ret;
-            }
-
-            if ((t = (char *)hdr.sibling_ptr) &&
-                key >= ((page *)t)->records[0].key)
-                return t;
+                if (!ret && (t = (char *)hdr.sibling_ptr) &&
+                    key >= ((page *)t)->records[0].key) {
+                    ret = t;
+                    *to_sibling = true;
+                }
+            } while (hdr.switch_counter != previous_switch_counter);
 
-            return nullptr;
+            return ret;
         } else { // internal node
             do {
                 previous_switch_counter = hdr.switch_counter;
@@ -802,7 +1339,8 @@ class page {
 
         for (int i = 0; records[i].ptr != nullptr; ++i)
 #ifdef STRINGKEY
-            printf("%s,%p", records[i].key.Data(), records[i].ptr);
+            printf("%.*s,%p ", (int)records[i].key.Length(),
+                   records[i].key.Data(), records[i].ptr);
 #else
             printf("%ld,%p ", records[i].key, records[i].ptr);
 #endif
@@ -827,6 +1365,142 @@ class page {
     }
 };
 
+/*
+ * class leaf_prefetcher
+ */
+void leaf_prefetcher::start(page *parent, page *leaf) {
+    // leaf is read right away and counts as requested
+    ahead = leaf;
+    distance = 1;
+
+    int i = -1;
+    if (parent->hdr.leftmost_ptr != leaf) {
+        for (i = 0; i < cardinality && parent->records[i].ptr != (char *)leaf;
+             ++i) {
+            if (parent->records[i].ptr == nullptr) {
+                // leaf was reached through the sibling of parent
+                return;
+            }
+        }
+        if (i == cardinality) {
+            return;
+        }
+    }
+
+    for (++i; i < cardinality && distance <= FASTFAIR_SCAN_PREFETCH; ++i) {
+        page *p = (page *)parent->records[i].ptr;
+        if (p == nullptr) {
+            break;
+        }
+        if (p != ahead) {
+            p->prefetch();
+            ahead = p;
+            ++distance;
+        }
+    }
+}
+
+void leaf_prefetcher::step(page *current) {
+    if (distance > 0) {
+        --distance;
+    } else {
+        ahead = current;
+    }
+
+    // One page per step keeps the distance, a second one makes up for pages
+    // the parent did not provide
+    for (int hops = 0; hops < 2 && distance < FASTFAIR_SCAN_PREFETCH;
+         ++hops) {
+        page *next = ahead->hdr.sibling_ptr;
+        if (next == nullptr) {
+            break;
+        }
+        next->prefetch();
+        ahead = next;
+        ++distance;
+    }
+}
+
+/*
+ * class scan_pool
+ */
+scan_pool::scan_pool(int num_workers) : stop(false) {
+    for (int i = 0; i < num_workers; ++i) {
+        workers.emplace_back(&scan_pool::work, this);
+    }
+}
+
+scan_pool::~scan_pool() {
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        stop = true;
+    }
+    cv.notify_all();
+    for (auto &t : workers) {
+        t.join();
+    }
+}
+
+void scan_pool::work() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            cv.wait(lk, [this] { return stop || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            task = std::move(queue.front());
+            queue.pop_front();
+        }
+        task();
+    }
+}
+
+void scan_pool::run(std::vector<std::function<void()>> &tasks) {
+    std::mutex done_mtx;
+    std::condition_variable done_cv;
+    size_t left = tasks.size();
+
+    auto finish = [&] {
+        std::lock_guard<std::mutex> lk(done_mtx);
+        if (--left == 0) {
+            done_cv.notify_one();
+        }
+    };
+
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        for (size_t i = 1; i < tasks.size(); ++i) {
+            queue.emplace_back([&, i] {
+                tasks[i]();
+                finish();
+            });
+        }
+    }
+    cv.notify_all();
+
+    tasks[0]();
+    finish();
+
+    // Help with queued partitions instead of waiting for busy workers
+    while (true) {
+        std::function<void()> task;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (queue.empty()) {
+                break;
+            }
+            task = std::move(queue.front());
+            queue.pop_front();
+        }
+        task();
+    }
+
+    std::unique_lock<std::mutex> lk(done_mtx);
+    done_cv.wait(lk, [&] { return left == 0; });
+}
+
 /*
  * class btree
  */
@@ -836,39 +1510,61 @@ btree::btree(PIE::Allocator *all) {
     root = (char *)p;
     height = 1;
     allocator = all;
+    pool = FASTFAIR_SCAN_THREADS > 1 ? new scan_pool(FASTFAIR_SCAN_THREADS - 1)
+                                     : nullptr;
 }
 
+btree::~btree() { delete pool; }
+
 void btree::setNewRoot(char *new_root) {
     this->root = (char *)new_root;
     clflush((char *)&(this->root), sizeof(char *));
     ++height;
 }
 
-char *btree::btree_search(const entry_key_t &key) {
-    page *p = (page *)root;
-
-    while (p->hdr.leftmost_ptr != nullptr) {
-        p = (page *)p->linear_search(key);
+// Wait until no rebalance runs and return the sequence number to pass to
+// smo_since()
+uint64_t btree::smo_begin() {
+    uint64_t seq;
+    while ((seq = smo_seq.load(std::memory_order_acquire)) & 1) {
+        asm volatile("pause" ::: "memory");
     }
+    return seq;
+}
 
-    page *t;
-    while ((t = (page *)p->linear_search(key)) == p->hdr.sibling_ptr) {
-        p = t;
-        if (!p) {
-            break;
+// Whether a rebalance ran since smo_begin() returned "seq". Merges and
+// redistributions move entries between pages, thus a lookup that overlaps
+// one may miss its key and has to be retried before it reports kNotFound
+bool btree::smo_since(uint64_t seq) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return smo_seq.load(std::memory_order_acquire) != seq;
+}
+
+// search the value of key, "value" is only written when the key is found
+status_code_t btree::btree_search(const entry_key_t &key, char **value) {
+    while (true) {
+        uint64_t seq = smo_begin();
+        page *p = (page *)root;
+
+        while (p->hdr.leftmost_ptr != nullptr) {
+            p = (page *)p->linear_search(key);
         }
-    }
 
-    if (!t) {
-#ifdef STRINGKEY
-        printf("NOT FOUND %s, t = %p\n", key.Data(), t);
-#else
-        printf("NOT FOUND %lu, t = %p\n", key, t);
-#endif
-        return nullptr;
-    }
+        page *t;
+        bool to_sibling;
+        while ((t = (page *)p->linear_search(key, &to_sibling)) &&
+               to_sibling) {
+            p = t;
+        }
 
-    return (char *)t;
+        if (t) {
+            *value = (char *)t;
+            return kOk;
+        }
+        if (!smo_since(seq)) {
+            return kNotFound;
+        }
+    }
 }
 
 // insert the key in the leaf node
@@ -890,6 +1586,39 @@ status_code_t btree::btree_insert(const entry_key_t &key,
     return kOk;
 }
 
+// update the value of an existing key in the leaf node
+status_code_t btree::btree_update(const entry_key_t &key, char *right) {
+    while (true) {
+        uint64_t seq = smo_begin();
+        page *p = (page *)root;
+
+        while (p->hdr.leftmost_ptr != nullptr) {
+            p = (page *)p->linear_search(key);
+        }
+
+        // kFailed: the leaf is deleted, retry from the root
+        status_code_t ret = p->update(key, right);
+        if (ret == kOk || (ret == kNotFound && !smo_since(seq))) {
+            return ret;
+        }
+    }
+}
+
+// update the key if it exists, otherwise insert it, all under the leaf lock
+status_code_t btree::btree_upsert(const entry_key_t &key, char *right) {
+    page *p = (page *)root;
+
+    while (p->hdr.leftmost_ptr != nullptr) {
+        p = (page *)p->linear_search(key);
+    }
+
+    if (!p->store(allocator, this, nullptr, key, right, true, true, nullptr,
+                  true)) {
+        return btree_upsert(key, right);
+    }
+    return kOk;
+}
+
 // store the key into the node at the given level
 void btree::btree_insert_internal(char *left, const entry_key_t &key,
                                   char *right, uint32_t level) {
@@ -907,95 +1636,572 @@ void btree::btree_insert_internal(char *left, const entry_key_t &key,
 }
 
 status_code_t btree::btree_delete(const entry_key_t &key) {
-    page *p = (page *)root;
+    page *p;
+    while (true) {
+        uint64_t seq = smo_begin();
+        p = (page *)root;
 
-    while (p->hdr.leftmost_ptr != nullptr) {
-        p = (page *)p->linear_search(key);
-    }
+        while (p->hdr.leftmost_ptr != nullptr) {
+            p = (page *)p->linear_search(key);
+        }
 
-    page *t;
-    while ((t = (page *)p->linear_search(key)) == p->hdr.sibling_ptr) {
-        p = t;
-        if (!p)
+        page *t;
+        bool to_sibling;
+        while ((t = (page *)p->linear_search(key, &to_sibling)) &&
+               to_sibling) {
+            p = t;
+        }
+
+        // linear_search returns nullptr only if the key is in none of the
+        // leaves, or was passed while a rebalance moved it
+        if (!t) {
+            if (!smo_since(seq)) {
+                return kNotFound;
+            }
+            continue;
+        }
+
+        // otherwise the key is moved by a concurrent split or merge, retry
+        if (p->remove(key)) {
             break;
+        }
     }
 
-    if (p) {
-        if (!p->remove(this, key)) {
-            btree_delete(key);
+    if ((char *)p != root && p->count() < min_entries) {
+        rebalance(p, key);
+    }
+    return kOk;
+}
+
+// Merge or redistribute the underfull page "p" and continue with its parent
+// while that one becomes underfull. "key" is a key in the range of "p" and
+// is used to find the parents. Rebalancing is serialized by smo_mtx, so it
+// may hold the parent and two neighbours at once while every other writer
+// locks a single page at a time.
+void btree::rebalance(page *p, const entry_key_t &key) {
+    std::lock_guard<std::mutex> guard(smo_mtx);
+    smo_seq.fetch_add(1, std::memory_order_acq_rel);
+    while (p) {
+        p = rebalance_page(p, key);
+    }
+    smo_seq.fetch_add(1, std::memory_order_release);
+}
+
+// FAIR order of a rebalance between two neighbours "left" and "right":
+// 1. the parent entry of "right" is removed, its range is then reached by
+//    the sibling pointer of "left" as after the first step of a split
+// 2. entries are copied to their new page, so a key is always present in a
+//    page reachable from "left", and a crash at most leaves duplicates
+// 3. the emptied part is cut off (merge: "right" is unlinked from "left"
+//    and then marked deleted, borrow: the tail of "left" is cut or "right"
+//    is replaced by a new page and then marked deleted)
+// 4. the separator of the new right page is inserted into the parent
+// Pages taken out of the tree are only marked deleted, readers may still
+// traverse them and writers retry from the root when they land on one.
+// Returns the parent if it is underfull after a merge.
+page *btree::rebalance_page(page *p, const entry_key_t &key) {
+    if ((char *)p == root || p->hdr.is_deleted ||
+        p->count() >= min_entries) {
+        return nullptr;
+    }
+
+    page *parent = (page *)root;
+    if (parent->hdr.level <= p->hdr.level) {
+        return nullptr;
+    }
+    while (parent->hdr.level > p->hdr.level + 1) {
+        parent = (page *)parent->linear_search(key);
+    }
+    while (parent->hdr.sibling_ptr &&
+           key >= parent->hdr.sibling_ptr->records[0].key) {
+        parent = parent->hdr.sibling_ptr;
+    }
+
+    parent->hdr.lock();
+    int parent_num = parent->count();
+    int slot = -1; // slot of "right" in parent
+    page *left = nullptr, *right = nullptr;
+    if (parent->hdr.is_deleted) {
+        // fall through
+    } else if (parent->hdr.leftmost_ptr == p) {
+        if (parent_num > 0) {
+            slot = 0;
+            left = p;
+            right = (page *)parent->records[0].ptr;
         }
-        return kOk;
     } else {
-#ifdef STRINGKEY
-        printf("not found the key to delete %s\n", key.Data());
-#else
-        printf("not found the key to delete %lu\n", key);
-#endif
+        for (int i = 0; i < parent_num; ++i) {
+            if (parent->records[i].ptr == (char *)p) {
+                slot = i;
+                left = (i == 0) ? parent->hdr.leftmost_ptr
+                                : (page *)parent->records[i - 1].ptr;
+                right = p;
+                break;
+            }
+        }
+    }
+    if (slot < 0) { // p is moved by a concurrent split, leave it
+        parent->hdr.unlock();
+        return nullptr;
+    }
+
+    left->hdr.lock();
+    right->hdr.lock();
+    if (left->hdr.sibling_ptr != right || left->hdr.is_deleted ||
+        right->hdr.is_deleted || p->count() >= min_entries) {
+        right->hdr.unlock();
+        left->hdr.unlock();
+        parent->hdr.unlock();
+        return nullptr;
     }
-    return kFailed;
+
+    bool is_leaf = (left->hdr.leftmost_ptr == nullptr);
+    int left_num = left->count();
+    int right_num = right->count();
+    // an internal merge also pulls the separator down
+    int total = left_num + right_num + (is_leaf ? 0 : 1);
+    entry_key_t sep_key = parent->records[slot].key;
+    entry_key_t new_sep_key;
+    page *new_right = nullptr;
+
+    parent->remove_key(sep_key);
+    parent_num--;
+
+    if (total <= cardinality - 1) { // merge right into left
+        if (!is_leaf) {
+            left->insert_key(sep_key, (char *)right->hdr.leftmost_ptr,
+                             &left_num);
+        }
+        for (int i = 0; i < right_num; ++i) {
+            left->insert_key(right->records[i].key, right->records[i].ptr,
+                             &left_num);
+        }
+
+        left->hdr.switch_counter += 2; // revalidate readers of left
+        left->hdr.sibling_ptr = right->hdr.sibling_ptr;
+        clflush((char *)&(left->hdr.sibling_ptr), sizeof(page *));
+
+        // Only an unlinked page is marked deleted, a page that is still
+        // reachable after a crash keeps accepting writes
+        right->hdr.is_deleted = 1;
+        clflush((char *)&(right->hdr.is_deleted), sizeof(uint8_t));
+    } else if (left_num > right_num) { // move the tail of left into right
+        // entries kept in left, the separator of an internal page moves up
+        int m = is_leaf ? (total + 1) / 2 : total / 2;
+        if (is_leaf) {
+            for (int i = left_num - 1; i >= m; --i) {
+                right->insert_key(left->records[i].key, left->records[i].ptr,
+                                  &right_num);
+            }
+            new_sep_key = left->records[m].key;
+        } else {
+            right->insert_key(sep_key, (char *)right->hdr.leftmost_ptr,
+                              &right_num);
+            for (int i = left_num - 1; i > m; --i) {
+                right->insert_key(left->records[i].key, left->records[i].ptr,
+                                  &right_num);
+            }
+            new_sep_key = left->records[m].key;
+            right->hdr.leftmost_ptr = (page *)left->records[m].ptr;
+            clflush((char *)&(right->hdr.leftmost_ptr), sizeof(page *));
+        }
+
+        if (IS_FORWARD(left->hdr.switch_counter))
+            left->hdr.switch_counter += 2;
+        else
+            ++left->hdr.switch_counter;
+        left->records[m].ptr = nullptr;
+        clflush((char *)&(left->records[m].ptr), sizeof(char *));
+
+        left->hdr.last_index = m - 1;
+        clflush((char *)&(left->hdr.last_index), sizeof(int16_t));
+        new_right = right;
+    } else { // move the head of right into left, the rest to a new page
+        int m = total / 2; // entries of the new right page
+        int moved = right_num - m;
+        new_right = (page *)allocator->Allocate(sizeof(page));
+        new_right->init(right->hdr.level);
+        new_right->hdr.sibling_ptr = right->hdr.sibling_ptr;
+        int new_num = 0;
+
+        if (is_leaf) {
+            for (int i = moved; i < right_num; ++i) {
+                new_right->insert_key(right->records[i].key,
+                                      right->records[i].ptr, &new_num, false);
+            }
+            new_sep_key = right->records[moved].key;
+        } else {
+            new_right->hdr.leftmost_ptr = (page *)right->records[moved - 1].ptr;
+            for (int i = moved; i < right_num; ++i) {
+                new_right->insert_key(right->records[i].key,
+                                      right->records[i].ptr, &new_num, false);
+            }
+            new_sep_key = right->records[moved - 1].key;
+        }
+        clflush((char *)new_right, sizeof(page));
+
+        if (is_leaf) {
+            for (int i = 0; i < moved; ++i) {
+                left->insert_key(right->records[i].key, right->records[i].ptr,
+                                 &left_num);
+            }
+        } else {
+            left->insert_key(sep_key, (char *)right->hdr.leftmost_ptr,
+                             &left_num);
+            for (int i = 0; i < moved - 1; ++i) {
+                left->insert_key(right->records[i].key, right->records[i].ptr,
+                                 &left_num);
+            }
+        }
+
+        left->hdr.switch_counter += 2; // revalidate readers of left
+        left->hdr.sibling_ptr = new_right;
+        clflush((char *)&(left->hdr.sibling_ptr), sizeof(page *));
+
+        right->hdr.is_deleted = 1;
+        clflush((char *)&(right->hdr.is_deleted), sizeof(uint8_t));
+    }
+
+    if (new_right) {
+        parent->insert_key(new_sep_key, (char *)new_right, &parent_num);
+    }
+
+    // The root is left with a single child, which becomes the new root
+    if ((char *)parent == root && parent_num == 0 &&
+        left->hdr.sibling_ptr == nullptr) {
+        root = (char *)left;
+        clflush((char *)&root, sizeof(char *));
+        --height;
+        parent->hdr.is_deleted = 1;
+        clflush((char *)&(parent->hdr.is_deleted), sizeof(uint8_t));
+    }
+
+    right->hdr.unlock();
+    left->hdr.unlock();
+    parent->hdr.unlock();
+
+    if (!new_right && parent_num < min_entries) {
+        return parent;
+    }
+    return nullptr;
 }
 
-void btree::btree_delete_internal(const entry_key_t &key, char *ptr,
-                                  uint32_t level, entry_key_t *deleted_key,
-                                  bool *is_leftmost_node, page **left_sibling) {
-    if (level > ((page *)this->root)->hdr.level)
-        return;
+// Find the leaf a scan from "min" starts at, the leaves after it are
+// prefetched from its parent
+page *btree::scan_leaf(const entry_key_t &min, leaf_prefetcher *pf) {
+    page *p = (page *)root;
 
-    page *p = (page *)this->root;
+    while (p->hdr.leftmost_ptr != nullptr) {
+        page *child = (page *)p->linear_search(min);
+        if (p->hdr.level == 1) {
+            pf->start(p, child);
+        }
+        p = child;
+    }
+    return p;
+}
 
-    while (p->hdr.level > level) {
-        p = (page *)p->linear_search(key);
+// Pick parts - 1 keys within (min, max) to split a range scan at, in
+// ascending order. They are taken from the highest level that has enough
+// separators within the range, thus every partition but the first and the
+// last spans whole subtrees. Ranges spanning less than
+// scan_parallel_min_leaves leaves are not split and get no keys
+void btree::scan_boundaries(const entry_key_t &min, const entry_key_t &max,
+                            int parts, std::vector<entry_key_t> *bounds) {
+    const size_t scan_parallel_min_leaves = 16;
+    std::vector<entry_key_t> keys;
+    page *p = (page *)root;
+
+    bounds->clear();
+    while (p->hdr.leftmost_ptr != nullptr) {
+        keys.clear();
+        for (page *q = p; q != nullptr; q = q->hdr.sibling_ptr) {
+            if (q->collect_separators(min, max, &keys)) {
+                break;
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        // n separators cover n - 1 whole subtrees of the level below
+        size_t n = keys.size();
+        bool enough = p->hdr.level == 1
+                          ? n + 1 >= std::max(scan_parallel_min_leaves,
+                                              (size_t)parts)
+                          : n >= (size_t)parts;
+        if (enough) {
+            for (int i = 1; i < parts; ++i) {
+                bounds->push_back(keys[i * (n + 1) / parts - 1]);
+            }
+            return;
+        }
+        if (p->hdr.level == 1) {
+            return;
+        }
+        p = (page *)p->linear_search(min);
     }
+}
 
-    p->hdr.mtx->lock();
+// Function to search keys from "min" to "max"
+status_code_t btree::btree_search_range(const entry_key_t &min,
+                                        const entry_key_t &max, void **buf) {
+    std::vector<entry_key_t> bounds;
+    if (pool) {
+        scan_boundaries(min, max, pool->size(), &bounds);
+    }
 
-    if ((char *)p->hdr.leftmost_ptr == ptr) {
-        *is_leftmost_node = true;
-        p->hdr.mtx->unlock();
-        return;
+    if (bounds.empty()) {
+        size_t off = 0;
+        leaf_prefetcher pf;
+        scan_leaf(min, &pf)->linear_search_range(
+            min, max, &pf, [&](char **values, int n) {
+                memcpy(buf + off, values, n * sizeof(char *));
+                off += n;
+            });
+        return kOk;
     }
 
-    *is_leftmost_node = false;
+    // Each partition [lo, hi) is scanned into its own buffer, the results
+    // are concatenated in key order afterwards
+    size_t parts = bounds.size() + 1;
+    std::vector<std::vector<char *>> results(parts);
+    std::vector<std::function<void()>> tasks;
+    for (size_t i = 0; i < parts; ++i) {
+        tasks.emplace_back([&, i] {
+            const entry_key_t &lo = i == 0 ? min : bounds[i - 1];
+            const entry_key_t &hi = i == parts - 1 ? max : bounds[i];
+            leaf_prefetcher pf;
+            scan_leaf(lo, &pf)->linear_search_range(
+                lo, hi, &pf, [&](char **values, int n) {
+                    results[i].insert(results[i].end(), values, values + n);
+                });
+        });
+    }
+    pool->run(tasks);
 
-    for (int i = 0; p->records[i].ptr != nullptr; ++i) {
-        if (p->records[i].ptr == ptr) {
-            if (i == 0) {
-                if ((char *)p->hdr.leftmost_ptr != p->records[i].ptr) {
-                    *deleted_key = p->records[i].key;
-                    *left_sibling = p->hdr.leftmost_ptr;
-                    p->remove(this, *deleted_key, false, false);
-                    break;
+    size_t off = 0;
+    for (auto &r : results) {
+        memcpy(buf + off, r.data(), r.size() * sizeof(char *));
+        off += r.size();
+    }
+    return kOk;
+}
+
+// Function to search the first "count" keys starting from "min"
+status_code_t btree::btree_search_count(const entry_key_t &min, size_t count,
+                                        void **buf) {
+    leaf_prefetcher pf;
+    scan_leaf(min, &pf)->linear_search_count(min, count, &pf, buf);
+    return kOk;
+}
+
+// Copy a page built in DRAM into persistent memory with non-temporal
+// stores, so a bulk loaded page costs one fence instead of a flush per line
+inline void persist_page(page *dst, const page *src) {
+    static_assert(sizeof(page) % sizeof(long long) == 0,
+                  "page is copied in 8B words");
+    long long *d = (long long *)dst;
+    const long long *s = (const long long *)src;
+    for (size_t i = 0; i < sizeof(page) / sizeof(long long); ++i) {
+        _mm_stream_si64(d + i, s[i]);
+    }
+    _mm_sfence();
+}
+
+// Build the tree bottom-up from pairs produced by "next(&key, &value)" in
+// strictly ascending key order, "next" returns false at the end of input.
+// Each level keeps one page under construction in DRAM, a full page is
+// linked to its successor and written out once, and the first key of the
+// successor is passed up as separator. The tree must be empty and is only
+// switched to the new root when the whole input has been loaded.
+// Unsorted input is only detected on the way, then every page written so
+// far and the strings of all keys taken from "next" are handed back to the
+// tree's allocator, which string keys must come from. PIENVMAllocator
+// ignores Free, there the space stays allocated in the pool.
+template <typename Source>
+status_code_t btree::btree_bulk_load(Source &next, double fill_factor) {
+    if (height != 1 || ((page *)root)->count() != 0) {
+        return kFailed;
+    }
+    if (!(fill_factor > 0 && fill_factor <= 1)) {
+        return kFailed;
+    }
+
+    // The last slot of a page always terminates the entries. Internal pages
+    // keep one more slot for a trailing child, so that the last page of a
+    // level never ends up with a leftmost_ptr only.
+    int leaf_fill = std::max(1, (int)((cardinality - 1) * fill_factor));
+    int inner_fill =
+        std::max(1, std::min(cardinality - 2,
+                             (int)((cardinality - 1) * fill_factor)));
+
+    struct level_builder {
+        page *staged = nullptr; // page under construction in DRAM
+        page *target = nullptr; // its location in persistent memory
+        page *first = nullptr;  // leftmost page of this level
+        int num_entries = 0;
+        bool has_pending = false;
+        entry_key_t pending_key; // child that did not fit into a full page
+        page *pending_child = nullptr;
+    };
+    std::vector<level_builder> levels;
+
+    auto open_page = [&](uint32_t level, page *target, page *leftmost) {
+        level_builder &l = levels[level];
+        l.staged->init(level);
+        l.staged->hdr.leftmost_ptr = leftmost;
+        l.target = target;
+        l.num_entries = 0;
+    };
+    auto append = [&](level_builder &l, const entry_key_t &key, char *ptr) {
+        l.staged->records[l.num_entries].key = key;
+        l.staged->records[l.num_entries].ptr = ptr;
+        l.staged->hdr.last_index = l.num_entries++;
+    };
+    auto close_page = [&](level_builder &l, page *sibling) {
+        l.staged->hdr.sibling_ptr = sibling;
+        persist_page(l.target, l.staged);
+    };
+    auto new_level = [&](page *leftmost) {
+        levels.emplace_back();
+        levels.back().staged = new page;
+        page *target = (page *)allocator->Allocate(sizeof(page));
+        levels.back().first = target;
+        open_page(levels.size() - 1, target, leftmost);
+    };
+
+    // Pass separator "key" of the new page "child" up from "level"
+    auto push_up = [&](uint32_t level, entry_key_t key, page *child) {
+        for (uint32_t i = level + 1;; ++i) {
+            if (i == levels.size()) {
+                new_level(levels[i - 1].first);
+            }
+            level_builder &l = levels[i];
+            if (!l.has_pending) {
+                if (l.num_entries < inner_fill) {
+                    append(l, key, (char *)child);
+                } else {
+                    l.pending_key = key;
+                    l.pending_child = child;
+                    l.has_pending = true;
                 }
-            } else {
-                if (p->records[i - 1].ptr != p->records[i].ptr) {
-                    *deleted_key = p->records[i].key;
-                    *left_sibling = (page *)p->records[i - 1].ptr;
-                    p->remove(this, *deleted_key, false, false);
+                return;
+            }
+            // The pending child opens the next page of this level
+            page *target = (page *)allocator->Allocate(sizeof(page));
+            close_page(l, target);
+            open_page(i, target, l.pending_child);
+            l.has_pending = false;
+            append(l, key, (char *)child);
+            key = l.pending_key;
+            child = target;
+        }
+    };
+
+    status_code_t ret = kOk;
+    entry_key_t key, last_key;
+    char *value;
+    while (next(&key, &value)) {
+        if (levels.empty()) {
+            new_level(nullptr);
+        } else if (!(last_key < key)) {
+            ret = kFailed;
+            break;
+        }
+        last_key = key;
+
+        level_builder &leaf = levels[0];
+        if (leaf.num_entries == leaf_fill) {
+            page *target = (page *)allocator->Allocate(sizeof(page));
+            close_page(leaf, target);
+            open_page(0, target, nullptr);
+            append(leaf, key, value);
+            push_up(0, key, target);
+        } else {
+            append(leaf, key, value);
+        }
+    }
+
+    if (ret == kOk && !levels.empty()) {
+        for (auto &l : levels) {
+            if (l.has_pending) {
+                append(l, l.pending_key, (char *)l.pending_child);
+                l.has_pending = false;
+            }
+            close_page(l, nullptr);
+        }
+        page *old_root = (page *)root;
+        root = (char *)levels.back().target;
+        clflush((char *)&root, sizeof(char *));
+        height = levels.size();
+        allocator->Free(old_root);
+    }
+
+    if (ret != kOk) {
+        // Nothing is reachable from the tree yet. Pages of a level are
+        // chained from its first page up to the one still staged in DRAM,
+        // separators in inner pages share the strings of leaf keys
+        for (size_t i = 0; i < levels.size(); ++i) {
+            level_builder &l = levels[i];
+            page *p = l.first;
+            while (true) {
+                page *content = (p == l.target) ? l.staged : p;
+                page *sibling = content->hdr.sibling_ptr;
+                if (i == 0) {
+                    for (int j = 0; j <= content->hdr.last_index; ++j) {
+                        free_key(allocator, content->records[j].key);
+                    }
+                }
+                allocator->Free(p);
+                if (p == l.target) {
                     break;
                 }
+                p = sibling;
             }
         }
+        free_key(allocator, key);
     }
 
-    p->hdr.mtx->unlock();
+    for (auto &l : levels) {
+        delete l.staged;
+    }
+    return ret;
 }
 
-// Function to search keys from "min" to "max"
-status_code_t btree::btree_search_range(const entry_key_t &min,
-                                        const entry_key_t &max, void **buf) {
+// Average occupancy of the leaves, the number of leaves and keys are also
+// returned through "num_leaves" and "num_keys" unless they are nullptr
+double btree::fill_factor(size_t *num_leaves, size_t *num_keys) {
     page *p = (page *)root;
+    while (p->hdr.leftmost_ptr != nullptr) {
+        p = p->hdr.leftmost_ptr;
+    }
 
-    while (p) {
-        if (p->hdr.leftmost_ptr != nullptr) {
-            // The current page is internal
-            p = (page *)p->linear_search(min);
-        } else {
-            // Found a leaf
-            p->linear_search_range(min, max, buf);
-            break;
+    size_t leaves = 0, keys = 0;
+    for (; p != nullptr; p = p->hdr.sibling_ptr) {
+        ++leaves;
+        keys += p->count();
+    }
+    if (num_leaves) {
+        *num_leaves = leaves;
+    }
+    if (num_keys) {
+        *num_keys = keys;
+    }
+    return (double)keys / (leaves * (cardinality - 1));
+}
+
+// Clear the page locks that were held at the time of a crash. Walks every
+// level through the sibling pointers, pages unlinked by a merge are not
+// reachable any more and keep their stale lock. Must run before any other
+// thread accesses the tree. Nothing calls it yet, FASTFAIRTree always builds
+// a new tree, a constructor that reopens a tree from the pool has to call it
+void btree::recover_locks() {
+    for (page *leftmost = (page *)root; leftmost != nullptr;
+         leftmost = leftmost->hdr.leftmost_ptr) {
+        for (page *p = leftmost; p != nullptr; p = p->hdr.sibling_ptr) {
+            p->hdr.reset_lock();
         }
     }
-    return kOk;
 }
 
 void btree::printAll() {
@@ -1017,6 +2223,10 @@ void btree::printAll() {
     } while (leftmost);
 
     printf("total number of keys: %d\n", total_keys);
+    size_t num_leaves;
+    double ff = fill_factor(&num_leaves, nullptr);
+    printf("height: %d, leaf pages: %zu, leaf fill factor: %.2f%%\n", height,
+           num_leaves, ff * 100);
     pthread_mutex_unlock(&print_mtx);
 }
 
@@ -1045,35 +2255,58 @@ class FASTFAIRTree : public Index {
 #else
         auto k = (uint64_t)key;
 #endif
-        if ((*value = tree.btree_search(k))) {
-            return kOk;
-        }
-        return kNotFound;
+        return tree.btree_search(k, (char **)value);
     }
 
     status_code_t Update(const char *key, size_t key_len,
                          void *value) override {
-        UNUSED(key);
-        UNUSED(key_len);
-        UNUSED(value);
-        return kNotDefined;
+#ifdef STRINGKEY
+        char buf[512];
+        auto k = InternalString(key, key_len, (uint8_t *)buf);
+#else
+        auto k = (uint64_t)key;
+#endif
+        return tree.btree_update(k, (char *)value);
     }
 
     status_code_t Upsert(const char *key, size_t key_len,
                          void *value) override {
-        UNUSED(key);
-        UNUSED(key_len);
-        UNUSED(value);
-        return kNotDefined;
+        // Try an in-place update first so that an existing key does not
+        // cost a persistent key allocation
+        if (Update(key, key_len, value) == kOk) {
+            return kOk;
+        }
+#ifdef STRINGKEY
+        auto des = allocator->Allocate(key_len + sizeof(uint32_t));
+        InternalString str(key, key_len, (uint8_t *)des);
+#else
+        auto str = (uint64_t)key;
+#endif
+        return tree.btree_upsert(str, (char *)value);
+    }
+
+    status_code_t Delete(const char *key, size_t key_len) override {
+#ifdef STRINGKEY
+        char buf[512];
+        auto k = InternalString(key, key_len, (uint8_t *)buf);
+#else
+        auto k = (uint64_t)key;
+#endif
+        return tree.btree_delete(k);
     }
 
+    // Average occupancy of the leaf pages in [0, 1]
+    double FillFactor() { return tree.fill_factor(nullptr, nullptr); }
+
     status_code_t ScanCount(const char *startkey, size_t key_len, size_t count,
                             void **vec) override {
-        UNUSED(startkey);
-        UNUSED(key_len);
-        UNUSED(count);
-        UNUSED(vec);
-        return kNotDefined;
+#ifdef STRINGKEY
+        char bufs[512];
+        auto s = InternalString(startkey, key_len, (uint8_t *)bufs);
+#else
+        auto s = (uint64_t)startkey;
+#endif
+        return tree.btree_search_count(s, count, vec);
     }
 
     status_code_t Scan(const char *startkey, size_t startkey_len,
@@ -1091,6 +2324,28 @@ class FASTFAIRTree : public Index {
         return tree.btree_search_range(s, e, vec);
     }
 
+    // Pages are filled in DRAM and written to persistent memory once, see
+    // btree::btree_bulk_load. With FASTFAIR_INTKEY the iterator yields the
+    // 8B integer keys (as key().data()) in ascending integer order
+    status_code_t BulkLoad(Iterator *iter, double fill_factor) override {
+        auto next = [&](entry_key_t *key, char **value) {
+            if (!iter->Valid()) {
+                return false;
+            }
+            Slice k = iter->key();
+#ifdef STRINGKEY
+            auto des = allocator->Allocate(k.size() + sizeof(uint32_t));
+            *key = InternalString(k.data(), k.size(), (uint8_t *)des);
+#else
+            *key = (uint64_t)k.data();
+#endif
+            *value = (char *)iter->value();
+            iter->Next();
+            return true;
+        };
+        return tree.btree_bulk_load(next, fill_factor);
+    }
+
     void Print() override { tree.printAll(); }
 
   private:
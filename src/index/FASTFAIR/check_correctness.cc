@@ -0,0 +1,468 @@
+// A simple correctness test for FAST-FAIR
+//
+// Keys are inserted and searched first. Then every thread deletes two
+// thirds of its own keys and updates the rest concurrently, which merges
+// and redistributes pages while other threads update and delete. Finally
+// deleted keys must be gone and updated keys must return their new value.
+// Half of the string keys share a long tenant prefix, so that their inlined
+// 8B prefixes tie and comparisons fall back to the full strings.
+//
+// Last, a second tree is bulk loaded from all keys in key order. Invalid
+// fill factors, unsorted input and loading a non-empty tree have to fail.
+// The loaded tree is checked with searches, scans and a range scan over half
+// of the keys, which runs in parallel when built with
+// -DFASTFAIR_SCAN_THREADS=4. Then its keys are upserted and new keys are
+// inserted and upserted.
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <locale>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "btree.hpp"
+#include "iterator.hpp"
+
+const char *pmem_file = "/home/pmem0/pm";
+
+// parse parameter
+extern int optind, opterr, optopt;
+extern char *optarg;
+
+// Test parameter
+size_t test_size;   // The number of insert operation count
+size_t thread_num;  // The number of created threads
+size_t key_len = 16;
+
+struct ThreadResults {
+  uint64_t throughput;
+  uint64_t pass_time;  // use nanoseconds
+  uint64_t fail_cnt;
+};
+
+static constexpr size_t max_thread_num =
+    32;  // Set maximum running thread number
+
+// Test framework data unit
+using testpair = std::pair<const char *, size_t>;
+
+// Insert & Search data for correctness test
+std::vector<testpair> thread_data[max_thread_num];
+
+// Evaluation index for insert & search operation
+PIE::Allocator *nvm_allocator;
+PIE::Index *test_index;
+
+// To record each thread running performance
+ThreadResults thread_results[max_thread_num];
+std::thread threads[max_thread_num];
+
+void InitTest();
+void DoInsert();
+void DoSearch();
+void DoDeleteUpdate();
+void DoCheckDeleteUpdate();
+void DoBulkLoad();
+
+static const char *generate_string(size_t id);
+static testpair NewKey(size_t id);
+
+// Keys at these positions of a thread's data are updated, the others are
+// deleted
+static bool IsUpdated(size_t pos) { return pos % 3 == 2; }
+
+// Value an updated key holds afterwards
+static void *UpdatedValue(const testpair &item) {
+  return (void *)(item.first + 1);
+}
+
+// Key order of FAST-FAIR, string keys compare bytewise and a prefix sorts
+// first
+static bool KeyLess(const testpair &a, const testpair &b) {
+#ifdef STRINGKEY
+  int cmp = memcmp(a.first, b.first, std::min(a.second, b.second));
+  return cmp ? cmp < 0 : a.second < b.second;
+#else
+  return (uint64_t)a.first < (uint64_t)b.first;
+#endif
+}
+
+// Yield "data" in its order, each key maps to itself
+class TestIterator : public PIE::Iterator {
+ public:
+  explicit TestIterator(const std::vector<testpair> &data) : data_(data) {}
+
+  bool Valid() const override { return pos_ < data_.size(); }
+  void Next() override { ++pos_; }
+  PIE::Slice key() const override {
+    return PIE::Slice(data_[pos_].first, data_[pos_].second);
+  }
+  void *value() const override { return (void *)data_[pos_].first; }
+
+ private:
+  const std::vector<testpair> &data_;
+  size_t pos_ = 0;
+};
+
+static void PrintPhase(const char *phase, size_t threads, double kops,
+                       double succ_ratio) {
+  double mem_use = (double)(nvm_allocator->MemUsage()) / (1024 * 1024);
+  std::cout << "[FASTFAIR Finish " << phase << "]\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n";
+  std::cout << "|    Index   | Thread Number | Throughput(kops/s) | Success "
+               "Ratio | Memory Usage(MB) |\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n";
+  std::cout << "| " << std::setw(strlen("   Index  ")) << "FASTFAIR"
+            << " | " << std::setw(strlen("Thread Number")) << threads
+            << " | " << std::setw(strlen("Throughput(kops/s)")) << kops << " | "
+            << std::setw(strlen("Success Ratio")) << succ_ratio << " | "
+            << std::setw(strlen("Memory Usage(MB)")) << mem_use << " |\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n\n";
+}
+
+// Run "work" on every thread and print its throughput and success ratio
+template <typename Work>
+static void RunPhase(const char *phase, Work work) {
+  auto execute = [&](int thread_id) {
+    auto start = std::chrono::high_resolution_clock::now();
+    uint64_t fail_time = work(thread_id);
+    auto end = std::chrono::high_resolution_clock::now();
+    auto dura =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+
+    // Calculate iops for each second
+    double iops = thread_data[thread_id].size() * 1e9 / (dura.count());
+
+    thread_results[thread_id].fail_cnt = fail_time;
+    thread_results[thread_id].pass_time = dura.count();
+    thread_results[thread_id].throughput = iops;
+  };
+
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    threads[i] = std::thread(execute, i);
+  }
+
+  // Wait for all threads exiting
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    threads[i].join();
+  }
+
+  // Calculate total throughput and other information to print
+  uint64_t total_opts = 0, fail_cnt = 0;
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    total_opts += thread_results[i].throughput;
+    fail_cnt += thread_results[i].fail_cnt;
+  }
+
+  double succ_ratio = (double)(test_size - fail_cnt) / test_size;
+  PrintPhase(phase, thread_num, (double)total_opts / 1000, succ_ratio);
+}
+
+int main(int argc, char *argv[]) {
+  // Parse parameters
+  struct option long_options[] = {{"size", required_argument, nullptr, 1},
+                                  {"thread_num", required_argument, nullptr, 2},
+                                  {"key_len", required_argument, nullptr, 3}};
+
+  int opt_idx, c;
+  while (EOF != (c = getopt_long(argc, argv, "s:t:", long_options, &opt_idx))) {
+    switch (c) {
+      case 1:
+        test_size = atoll(optarg);
+        break;
+      case 2:
+        thread_num = atoll(optarg);
+        break;
+      case 3:
+        key_len = atoll(optarg);
+        break;
+      default:
+        std::cerr << "Invalid Parameter: " << optarg << "\n";
+    }
+  }
+
+  // Init index itself and prepare for
+  // testing data
+  InitTest();
+
+  // Perform insert operation
+  DoInsert();
+
+  // Check if search can find right value of
+  // previously inserted key
+  DoSearch();
+
+  // Delete and update concurrently, then check the outcome
+  DoDeleteUpdate();
+  DoCheckDeleteUpdate();
+
+  // Bulk load a second tree and use it
+  DoBulkLoad();
+
+  return 0;
+}
+
+void InitTest() {
+  assert(test_size > 0 && thread_num > 0 && thread_num <= max_thread_num);
+
+  const size_t pmem_size = 100ULL * 1024 * 1024 * 1024;
+
+  // Create new index for test
+  nvm_allocator = new PIE::PIENVMAllocator(pmem_file, pmem_size);
+  test_index = new PIE::FASTFAIR::FASTFAIRTree(nvm_allocator);
+
+  // generate test data, keys are unique so that every delete and update
+  // has to succeed;
+  // Apparently, each thread will have relatively average
+  // size of test data
+  decltype(test_size) cnt = 0;
+  while (cnt < test_size) {
+#ifdef STRINGKEY
+    const char *key = generate_string(cnt);
+#else
+    // multiplying by an odd constant is a bijection, 0 is never a key
+    uint64_t key = ((cnt + 1) * 0x9e3779b97f4a7c15ULL) >> 1;
+    key_len = 0;
+#endif
+    thread_data[cnt % thread_num].push_back({(const char *)key, key_len});
+    ++cnt;
+  }
+
+  printf("[Finish Init Test]\n");
+}
+
+void DoInsert() {
+  RunPhase("Insertion", [](int thread_id) {
+    uint64_t fail_time = 0;
+    for (const auto &item : thread_data[thread_id]) {
+      // The inserted value is the same of key
+      // in order to make value check simple
+      PIE::status_code_t stat =
+          test_index->Insert(item.first, item.second, (void *)item.first);
+      if (stat != PIE::kOk) {
+        fail_time++;
+      }
+    }
+    return fail_time;
+  });
+}
+
+void DoSearch() {
+  RunPhase("Check", [](int thread_id) {
+    uint64_t fail_time = 0;
+    void *value;
+    for (const auto &item : thread_data[thread_id]) {
+      PIE::status_code_t stat =
+          test_index->Search(item.first, item.second, &value);
+      if (stat != PIE::kOk || value != (void *)(item.first)) {
+        fail_time++;
+      }
+    }
+    return fail_time;
+  });
+}
+
+void DoDeleteUpdate() {
+  RunPhase("Delete & Update", [](int thread_id) {
+    uint64_t fail_time = 0;
+    const auto &data = thread_data[thread_id];
+    for (size_t pos = 0; pos < data.size(); ++pos) {
+      const auto &item = data[pos];
+      PIE::status_code_t stat =
+          IsUpdated(pos)
+              ? test_index->Update(item.first, item.second, UpdatedValue(item))
+              : test_index->Delete(item.first, item.second);
+      if (stat != PIE::kOk) {
+        fail_time++;
+      }
+    }
+    return fail_time;
+  });
+}
+
+void DoCheckDeleteUpdate() {
+  RunPhase("Delete & Update Check", [](int thread_id) {
+    uint64_t fail_time = 0;
+    void *value;
+    const auto &data = thread_data[thread_id];
+    for (size_t pos = 0; pos < data.size(); ++pos) {
+      const auto &item = data[pos];
+      PIE::status_code_t stat =
+          test_index->Search(item.first, item.second, &value);
+      if (IsUpdated(pos) ? (stat != PIE::kOk || value != UpdatedValue(item))
+                         : (stat != PIE::kNotFound)) {
+        fail_time++;
+      }
+    }
+    return fail_time;
+  });
+}
+
+// A key that is not part of the test data
+static testpair NewKey(size_t id) {
+#ifdef STRINGKEY
+  const char *key = generate_string(id);
+#else
+  uint64_t key = ((id + 1) * 0x9e3779b97f4a7c15ULL) >> 1;
+#endif
+  return {(const char *)key, key_len};
+}
+
+void DoBulkLoad() {
+  static constexpr size_t scan_len = 16;
+  uint64_t check_cnt = 0, fail_cnt = 0;
+  auto check = [&](bool ok) {
+    ++check_cnt;
+    if (!ok) {
+      fail_cnt++;
+    }
+  };
+
+  std::vector<testpair> sorted;
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    sorted.insert(sorted.end(), thread_data[i].begin(), thread_data[i].end());
+  }
+  std::sort(sorted.begin(), sorted.end(), KeyLess);
+  size_t n = sorted.size();
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+  auto *tree = new PIE::FASTFAIR::FASTFAIRTree(nvm_allocator);
+  void *value;
+
+  // Fill factors outside (0, 1] are rejected
+  for (double fill_factor : {0.0, -0.5, 1.5}) {
+    TestIterator iter(sorted);
+    check(tree->BulkLoad(&iter, fill_factor) == PIE::kFailed);
+  }
+
+  // Unsorted input fails after some pages were written, the tree stays empty
+  if (n >= 2) {
+    std::vector<testpair> unsorted(sorted);
+    std::swap(unsorted[n - 2], unsorted[n - 1]);
+    TestIterator iter(unsorted);
+    check(tree->BulkLoad(&iter, 1.0) == PIE::kFailed);
+    check(tree->Search(sorted[0].first, sorted[0].second, &value) ==
+          PIE::kNotFound);
+  }
+
+  {
+    TestIterator iter(sorted);
+    check(tree->BulkLoad(&iter, 0.7) == PIE::kOk);
+  }
+  // Only an empty tree can be loaded
+  {
+    TestIterator iter(sorted);
+    check(tree->BulkLoad(&iter, 0.7) == PIE::kFailed);
+  }
+
+  // Every key is found, scans return the keys in input order
+  void *vec[scan_len + 1];
+  for (size_t pos = 0; pos < n; ++pos) {
+    const auto &item = sorted[pos];
+    PIE::status_code_t stat = tree->Search(item.first, item.second, &value);
+    check(stat == PIE::kOk && value == (void *)item.first);
+
+    if (pos % 64 == 0) {
+      size_t expect = std::min(scan_len, n - pos);
+      bool ok = true;
+      std::fill(vec, vec + scan_len + 1, nullptr);
+      tree->ScanCount(item.first, item.second, scan_len, vec);
+      for (size_t i = 0; i < expect; ++i) {
+        ok &= (vec[i] == (void *)sorted[pos + i].first);
+      }
+      check(ok);
+    }
+  }
+
+  // A scan over half of the keys spans enough leaves to be split across
+  // FASTFAIR_SCAN_THREADS
+  if (n >= 4) {
+    size_t lo = n / 4, hi = lo + n / 2;
+    std::vector<void *> buf(hi - lo + 1, nullptr);
+    tree->Scan(sorted[lo].first, sorted[lo].second, sorted[hi].first,
+               sorted[hi].second, buf.data());
+    bool ok = buf[hi - lo] == nullptr;
+    for (size_t i = lo; i < hi; ++i) {
+      ok &= (buf[i - lo] == (void *)sorted[i].first);
+    }
+    check(ok);
+  }
+
+  // Upsert replaces the values of loaded keys, new keys are inserted and
+  // upserted into the loaded pages
+  std::vector<testpair> added;
+  for (size_t pos = 0; pos < n; ++pos) {
+    const auto &item = sorted[pos];
+    if (pos % 2 == 0) {
+      check(tree->Upsert(item.first, item.second, UpdatedValue(item)) ==
+            PIE::kOk);
+    }
+    added.push_back(NewKey(n + pos));
+    const auto &fresh = added.back();
+    PIE::status_code_t stat =
+        (pos % 2 == 0)
+            ? tree->Insert(fresh.first, fresh.second, (void *)fresh.first)
+            : tree->Upsert(fresh.first, fresh.second, (void *)fresh.first);
+    check(stat == PIE::kOk);
+  }
+  for (size_t pos = 0; pos < n; ++pos) {
+    const auto &item = sorted[pos];
+    PIE::status_code_t stat = tree->Search(item.first, item.second, &value);
+    check(stat == PIE::kOk &&
+          value == (pos % 2 == 0 ? UpdatedValue(item) : (void *)item.first));
+    stat = tree->Search(added[pos].first, added[pos].second, &value);
+    check(stat == PIE::kOk && value == (void *)added[pos].first);
+  }
+
+  // Loaded and inserted keys together stay in key order
+  sorted.insert(sorted.end(), added.begin(), added.end());
+  std::sort(sorted.begin(), sorted.end(), KeyLess);
+  for (size_t pos = 0; pos < sorted.size(); pos += 64) {
+    size_t expect = std::min(scan_len, sorted.size() - pos);
+    bool ok = true;
+    tree->ScanCount(sorted[pos].first, sorted[pos].second, scan_len, vec);
+    for (size_t i = 0; i < expect; ++i) {
+      tree->Search(sorted[pos + i].first, sorted[pos + i].second, &value);
+      ok &= (vec[i] == value);
+    }
+    check(ok);
+  }
+
+  auto end_time = std::chrono::high_resolution_clock::now();
+  auto dura = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      end_time - start_time);
+  PrintPhase("Bulk Load", 1,
+             check_cnt * 1e6 / std::max<int64_t>(dura.count(), 1),
+             (double)(check_cnt - fail_cnt) / check_cnt);
+}
+
+// generate a string key that is unique by its id. Odd ids lead the key
+// followed by random bytes. Even ids follow a tenant prefix that fills all
+// but the last 8 bytes, so only the full compare tells these keys apart
+static const char *generate_string(size_t id) {
+  static const char tenant[] = "tenant/0000000042/";
+  size_t len = std::max(key_len, 2 * sizeof(id));
+  char *ret = new char[len];
+  if (id % 2) {
+    for (size_t i = 0; i < len; ++i) {
+      ret[i] = rand() % 255;
+    }
+    memcpy(ret, &id, sizeof(id));
+  } else {
+    for (size_t i = 0; i < len - sizeof(id); ++i) {
+      ret[i] = tenant[i % (sizeof(tenant) - 1)];
+    }
+    memcpy(ret + len - sizeof(id), &id, sizeof(id));
+  }
+  key_len = len;
+  return reinterpret_cast<const char *>(ret);
+}
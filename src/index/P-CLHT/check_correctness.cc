@@ -12,7 +12,9 @@
 #include <vector>
 
 #include "clht-lb.hpp"
+#ifndef PCLHT_INTKEY
 #define STRINGKEY
+#endif
 
 const char *pmem_file = "/home/pmem0/pm";
 
@@ -51,6 +53,7 @@ std::thread threads[max_thread_num];
 void InitTest();
 void DoInsert();
 void DoSearch();
+void DoUpdate();
 
 static const char *generate_string();
 
@@ -88,6 +91,9 @@ int main(int argc, char *argv[]) {
   // previously inserted key
   DoSearch();
 
+  // Replace every value, then check that searches see the new one
+  DoUpdate();
+
   return 0;
 }
 
@@ -168,7 +174,7 @@ void DoInsert() {
   double succ_ratio = (double)(test_size - fail_cnt) / test_size;
   double mem_use = (double)(nvm_allocator->MemUsage()) / (1024 * 1024);
   double kops = (double)total_opts / 1000;
-  std::cout << "[WORT Finish Insertion]\n";
+  std::cout << "[P-CLHT Finish Insertion]\n";
   std::cout << "---------------------------------------------------------------"
                "-----------------------\n";
   std::cout << "|    Index   | Thread Number | Throughput(kops/s) | Success "
@@ -176,7 +182,7 @@ void DoInsert() {
   std::cout << "---------------------------------------------------------------"
                "-----------------------\n";
   // std::cout << "| |\n";
-  std::cout << "| " << std::setw(strlen("   Index  ")) << "WORT"
+  std::cout << "| " << std::setw(strlen("   Index  ")) << "P-CLHT"
             << " | " << std::setw(strlen("Thread Number")) << thread_num
             << " | " << std::setw(strlen("Throughput(kops/s)")) << kops << " | "
             << std::setw(strlen("Success Ratio")) << succ_ratio << " | "
@@ -238,7 +244,7 @@ void DoSearch() {
   double mem_use = (double)(nvm_allocator->MemUsage()) / (1024 * 1024);
   double kops = (double)total_opts / 1000;
 
-  std::cout << "[WORT Finish Check]\n";
+  std::cout << "[P-CLHT Finish Check]\n";
   std::cout << "---------------------------------------------------------------"
                "-----------------------\n";
   std::cout << "|    Index   | Thread Number | Throughput(kops/s) | Success "
@@ -246,7 +252,7 @@ void DoSearch() {
   std::cout << "---------------------------------------------------------------"
                "-----------------------\n";
   // std::cout << "| |\n";
-  std::cout << "| " << std::setw(strlen("   Index  ")) << "WORT"
+  std::cout << "| " << std::setw(strlen("   Index  ")) << "P-CLHT"
             << " | " << std::setw(strlen("Thread Number")) << thread_num
             << " | " << std::setw(strlen("Throughput(kops/s)")) << kops << " | "
             << std::setw(strlen("Success Ratio")) << succ_ratio << " | "
@@ -267,4 +273,78 @@ static const char *generate_string() {
     ret[idx] = rand() % 255;
   }
   return reinterpret_cast<const char *>(ret);
-}
\ No newline at end of file
+}
+void DoUpdate() {
+  // A simple per-thread work
+  auto update = [](int thread_id) {
+    int fail_time = 0;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    void *value;
+    size_t pos = 0;
+
+    for (const auto &item : thread_data[thread_id]) {
+      // Alternate between Update and Upsert of an existing key, both
+      // replace the value in place
+      void *new_value = (void *)(item.first + 1);
+      PIE::status_code_t stat =
+          (pos++ % 2 == 0)
+              ? test_index->Update(item.first, item.second, new_value)
+              : test_index->Upsert(item.first, item.second, new_value);
+      if (stat != PIE::kOk) {
+        fail_time++;
+        continue;
+      }
+      stat = test_index->Search(item.first, item.second, &value);
+      if (stat != PIE::kOk || value != new_value) {
+        fail_time++;
+      }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto dura =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+
+    // Calculate iops for each second
+    double iops = thread_data[thread_id].size() * 1e9 / (dura.count());
+
+    thread_results[thread_id].fail_cnt = fail_time;
+    thread_results[thread_id].pass_time = dura.count();
+    thread_results[thread_id].throughput = iops;
+  };
+
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    threads[i] = std::thread(update, i);
+  }
+
+  // Wait for all threads exiting
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    threads[i].join();
+  }
+
+  // Calculate total throughput and other information to print
+  uint64_t total_opts = 0, fail_cnt = 0;
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    total_opts += thread_results[i].throughput;
+    fail_cnt += thread_results[i].fail_cnt;
+  }
+
+  double succ_ratio = (double)(test_size - fail_cnt) / test_size;
+  double mem_use = (double)(nvm_allocator->MemUsage()) / (1024 * 1024);
+  double kops = (double)total_opts / 1000;
+
+  std::cout << "[P-CLHT Finish Update]\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n";
+  std::cout << "|    Index   | Thread Number | Throughput(kops/s) | Success "
+               "Ratio | Memory Usage(MB) |\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n";
+  std::cout << "| " << std::setw(strlen("   Index  ")) << "P-CLHT"
+            << " | " << std::setw(strlen("Thread Number")) << thread_num
+            << " | " << std::setw(strlen("Throughput(kops/s)")) << kops << " | "
+            << std::setw(strlen("Success Ratio")) << succ_ratio << " | "
+            << std::setw(strlen("Memory Usage(MB)")) << mem_use << " |\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n\n";
+}
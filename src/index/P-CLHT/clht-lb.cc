@@ -1,5 +1,9 @@
 #include "clht-lb.hpp"
 
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 
 #include "clhtutils.h"
@@ -18,6 +22,30 @@ __thread size_t check_ht_status_steps = CLHT_STATUS_INVOK_IN;
 namespace PIE {
 namespace CLHT {
 
+namespace {
+
+// GC record of the calling thread in the index whose gc_index_id_ equals
+// owner. id identifies the thread's records across indexes. A thread that
+// exits no longer holds back any table
+struct GCThread {
+  uint64_t owner = 0;
+  ht_ts_t *ts = nullptr;
+  int id = -1;
+
+  ~GCThread() {
+    if (ts != nullptr) {
+      ts->version = kGCQuiescent;
+    }
+  }
+};
+
+thread_local GCThread gc_thread;
+
+std::atomic<uint64_t> gc_index_ids{1};
+std::atomic<int> gc_thread_ids{0};
+
+}  // namespace
+
 static inline void movnt64(uint64_t *dest, uint64_t const src, bool front,
                            bool back) {
   assert(((uint64_t)dest & 7) == 0);
@@ -87,7 +115,7 @@ clht_hashtable_t *CLHTLBIndex::clht_hashtable_create(uint64_t num_buckets) {
   if (hashtable->table == NULL) {
     printf("** alloc: hashtable->table\n");
     fflush(stdout);
-    free(hashtable);
+    nvmallocator_->Free(hashtable);
     return nullptr;
   }
 
@@ -114,19 +142,24 @@ clht_hashtable_t *CLHTLBIndex::clht_hashtable_create(uint64_t num_buckets) {
     hashtable->num_expands_threshold = 1;
   }
   hashtable->is_helper = 1;
-  hashtable->helper_done = 0;
+  hashtable->copy_next = 0;
+  hashtable->copy_done = 0;
 
   return hashtable;
 }
 
-int CLHTLBIndex::clht_put(clht_addr_t key, clht_val_t val) {
+int CLHTLBIndex::clht_put(const clht_probe_t &probe, clht_val_t val) {
   // Specify target bucket position
+#if CLHT_DO_GC == 1
+  clht_hashtable_t *hashtable = clht_gc_thread_version(clht_gc_thread_init());
+#else
   clht_hashtable_t *hashtable = clht_->ht;
-  size_t bin = clht_hash(hashtable, key);
+#endif
+  size_t bin = clht_hash(hashtable, probe.hash);
   volatile bucket_t *bucket = hashtable->table + bin;
 
 #if CLHT_READ_ONLY_FAIL == 1
-  if (bucket_exists(bucket, key)) {
+  if (bucket_exists(bucket, probe)) {
     return false;
   }
 #endif
@@ -136,36 +169,40 @@ int CLHTLBIndex::clht_put(clht_addr_t key, clht_val_t val) {
   // doint resize
   while (!LOCK_ACQ(lock, hashtable)) {
     hashtable = clht_->ht;
-    size_t bin = clht_hash(hashtable, key);
+    size_t bin = clht_hash(hashtable, probe.hash);
 
     bucket = hashtable->table + bin;
     lock = &bucket->lock;
   }
 
-  CLHT_GC_HT_VERSION_USED(hashtable);
   CLHT_CHECK_STATUS(h);
   clht_addr_t *empty = NULL;
   clht_val_t *empty_v = NULL;
+  uint8_t *empty_fp = NULL;
 
   uint32_t j;
   do {
     for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-      if (bucket->key[j] == key) {
+      if (clht_slot_matches(bucket, j, probe)) {
         LOCK_RLS(lock);
         return false;
       } else if (empty == nullptr && bucket->key[j] == 0) {
         empty = (clht_addr_t *)&bucket->key[j];
         empty_v = &bucket->val[j];
+        empty_fp = (uint8_t *)&bucket->fingerprint[j];
       }
     }
 
     int resize = 0;
     if (likely(bucket->next == NULL)) {
+      // A string key is copied out of line once it is known to be new
+      clht_addr_t key = clht_slot_create(probe);
       if (unlikely(empty == NULL)) {
         DPP(put_num_failed_expand);
 
         bucket_t *b = clht_bucket_create_stats(hashtable, &resize);
         b->val[0] = val;
+        b->fingerprint[0] = probe.fingerprint;
 #ifdef __tile__
         /* keep the writes in order */
         _mm_sfence();
@@ -180,7 +217,10 @@ int CLHTLBIndex::clht_put(clht_addr_t key, clht_val_t val) {
         movnt64((uint64_t *)&bucket->next, (uint64_t)b, false, true);
 
       } else {
+        // Value and fingerprint share the bucket's cacheline, a single
+        // flush persists both before the key slot
         *empty_v = val;
+        *empty_fp = probe.fingerprint;
 #ifdef __tile__
         /* keep the writes in order */
         _mm_sfence();
@@ -191,7 +231,7 @@ int CLHTLBIndex::clht_put(clht_addr_t key, clht_val_t val) {
       }
 
       LOCK_RLS(lock);
-      if (unlikely(resize)) {
+      if (unlikely(resize) && clht_->ht == hashtable) {
         /* ht_resize_pes(h, 1); */
         int ret = ht_status(clht_, 1, 0);
 
@@ -204,10 +244,13 @@ int CLHTLBIndex::clht_put(clht_addr_t key, clht_val_t val) {
   } while (true);
 }
 
-clht_val_t CLHTLBIndex::clht_get(clht_addr_t key) {
+clht_val_t CLHTLBIndex::clht_get(const clht_probe_t &probe) {
+#if CLHT_DO_GC == 1
+  clht_hashtable_t *hashtable = clht_gc_thread_version(clht_gc_thread_init());
+#else
   clht_hashtable_t *hashtable = clht_->ht;
-  size_t bin = clht_hash(hashtable, key);
-  CLHT_GC_HT_VERSION_USED(hashtable);
+#endif
+  size_t bin = clht_hash(hashtable, probe.hash);
   volatile bucket_t *bucket = hashtable->table + bin;
 
   uint32_t j;
@@ -217,11 +260,13 @@ clht_val_t CLHTLBIndex::clht_get(clht_addr_t key) {
 #ifdef __tile__
       _mm_lfence();
 #endif
-      if (bucket->key[j] == key) {
+      if (clht_slot_matches(bucket, j, probe)) {
+        // Slots are never reused, a value that changed meanwhile has been
+        // replaced by an update of the same key
         if (likely(bucket->val[j] == val)) {
           return val;
         } else {
-          return 0;
+          return bucket->val[j];
         }
       }
     }
@@ -231,6 +276,44 @@ clht_val_t CLHTLBIndex::clht_get(clht_addr_t key) {
   return 0;
 }
 
+int CLHTLBIndex::clht_update(const clht_probe_t &probe, clht_val_t val) {
+#if CLHT_DO_GC == 1
+  clht_hashtable_t *hashtable = clht_gc_thread_version(clht_gc_thread_init());
+#else
+  clht_hashtable_t *hashtable = clht_->ht;
+#endif
+  size_t bin = clht_hash(hashtable, probe.hash);
+  volatile bucket_t *bucket = hashtable->table + bin;
+
+  // The bucket lock keeps a resize from copying the slot while its value
+  // changes, the update then goes to the new table
+  clht_lock_t *lock = &bucket->lock;
+  while (!LOCK_ACQ(lock, hashtable)) {
+    hashtable = clht_->ht;
+    size_t bin = clht_hash(hashtable, probe.hash);
+
+    bucket = hashtable->table + bin;
+    lock = &bucket->lock;
+  }
+
+  uint32_t j;
+  do {
+    for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
+      if (clht_slot_matches(bucket, j, probe)) {
+        // An aligned 8B store is failure atomic, a crash leaves either value
+        bucket->val[j] = val;
+        persist_data((char *)&bucket->val[j], sizeof(clht_val_t));
+        LOCK_RLS(lock);
+        return true;
+      }
+    }
+    bucket = bucket->next;
+  } while (unlikely(bucket != NULL));
+
+  LOCK_RLS(lock);
+  return false;
+}
+
 size_t CLHTLBIndex::ht_status(clht_t *h, int resize_increase, int just_print) {
   if (TRYLOCK_ACQ(&h->status_lock) && !resize_increase) {
     return 0;
@@ -277,7 +360,7 @@ size_t CLHTLBIndex::ht_status(clht_t *h, int resize_increase, int just_print) {
         99, hashtable->num_buckets, size, full_ratio, expands, expands_max);
   } else {
     if (full_ratio > 0 && full_ratio < CLHT_PERC_FULL_HALVE) {
-      ht_resize_pes(h, 0, 33);
+      ht_resize_pes(h, hashtable, 0, 33);
     } else if ((full_ratio > 0 && full_ratio > CLHT_PERC_FULL_DOUBLE) ||
                expands_max > CLHT_MAX_EXPANSIONS || resize_increase) {
       int inc_by = (full_ratio / CLHT_OCCUP_AFTER_RES);
@@ -289,7 +372,7 @@ size_t CLHTLBIndex::ht_status(clht_t *h, int resize_increase, int just_print) {
 
       DEBUG_PRINT("Callig ht_resize_pes\n");
 
-      int ret = ht_resize_pes(h, 1, inc_by_pow2);
+      int ret = ht_resize_pes(h, hashtable, 1, inc_by_pow2);
 
       // return if crashed
       if (ret == -1) return 0;
@@ -305,17 +388,23 @@ size_t CLHTLBIndex::ht_status(clht_t *h, int resize_increase, int just_print) {
 }
 
 // return -1 if crash is simulated.
-int CLHTLBIndex::ht_resize_pes(clht_t *h, int is_increase, int by) {
-  //    ticks s = getticks();
+int CLHTLBIndex::ht_resize_pes(clht_t *h, clht_hashtable_t *ht_old,
+                               int is_increase, int by) {
+  auto start = std::chrono::steady_clock::now();
 
   check_ht_status_steps = CLHT_STATUS_INVOK;
 
-  clht_hashtable_t *ht_old = h->ht;
-
   if (TRYLOCK_ACQ(&h->resize_lock)) {
     return 0;
   }
 
+  // Another thread may have resized ht_old after it has been read, which
+  // must not be repeated on the new table or, worse, on ht_old
+  if (h->ht != ht_old) {
+    TRYLOCK_RLS(h->resize_lock);
+    return 0;
+  }
+
   size_t num_buckets_new;
   if (is_increase == true) {
     /* num_buckets_new = CLHT_RATIO_DOUBLE * ht_old->num_buckets; */
@@ -333,35 +422,24 @@ int CLHTLBIndex::ht_resize_pes(clht_t *h, int is_increase, int by) {
   clht_hashtable_t *ht_new = clht_hashtable_create(num_buckets_new);
   ht_new->version = ht_old->version + 1;
 
-#if CLHT_HELP_RESIZE == 1
+  // Writers that find a bucket locked for resize help copying chunks, a
+  // shrink copies alone since several old buckets map to one new bucket
   ht_old->table_tmp = ht_new;
-
-  size_t b;
-  for (b = 0; b < ht_old->num_buckets; b++) {
-    bucket_t *bu_cur = ht_old->table + b;
-    int ret = bucket_cpy(
-        h, bu_cur, ht_new); /* reached a point where the helper is handling */
-    if (ret == -1) return -1;
-
-    if (!ret) break;
+  if (ht_resize_copy(ht_old) == -1) {
+    return -1;
   }
 
-  if (is_increase && ht_old->is_helper != 1) /* there exist a helper */
-  {
-    while (ht_old->helper_done != 1) {
-      _mm_pause();
-    }
+  uint64_t num_chunks =
+      (ht_old->num_buckets + kResizeChunkBuckets - 1) / kResizeChunkBuckets;
+  while (ht_old->copy_done != num_chunks) {
+    _mm_pause();
   }
 
-#else
-
-  size_t b;
-  for (b = 0; b < ht_old->num_buckets; b++) {
-    bucket_t *bu_cur = ht_old->table + b;
-    int ret = bucket_cpy(h, bu_cur, ht_new);
-    if (ret == -1) return -1;
+  if (!is_increase) {
+    for (size_t b = 0; b < num_buckets_new; b++) {
+      bucket_persist(ht_new->table + b);
+    }
   }
-#endif
 
 #if defined(DEBUG)
   /* if (clht_size(ht_old) != clht_size(ht_new)) */
@@ -380,16 +458,11 @@ int CLHTLBIndex::ht_resize_pes(clht_t *h, int is_increase, int by) {
     /* ht_new->num_expands_threshold = ht_new->num_expands + 1; */
   }
 
-  // mfence();
-  // clflush((char*)ht_new, sizeof(clht_hashtable_t), false, false);
-  // clflush_next_check((char*)ht_new->table, num_buckets_new *
-  // sizeof(bucket_t),
-  //                    false);
-  // mfence();
+  // Every bucket and overflow bucket of ht_new has been persisted by the
+  // thread that copied it, the header is the last piece before the root
+  // switch makes ht_new durable
   asm_sfence();
-
   persist_data((char *)ht_new, sizeof(clht_hashtable_t));
-  persist_data((char *)ht_new->table, num_buckets_new * sizeof(bucket_t));
   asm_sfence();
 
 #if defined(CRASH_BEFORE_SWAP_CLHT)
@@ -421,9 +494,8 @@ int CLHTLBIndex::ht_resize_pes(clht_t *h, int is_increase, int by) {
   }
 #endif
 
-  // atomically swap the root pointer
-  // SWAP_U64((uint64_t*) h, (uint64_t) ht_new);
-  // clflush((char *)h, sizeof(uint64_t), false, true);
+  // atomically swap the root pointer, a crash before the swap leaves the
+  // complete old table reachable, a crash after it the complete new table
   movnt64((uint64_t*)&h->ht, (uint64_t)ht_new, false, true);
 
 #if defined(CRASH_AFTER_SWAP_CLHT)
@@ -458,12 +530,15 @@ int CLHTLBIndex::ht_resize_pes(clht_t *h, int is_increase, int by) {
   ht_old->table_new = ht_new;
   TRYLOCK_RLS(h->resize_lock);
 
-  //    ticks e = getticks() - s;
-  //    double mba = (ht_new->num_buckets * 64) / (1024.0 * 1024);
-  //    printf("[RESIZE-%02d] to #bu %7zu = MB: %7.2f    | took: %13llu ti =
-  //    %8.6f s\n",
-  //            clht_gc_get_id(), ht_new->num_buckets, mba, (unsigned long long)
-  //            e, e / 2.1e9);
+  uint64_t dura = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+  resize_num_.fetch_add(1, std::memory_order_relaxed);
+  resize_time_ns_.fetch_add(dura, std::memory_order_relaxed);
+  uint64_t max_dura = resize_max_ns_.load(std::memory_order_relaxed);
+  while (dura > max_dura &&
+         !resize_max_ns_.compare_exchange_weak(max_dura, dura)) {
+  }
 
 #if defined(CLHTDEBUG)
   DEBUG_PRINT("-------------ht old------------\n");
@@ -487,15 +562,108 @@ int CLHTLBIndex::ht_resize_pes(clht_t *h, int is_increase, int by) {
   return 1;
 }
 
-int CLHTLBIndex::clht_gc_collect(clht_t *hashtable) {
+int CLHTLBIndex::clht_gc_collect(clht_t *h) {
 #if CLHT_DO_GC == 1
-  CLHT_GC_HT_VERSION_USED(hashtable->ht);
-  return clht_gc_collect_cond(hashtable, 1);
+  if (h->gc_lock != LOCK_FREE || TRYLOCK_ACQ(&h->gc_lock)) {
+    return 0;
+  }
+
+  // Pairs with the fence in clht_gc_thread_init. A table was replaced
+  // before this point, so a thread that may still read it has its
+  // announcement visible below
+  _mm_mfence();
+  size_t version_min = clht_gc_min_version_used(h);
+  h->version_min = version_min;
+
+  // table_new is set once the root points past a table, which also keeps
+  // the current table from being freed
+  int freed = 0;
+  clht_hashtable_t *ht = h->ht_oldest;
+  while (ht->version < version_min && ht->table_new != nullptr) {
+    clht_hashtable_t *next = ht->table_new;
+    next->table_prev = nullptr;
+    clht_gc_release(ht);
+    ht = next;
+    freed++;
+  }
+  h->ht_oldest = ht;
+  gc_freed_tables_ += freed;
+
+  TRYLOCK_RLS(h->gc_lock);
+  return freed;
 #else
   return 0;
 #endif
 }
 
+ht_ts_t *CLHTLBIndex::clht_gc_thread_init() {
+  GCThread &thread = gc_thread;
+  if (likely(thread.owner == gc_index_id_)) {
+    return thread.ts;
+  }
+  if (thread.id < 0) {
+    thread.id = gc_thread_ids.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (thread.ts != nullptr) {
+    thread.ts->version = kGCQuiescent;
+  }
+
+  // The thread may have used this index before switching to another one
+  ht_ts_t *ts = clht_->version_list;
+  while (ts != nullptr && ts->id != thread.id) {
+    ts = (ht_ts_t *)ts->next;
+  }
+  if (ts == nullptr) {
+    ts = new ht_ts_t;
+    ts->versionp = nullptr;
+    ts->id = thread.id;
+    ht_ts_t *head;
+    do {
+      head = clht_->version_list;
+      ts->next = head;
+    } while (CAS_PTR(&clht_->version_list, head, ts) != head);
+  }
+
+  // Version 0 holds back every table until the first operation raises it.
+  // Pairs with the fence in clht_gc_collect: either the collector sees this
+  // announcement, or the root read afterwards is past the freed tables
+  ts->version = 0;
+  _mm_mfence();
+
+  thread.owner = gc_index_id_;
+  thread.ts = ts;
+  return ts;
+}
+
+clht_hashtable_t *CLHTLBIndex::clht_gc_thread_version(ht_ts_t *ts) {
+  // The announced version never exceeds the version of the current table,
+  // so the table is protected without another fence
+  clht_hashtable_t *ht = *(clht_hashtable_t *volatile *)&clht_->ht;
+  if (unlikely(ht->version != ts->version)) {
+    // The thread is done with older tables and may be the last user of them
+    ts->version = ht->version;
+    clht_gc_collect(clht_);
+  }
+  return ht;
+}
+
+size_t CLHTLBIndex::clht_gc_min_version_used(clht_t *h) {
+  size_t version_min = kGCQuiescent;
+  volatile ht_ts_t *ts = h->version_list;
+  while (ts != nullptr) {
+    size_t version = ts->version;
+    if (version < version_min) {
+      version_min = version;
+    }
+    ts = ts->next;
+  }
+  return version_min;
+}
+
+uint64_t CLHTLBIndex::NextGCIndexId() {
+  return gc_index_ids.fetch_add(1, std::memory_order_relaxed);
+}
+
 int CLHTLBIndex::clht_gc_release(clht_hashtable_t *hashtable) {
   /* the CLHT_LINKED version does not allocate any extra buckets! */
 #if !defined(CLHT_LINKED) && !defined(LOCKFREE_RES)
@@ -522,8 +690,103 @@ int CLHTLBIndex::clht_gc_release(clht_hashtable_t *hashtable) {
   return 1;
 }
 
+void CLHTLBIndex::ht_resize_help(clht_hashtable_t *h) {
+  // The resizer publishes the new table in table_tmp before it locks the
+  // first bucket, which is how a writer ended up here
+  if (h->is_helper) {
+    ht_resize_copy(h);
+  }
+}
+
+int CLHTLBIndex::ht_resize_copy(clht_hashtable_t *h) {
+  clht_hashtable_t *ht_new = h->table_tmp;
+  uint64_t num_chunks =
+      (h->num_buckets + kResizeChunkBuckets - 1) / kResizeChunkBuckets;
+  while (true) {
+    uint64_t chunk = FAI_U64(&h->copy_next);
+    if (chunk >= num_chunks) {
+      return 1;
+    }
+    uint64_t from = chunk * kResizeChunkBuckets;
+    uint64_t to = std::min(from + kResizeChunkBuckets, h->num_buckets);
+    for (uint64_t b = from; b < to; b++) {
+      if (bucket_cpy(clht_, h->table + b, ht_new) == -1) {
+        return -1;
+      }
+    }
+
+    // When growing, old bucket b only moves into new buckets b + k * n of
+    // an old table of n buckets, which no other chunk writes to. A shrink
+    // has no helpers and persists the whole new table at its end
+    if (ht_new->num_buckets >= h->num_buckets) {
+      for (uint64_t base = 0; base < ht_new->num_buckets;
+           base += h->num_buckets) {
+        for (uint64_t b = from; b < to; b++) {
+          bucket_persist(ht_new->table + base + b);
+        }
+      }
+    }
+    asm_sfence();
+    IAF_U64(&h->copy_done);
+  }
+}
+
+void CLHTLBIndex::bucket_persist(volatile bucket_t *bucket) {
+  do {
+    asm_clwb((char *)bucket);
+    bucket = bucket->next;
+  } while (bucket != nullptr);
+}
+
+void CLHTLBIndex::clht_lock_initialization(clht_t *h) {
+  clht_hashtable_t *ht = h->ht;
+  for (size_t b = 0; b < ht->num_buckets; b++) {
+    ht->table[b].lock = LOCK_FREE;
+  }
+  persist_data((char *)ht->table, ht->num_buckets * sizeof(bucket_t));
+  ht->table_tmp = nullptr;
+  ht->table_new = nullptr;
+  ht->is_helper = 1;
+  ht->copy_next = 0;
+  ht->copy_done = 0;
+  persist_data((char *)ht, sizeof(clht_hashtable_t));
+
+  // Tables replaced before the restart are unreachable, and GC records
+  // lived in DRAM
+  h->ht_oldest = ht;
+  h->version_list = nullptr;
+  h->version_min = 0;
+  h->resize_lock = LOCK_FREE;
+  h->gc_lock = LOCK_FREE;
+  h->status_lock = LOCK_FREE;
+  persist_data((char *)h, sizeof(clht_t));
+}
+
+void CLHTLBIndex::clht_print(clht_hashtable_t *ht) {
+  printf("[P-CLHT][Buckets: %zu][Version: %zu]\n", ht->num_buckets,
+         ht->version);
+  for (size_t b = 0; b < ht->num_buckets; b++) {
+    volatile bucket_t *bucket = ht->table + b;
+    printf("[%09zu]", b);
+    do {
+      for (uint32_t j = 0; j < ENTRIES_PER_BUCKET; j++) {
+        if (bucket->key[j]) {
+          printf(" %lx/%lx", (unsigned long)bucket->key[j],
+                 (unsigned long)bucket->val[j]);
+        }
+      }
+      bucket = bucket->next;
+      if (bucket != nullptr) {
+        printf(" ->");
+      }
+    } while (bucket != nullptr);
+    printf("\n");
+  }
+}
+
 uint32_t CLHTLBIndex::clht_put_seq(clht_hashtable_t* hashtable, clht_addr_t key,
-                             clht_val_t val, uint64_t bin) {
+                                   uint8_t fingerprint, clht_val_t val,
+                                   uint64_t bin) {
   volatile bucket_t* bucket = hashtable->table + bin;
   uint32_t j;
 
@@ -531,6 +794,7 @@ uint32_t CLHTLBIndex::clht_put_seq(clht_hashtable_t* hashtable, clht_addr_t key,
     for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
       if (bucket->key[j] == 0) {
         bucket->val[j] = val;
+        bucket->fingerprint[j] = fingerprint;
         bucket->key[j] = key;
         return true;
       }
@@ -541,6 +805,7 @@ uint32_t CLHTLBIndex::clht_put_seq(clht_hashtable_t* hashtable, clht_addr_t key,
       int null;
       bucket->next = clht_bucket_create_stats(hashtable, &null);
       bucket->next->val[0] = val;
+      bucket->next->fingerprint[0] = fingerprint;
       bucket->next->key[0] = key;
       return true;
     }
@@ -559,7 +824,7 @@ int CLHTLBIndex::bucket_cpy(clht_t* h, volatile bucket_t* bucket,
     for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
       clht_addr_t key = bucket->key[j];
       if (key != 0) {
-        uint64_t bin = clht_hash(ht_new, key);
+        uint64_t bin = clht_hash(ht_new, clht_slot_hash(key));
 
 #if defined(CRASH_DURING_NODE_CREATE)
         pid_t pid = fork();
@@ -588,7 +853,8 @@ int CLHTLBIndex::bucket_cpy(clht_t* h, volatile bucket_t* bucket,
         }
 #endif
 
-        clht_put_seq(ht_new, key, bucket->val[j], bin);
+        clht_put_seq(ht_new, key, bucket->fingerprint[j], bucket->val[j],
+                     bin);
       }
     }
     bucket = bucket->next;
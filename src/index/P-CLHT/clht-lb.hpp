@@ -1,10 +1,19 @@
 #ifndef PIE_SRC_INDEX_PCLHT_CLHT_LB_HPP__
 #define PIE_SRC_INDEX_PCLHT_CLHT_LB_HPP__
 
+#include <immintrin.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+
 #include "allocator.hpp"
 #include "atomic_ops.h"
 #include "index.hpp"
 #include "internal_string.h"
+#include "persist.h"
 #include "status.hpp"
 
 namespace PIE {
@@ -23,11 +32,13 @@ namespace CLHT {
 #define CLHT_RATIO_HALVE 8
 #define CLHT_MIN_CLHT_SIZE 8
 #define CLHT_DO_CHECK_STATUS 0
-#define CLHT_DO_GC 0
+#define CLHT_DO_GC 1
 #define CLHT_STATUS_INVOK 500000
 #define CLHT_STATUS_INVOK_IN 500000
 #define LOAD_FACTOR 2
 
+// Lock elision is left off on PM: every bucket critical section persists
+// its slot before it releases the lock, and the flush aborts the transaction
 #if defined(RTM) /* only for processors that have RTM */
 #define CLHT_USE_RTM 1
 #else
@@ -45,13 +56,6 @@ namespace CLHT {
 #define CLHT_CHECK_STATUS(h)
 #endif
 
-#if CLHT_DO_GC == 1
-#define CLHT_GC_HT_VERSION_USED(ht) \
-  clht_gc_thread_version((clht_hashtable_t *)ht)
-#else
-#define CLHT_GC_HT_VERSION_USED(ht)
-#endif
-
 /* CLHT LINKED version specific parameters */
 #define CLHT_LINKED_PERC_FULL_DOUBLE 75
 #define CLHT_LINKED_MAX_AVG_EXPANSION 1
@@ -118,8 +122,34 @@ typedef volatile uint8_t clht_lock_t;
 constexpr size_t kEntriesPerBucket = 3;
 constexpr size_t kCacheLineSize = 64;
 
+// Number of consecutive buckets a resizer or helper copies at a time
+constexpr uint64_t kResizeChunkBuckets = 1024;
+
+// Table version announced by a thread that has left the index
+constexpr size_t kGCQuiescent = SIZE_MAX;
+
+// Keys are byte strings by default: a key slot holds the address of a
+// persisted InternalString record, and a 1B fingerprint of the key's hash
+// per slot filters out most records without dereferencing them. With
+// PCLHT_INTKEY a key is an 8B integer passed in place of the key pointer and
+// stored in its slot directly, e.g. cmake -DPCLHT_INTKEY=ON
+// In both modes a zero slot is empty, thus integer key 0 can't be stored
+
+// A key being looked up or inserted, hashed once per operation
+struct clht_probe_t {
+  const char *key;
+  size_t key_len;
+  uint64_t hash;
+  uint8_t fingerprint;
+};
+
+struct clht_hashtable_t;
+struct ht_ts_t;
+
 struct bucket_t {
   clht_lock_t lock;
+  // fingerprint of the key in each slot, written before the key
+  uint8_t fingerprint[kEntriesPerBucket];
   volatile uint32_t hops;
 
   // An array of key and coresponding value
@@ -128,6 +158,8 @@ struct bucket_t {
 
   volatile bucket_t *next;
 };
+static_assert(sizeof(bucket_t) == kCacheLineSize,
+              "a bucket has to fit in one cacheline");
 
 struct clht_t {
   clht_hashtable_t *ht;
@@ -158,17 +190,24 @@ struct clht_hashtable_t {
     volatile uint32_t num_expands_threshold;
     uint32_t num_buckets_prev;
   };
-  volatile int32_t is_helper;
-  volatile int32_t helper_done;
+  volatile int32_t is_helper;  // writers may help copying this table
+  // Buckets of this table are copied into table_tmp in chunks of
+  // kResizeChunkBuckets, claimed through copy_next. copy_done counts the
+  // chunks that have been copied and persisted
+  volatile uint64_t copy_next;
+  volatile uint64_t copy_done;
   size_t version_min;
 } __attribute__((aligned(CACHE_LINE_SIZE)));
 // TODO: Do we have to use union? union is not recommended in C++
 
+// Per-thread GC record: the oldest table version the thread may still read,
+// or kGCQuiescent. Records live in DRAM, are linked into version_list and
+// are never freed
 struct ht_ts_t {
-  size_t version;
+  volatile size_t version;
   clht_hashtable_t *versionp;
   int id;
-  volatile struct ht_ts *next;
+  volatile ht_ts_t *next;
 } __attribute__((aligned(CACHE_LINE_SIZE)));
 
 static inline void _mm_pause_rep(uint64_t w) {
@@ -215,40 +254,10 @@ static inline void _mm_pause_rep(uint64_t w) {
 
 #define TRYLOCK_RLS(lock) lock = LOCK_FREE
 
-void ht_resize_help(clht_hashtable_t *h);
-
 #if defined(DEBUG)
 extern __thread uint32_t put_num_restarts;
 #endif
 
-static inline int lock_acq_chk_resize(clht_lock_t *lock, clht_hashtable_t *h) {
-  char once = 1;
-  clht_lock_t l;
-  while ((l = CAS_U8(lock, LOCK_FREE, LOCK_UPDATE)) == LOCK_UPDATE) {
-    if (once) {
-      DPP(put_num_restarts);
-      once = 0;
-    }
-    _mm_pause();
-  }
-
-  if (l == LOCK_RESIZE) {
-    /* helping with the resize */
-#if CLHT_HELP_RESIZE == 1
-    ht_resize_help(h);
-#endif
-
-    while (h->table_new == NULL) {
-      _mm_pause();
-      _mm_mfence();
-    }
-
-    return 0;
-  }
-
-  return 1;
-}
-
 static inline int lock_acq_resize(clht_lock_t *lock) {
   clht_lock_t l;
   while ((l = CAS_U8(lock, LOCK_FREE, LOCK_RESIZE)) == LOCK_UPDATE) {
@@ -262,49 +271,6 @@ static inline int lock_acq_resize(clht_lock_t *lock) {
   return 1;
 }
 
-/* ********************************************************************************
- */
-#if CLHT_USE_RTM == 1 /* use RTM */
-/* ********************************************************************************
- */
-
-#include <immintrin.h> /*  */
-
-static inline int lock_acq_rtm_chk_resize(clht_lock_t *lock,
-                                          clht_hashtable_t *h) {
-  int rtm_retries = 1;
-  do {
-    /* while (unlikely(*lock == LOCK_UPDATE)) */
-    /* 	{ */
-    /* 	  _mm_pause(); */
-    /* 	} */
-
-    if (likely(_xbegin() == _XBEGIN_STARTED)) {
-      clht_lock_t lv = *lock;
-      if (likely(lv == LOCK_FREE)) {
-        return 1;
-      } else if (lv == LOCK_RESIZE) {
-        _xend();
-#if CLHT_HELP_RESIZE == 1
-        ht_resize_help(h);
-#endif
-
-        while (h->table_new == NULL) {
-          _mm_mfence();
-        }
-
-        return 0;
-      }
-
-      DPP(put_num_restarts);
-      _xabort(0xff);
-    }
-  } while (rtm_retries-- > 0);
-
-  return lock_acq_chk_resize(lock, h);
-}
-#endif /* RTM */
-
 /* ********************************************************************************
  */
 /* intefance */
@@ -313,9 +279,14 @@ static inline int lock_acq_rtm_chk_resize(clht_lock_t *lock,
 
 class CLHTLBIndex : public Index {
  public:
+  // num_buckets is the initial number of buckets, rounded up to a power of 2
   CLHTLBIndex(Allocator *nvmallocator, uint64_t num_buckets)
-      : nvmallocator_(nvmallocator) {
-    clht_ = clht_create(num_buckets);
+      : nvmallocator_(nvmallocator), gc_index_id_(NextGCIndexId()) {
+    uint64_t pow2 = CLHT_MIN_CLHT_SIZE;
+    while (pow2 < num_buckets) {
+      pow2 <<= 1;
+    }
+    clht_ = clht_create(pow2);
   }
 
  private:
@@ -326,40 +297,98 @@ class CLHTLBIndex : public Index {
   clht_hashtable_t *clht_hashtable_create(uint64_t num_buckets);
 
   // hash a key into position
-  uint64_t clht_hash(clht_hashtable_t *hashtable, clht_addr_t key) {
-    return key & (hashtable->hash);
+  uint64_t clht_hash(clht_hashtable_t *hashtable, uint64_t hash) {
+    return hash & (hashtable->hash);
   }
 
+  // Hash key and take its fingerprint from the bits above the bucket index
+  static clht_probe_t clht_probe(const char *key, size_t key_len);
+
+  // Hash of the key stored in a slot, used to move it into a new table
+  static uint64_t clht_slot_hash(clht_addr_t slot);
+
+  // Check if the key stored in slot j of bucket is the probed key
+  static bool clht_slot_matches(volatile bucket_t *bucket, uint32_t j,
+                                const clht_probe_t &probe);
+
+  // Return the slot content for a new key. String keys are copied into a
+  // persisted record first
+  clht_addr_t clht_slot_create(const clht_probe_t &probe);
+
  private:
   // CLHT original operation interface
   // return 0(false) to indicate inserted key is already in the index
   // return 1(true) to indicate insertion succeed
-  int clht_put(clht_addr_t key, clht_val_t val);
+  int clht_put(const clht_probe_t &probe, clht_val_t val);
 
   // Return target key's releted value if key is found. Otherwise return
   // 0 to indicate key not exist
-  clht_val_t clht_get(clht_addr_t key);
+  clht_val_t clht_get(const clht_probe_t &probe);
+
+  // Replace the value of an existing key in place and persist it. Return
+  // 0(false) if the key is not in the index
+  int clht_update(const clht_probe_t &probe, clht_val_t val);
 
   // helper functions
   // Check if target key exists in target bucket
-  bool bucket_exists(volatile bucket_t *bucket, clht_addr_t key);
+  bool bucket_exists(volatile bucket_t *bucket, const clht_probe_t &probe);
   bucket_t *clht_bucket_create();
   bucket_t *clht_bucket_create_stats(clht_hashtable_t *h, int *resize);
 
   size_t ht_status(clht_t *h, int resize_increate, int just_print);
-  int ht_resize_pes(clht_t *h, int is_increase, int by);
+  // Replace table ht_old of h by a larger or smaller copy. Nothing is done
+  // if ht_old has been replaced meanwhile
+  int ht_resize_pes(clht_t *h, clht_hashtable_t *ht_old, int is_increase,
+                    int by);
+  // Free every replaced table older than the versions announced by all
+  // threads, return the number of freed tables
   int clht_gc_collect(clht_t *h);
+  // Free a table along with its overflow buckets
   int clht_gc_release(clht_hashtable_t *ht);
 
+  // Return the GC record of the calling thread, registered on first use
+  ht_ts_t *clht_gc_thread_init();
+  // Return the current table, which stays allocated until the thread
+  // announces a newer version in ts
+  clht_hashtable_t *clht_gc_thread_version(ht_ts_t *ts);
+  // Smallest version announced by any thread
+  size_t clht_gc_min_version_used(clht_t *h);
+  static uint64_t NextGCIndexId();
+
   uint32_t clht_put_seq(clht_hashtable_t *hashtable, clht_addr_t key,
-                        clht_val_t val, uint64_t bin);
+                        uint8_t fingerprint, clht_val_t val, uint64_t bin);
 
   int bucket_cpy(clht_t *h, volatile bucket_t *bucket,
                  clht_hashtable_t *ht_new);
 
+  // Acquire the update lock of a bucket. Return 0 if the bucket belongs to
+  // a table that is being resized, the caller then retries on the new table
+  int lock_acq_chk_resize(clht_lock_t *lock, clht_hashtable_t *h);
+#if CLHT_USE_RTM == 1
+  int lock_acq_rtm_chk_resize(clht_lock_t *lock, clht_hashtable_t *h);
+#endif
+
+  // Help the resizer of h to copy its buckets if helpers are allowed
+  void ht_resize_help(clht_hashtable_t *h);
+
+  // Claim chunks of h's buckets and copy them into h->table_tmp until no
+  // chunk is left. Each chunk is persisted in the new table before it is
+  // counted as done
+  int ht_resize_copy(clht_hashtable_t *h);
+
+  // Persist a bucket and its overflow chain
+  void bucket_persist(volatile bucket_t *bucket);
+
+  // Reset every lock after a restart, a lock byte may have been flushed
+  // along with the data of its bucket
+  void clht_lock_initialization(clht_t *h);
+
+  // Print the entries of every bucket in ht, for debugging
+  void clht_print(clht_hashtable_t *ht);
+
  public:
   status_code_t Insert(const char *key, size_t key_len, void *value) override {
-    int ret = clht_put((uint64_t)key, (clht_val_t)value);
+    int ret = clht_put(clht_probe(key, key_len), (clht_val_t)value);
     if (ret == 0) {
       return kInsertKeyExist;
     }
@@ -367,7 +396,7 @@ class CLHTLBIndex : public Index {
   }
 
   status_code_t Search(const char *key, size_t key_len, void **value) override {
-    auto val = clht_get((uint64_t)key);
+    auto val = clht_get(clht_probe(key, key_len));
     if (val == 0) {
       return kNotFound;
     }
@@ -376,37 +405,175 @@ class CLHTLBIndex : public Index {
   }
 
   status_code_t Update(const char *key, size_t key_len, void *value) override {
+    if (clht_update(clht_probe(key, key_len), (clht_val_t)value) == 0) {
+      return kNotFound;
+    }
     return kOk;
   }
 
   status_code_t Upsert(const char *key, size_t key_len, void *value) override {
+    clht_probe_t probe = clht_probe(key, key_len);
+    // A put that loses against a concurrent put of the same key updates the
+    // winner's slot instead
+    while (clht_update(probe, (clht_val_t)value) == 0) {
+      if (clht_put(probe, (clht_val_t)value) != 0) {
+        break;
+      }
+    }
     return kOk;
   }
 
+  // A hash table keeps no key order
   status_code_t ScanCount(const char *startkey, size_t key_len, size_t count,
                           void **vec) override {
-    return kOk;
+    return kNotDefined;
   }
 
   status_code_t Scan(const char *startkey, size_t startkey_len,
                      const char *endkey, size_t endkey_len,
                      void **vec) override {
-    return kOk;
+    return kNotDefined;
   }
 
-  void Print() override { return; }
+  void Print() override {
+    std::cout << "[P-CLHT][Buckets: " << clht_->ht->num_buckets << "]\n";
+    uint64_t resizes = resize_num_.load();
+    if (resizes != 0) {
+      std::cout << "[Resizes: " << resizes << "]"
+                << "[Resize Time(ms): " << resize_time_ns_.load() / 1e6 << "]"
+                << "[Max Resize Time(ms): " << resize_max_ns_.load() / 1e6
+                << "][Freed Tables: " << gc_freed_tables_ << "]\n";
+    }
+  }
 
  private:
   Allocator *nvmallocator_;
   clht_t *clht_;
+
+  // Statistics of resizes, from allocating a new table to its root switch
+  std::atomic<uint64_t> resize_num_{0};
+  std::atomic<uint64_t> resize_time_ns_{0};
+  std::atomic<uint64_t> resize_max_ns_{0};
+
+  const uint64_t gc_index_id_;  // owner id of the threads' cached GC records
+  uint64_t gc_freed_tables_ = 0;  // updated under gc_lock
 };
 
+inline int CLHTLBIndex::lock_acq_chk_resize(clht_lock_t *lock,
+                                            clht_hashtable_t *h) {
+  char once = 1;
+  clht_lock_t l;
+  while ((l = CAS_U8(lock, LOCK_FREE, LOCK_UPDATE)) == LOCK_UPDATE) {
+    if (once) {
+      DPP(put_num_restarts);
+      once = 0;
+    }
+    _mm_pause();
+  }
+
+  if (l == LOCK_RESIZE) {
+    /* helping with the resize */
+#if CLHT_HELP_RESIZE == 1
+    ht_resize_help(h);
+#endif
+
+    while (h->table_new == NULL) {
+      _mm_pause();
+      _mm_mfence();
+    }
+
+    return 0;
+  }
+
+  return 1;
+}
+
+#if CLHT_USE_RTM == 1 /* use RTM */
+inline int CLHTLBIndex::lock_acq_rtm_chk_resize(clht_lock_t *lock,
+                                                clht_hashtable_t *h) {
+  int rtm_retries = 1;
+  do {
+    if (likely(_xbegin() == _XBEGIN_STARTED)) {
+      clht_lock_t lv = *lock;
+      if (likely(lv == LOCK_FREE)) {
+        return 1;
+      } else if (lv == LOCK_RESIZE) {
+        _xend();
+#if CLHT_HELP_RESIZE == 1
+        ht_resize_help(h);
+#endif
+
+        while (h->table_new == NULL) {
+          _mm_mfence();
+        }
+
+        return 0;
+      }
+
+      DPP(put_num_restarts);
+      _xabort(0xff);
+    }
+  } while (rtm_retries-- > 0);
+
+  return lock_acq_chk_resize(lock, h);
+}
+#endif /* RTM */
+
+inline clht_probe_t CLHTLBIndex::clht_probe(const char *key, size_t key_len) {
+#ifdef PCLHT_INTKEY
+  return {key, key_len, (uint64_t)key, 0};
+#else
+  uint64_t hash = std::_Hash_bytes(key, key_len, 0xc70f6907UL);
+  return {key, key_len, hash, (uint8_t)(hash >> 56)};
+#endif
+}
+
+inline uint64_t CLHTLBIndex::clht_slot_hash(clht_addr_t slot) {
+#ifdef PCLHT_INTKEY
+  return slot;
+#else
+  InternalString record(slot);
+  return std::_Hash_bytes(record.Data(), record.Length(), 0xc70f6907UL);
+#endif
+}
+
+inline bool CLHTLBIndex::clht_slot_matches(volatile bucket_t *bucket,
+                                           uint32_t j,
+                                           const clht_probe_t &probe) {
+#ifdef PCLHT_INTKEY
+  return bucket->key[j] == (clht_addr_t)probe.key;
+#else
+  if (bucket->fingerprint[j] != probe.fingerprint) {
+    return false;
+  }
+  clht_addr_t slot = bucket->key[j];
+  if (slot == 0) {
+    return false;
+  }
+  InternalString record(slot);
+  return record.Length() == probe.key_len &&
+         memcmp(record.Data(), probe.key, probe.key_len) == 0;
+#endif
+}
+
+inline clht_addr_t CLHTLBIndex::clht_slot_create(const clht_probe_t &probe) {
+#ifdef PCLHT_INTKEY
+  return (clht_addr_t)probe.key;
+#else
+  uint8_t *dataptr = reinterpret_cast<uint8_t *>(
+      nvmallocator_->Allocate(sizeof(uint32_t) + probe.key_len));
+  InternalString record(probe.key, probe.key_len, dataptr);
+  persist_data((char *)dataptr, sizeof(uint32_t) + probe.key_len);
+  return record.Raw();
+#endif
+}
+
 inline bool CLHTLBIndex::bucket_exists(volatile bucket_t *bucket,
-                                       clht_addr_t key) {
+                                       const clht_probe_t &probe) {
   uint32_t j;
   do {
     for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-      if (bucket->key[j] == key) {
+      if (clht_slot_matches(bucket, j, probe)) {
         return true;
       }
     }
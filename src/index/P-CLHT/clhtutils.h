@@ -64,7 +64,9 @@
 extern "C" {
 #endif
 
+#ifndef ALIGNED
 #define ALIGNED(N) __attribute__ ((aligned (N)))
+#endif
 
 #ifdef __sparc__
 #  define PAUSE    asm volatile("rd    %%ccr, %%g0\n\t" \
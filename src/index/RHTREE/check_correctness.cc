@@ -3,11 +3,13 @@
 #include <getopt.h>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstdio>
 #include <iostream>
 #include <locale>
 #include <random>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -39,6 +41,9 @@ using testpair = std::pair<const char *, size_t>;
 // Insert & Search data for correctness test
 std::vector<testpair> thread_data[max_thread_num];
 
+// Keys inserted while searches run concurrently in DoMixed
+std::vector<testpair> mixed_data[max_thread_num];
+
 // Evaluation index for insert & search operation
 PIE::Allocator *nvm_allocator, *dram_allocator;
 PIE::Index *test_index;
@@ -50,6 +55,8 @@ std::thread threads[max_thread_num];
 void InitTest();
 void DoInsert();
 void DoSearch();
+void DoMixed();
+void DoShortKeyScan();
 
 static const char *generate_string();
 
@@ -87,6 +94,13 @@ int main(int argc, char *argv[]) {
   // previously inserted key
   DoSearch();
 
+  // Check if lock-free search still finds every previously inserted key
+  // while concurrent insertions split leaves
+  DoMixed();
+
+  // Check scans whose start key is absent and shorter than the stored keys
+  DoShortKeyScan();
+
   return 0;
 }
 
@@ -116,6 +130,18 @@ void InitTest() {
     ++cnt;
   }
 
+  // Data inserted during the mixed test, half the size of the above
+  cnt = 0;
+  while (cnt < test_size / 2) {
+#ifdef STRINGKEY
+    const char *key = generate_string();
+#else
+    uint64_t key = rand() % UINT64_MAX;
+#endif
+    mixed_data[cnt % thread_num].push_back({(const char *)key, key_len});
+    ++cnt;
+  }
+
   printf("[Finish Init Test]\n");
 }
 
@@ -256,6 +282,173 @@ void DoSearch() {
                "-----------------------\n\n";
 }
 
+void DoMixed() {
+  std::atomic<size_t> writer_left(thread_num);
+
+  // Writers insert new keys, which keeps splitting leaves
+  auto insert = [&](int thread_id) {
+    for (const auto &item : mixed_data[thread_id]) {
+      test_index->Insert(item.first, item.second, (void *)item.first);
+    }
+    writer_left.fetch_sub(1);
+  };
+
+  // Readers repeatedly search the keys inserted by DoInsert until all
+  // writers finish. Every one of them has to be found
+  auto check = [&](int thread_id) {
+    uint64_t search_cnt = 0, fail_time = 0;
+    void *value;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    while (writer_left.load() != 0) {
+      for (const auto &item : thread_data[thread_id]) {
+        PIE::status_code_t stat =
+            test_index->Search(item.first, item.second, &value);
+        if (stat != PIE::kOk || value != (void *)(item.first)) {
+          fail_time++;
+        }
+        if (++search_cnt % 1024 == 0 && writer_left.load() == 0) {
+          break;
+        }
+      }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto dura =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+
+    thread_results[thread_id].fail_cnt = fail_time;
+    thread_results[thread_id].pass_time = search_cnt;
+    thread_results[thread_id].throughput =
+        search_cnt * 1e9 / std::max<int64_t>(dura.count(), 1);
+  };
+
+  std::thread writers[max_thread_num];
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    writers[i] = std::thread(insert, i);
+    threads[i] = std::thread(check, i);
+  }
+
+  // Wait for all threads exiting
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    writers[i].join();
+    threads[i].join();
+  }
+
+  // pass_time holds the number of searches here
+  uint64_t total_opts = 0, search_cnt = 0, fail_cnt = 0;
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    total_opts += thread_results[i].throughput;
+    fail_cnt += thread_results[i].fail_cnt;
+    search_cnt += thread_results[i].pass_time;
+  }
+
+  double succ_ratio =
+      search_cnt == 0 ? 1.0 : (double)(search_cnt - fail_cnt) / search_cnt;
+  double mem_use = (double)(nvm_allocator->MemUsage()) / (1024 * 1024);
+  double kops = (double)total_opts / 1000;
+
+  std::cout << "[RHTree Finish Mixed Check]\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n";
+  std::cout << "|    Index   | Thread Number | Throughput(kops/s) | Success "
+               "Ratio | Memory Usage(MB) |\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n";
+  std::cout << "| " << std::setw(strlen("   Index  ")) << "RHTREE"
+            << " | " << std::setw(strlen("Thread Number")) << thread_num
+            << " | " << std::setw(strlen("Throughput(kops/s)")) << kops << " | "
+            << std::setw(strlen("Success Ratio")) << succ_ratio << " | "
+            << std::setw(strlen("Memory Usage(MB)")) << mem_use << " |\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n\n";
+}
+
+void DoShortKeyScan() {
+  static constexpr size_t scan_len = 8;
+  static constexpr size_t sample_num = 10000;
+
+  // All inserted keys in key order, along with the value that won the insert
+  std::vector<std::pair<std::string, void *>> sorted;
+  void *value;
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    for (const auto *data : {&thread_data[i], &mixed_data[i]}) {
+      for (const auto &item : *data) {
+        if (test_index->Search(item.first, item.second, &value) == PIE::kOk) {
+          sorted.push_back({std::string(item.first, item.second), value});
+        }
+      }
+    }
+  }
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  uint64_t sample_cnt = 0, fail_cnt = 0;
+  void *vec[scan_len + 1];
+  auto start_time = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < sample_num && !sorted.empty(); ++i) {
+    // Start with a prefix of a stored key, which is not a key itself
+    const std::string &stored = sorted[i * 7919 % sorted.size()].first;
+    std::string start = stored.substr(0, 1 + i % std::min<size_t>(3, key_len));
+    auto pos = std::lower_bound(
+                   sorted.begin(), sorted.end(), start,
+                   [](const std::pair<std::string, void *> &a,
+                      const std::string &b) { return a.first < b; }) -
+               sorted.begin();
+    if ((size_t)pos < sorted.size() && sorted[pos].first == start) {
+      continue;
+    }
+    size_t expect = std::min(scan_len, sorted.size() - pos);
+    bool fail = false;
+    ++sample_cnt;
+
+    // A scan of a long key first leaves its bytes in the scan buffers
+    test_index->ScanCount(stored.data(), stored.size(), 1, vec);
+
+    std::fill(vec, vec + scan_len + 1, nullptr);
+    test_index->ScanCount(start.data(), start.size(), scan_len, vec);
+    for (size_t j = 0; j < expect; ++j) {
+      fail |= (vec[j] != sorted[pos + j].second);
+    }
+
+    if (pos + scan_len < sorted.size()) {
+      const std::string &end = sorted[pos + scan_len].first;
+      std::fill(vec, vec + scan_len + 1, nullptr);
+      test_index->Scan(start.data(), start.size(), end.data(), end.size(),
+                       vec);
+      for (size_t j = 0; j <= scan_len; ++j) {
+        fail |= (vec[j] != (j < scan_len ? sorted[pos + j].second : nullptr));
+      }
+    }
+
+    if (fail) {
+      fail_cnt++;
+    }
+  }
+  auto end_time = std::chrono::high_resolution_clock::now();
+  auto dura = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      end_time - start_time);
+
+  double succ_ratio =
+      sample_cnt == 0 ? 1.0 : (double)(sample_cnt - fail_cnt) / sample_cnt;
+  double mem_use = (double)(nvm_allocator->MemUsage()) / (1024 * 1024);
+  double kops = sample_cnt * 1e6 / std::max<int64_t>(dura.count(), 1);
+
+  std::cout << "[RHTree Finish Short Key Scan Check]\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n";
+  std::cout << "|    Index   | Thread Number | Throughput(kops/s) | Success "
+               "Ratio | Memory Usage(MB) |\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n";
+  std::cout << "| " << std::setw(strlen("   Index  ")) << "RHTREE"
+            << " | " << std::setw(strlen("Thread Number")) << 1
+            << " | " << std::setw(strlen("Throughput(kops/s)")) << kops << " | "
+            << std::setw(strlen("Success Ratio")) << succ_ratio << " | "
+            << std::setw(strlen("Memory Usage(MB)")) << mem_use << " |\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n\n";
+}
+
 // randomly generate a string key
 static const char *generate_string() {
   char *ret = new char[key_len];
@@ -5,8 +5,27 @@
 namespace PIE {
 namespace RHTREE {
 
+namespace {
+
+// Zero bytes that follow the start key of a scan: the leaf prefix plus the
+// pointer byte below it
+constexpr size_t kScanKeyPad = sizeof(LeafNode<16>::prefix) + 1;
+
+// The descent reads one key byte per trie level and PrefixMatch compares
+// the whole leaf prefix, both past the end of a key shorter than the path.
+// For a scan start these bytes have to read as 0x00, so that the scan
+// begins at the leftmost leaf that may hold keys starting with the start
+// key, rather than at a leaf picked by bytes an earlier call left in "buff"
+void PadScanKey(uint8_t *buff, size_t buff_size, size_t key_len) {
+  size_t off = std::min(sizeof(uint32_t) + key_len, buff_size);
+  memset(buff + off, 0, std::min(kScanKeyPad, buff_size - off));
+}
+
+}  // namespace
+
 // Building an empty RHTree
-void RHTreeIndex::Init() {
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+void RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::Init() {
   // Allocate root
   root_ = AllocINode();
 
@@ -44,25 +63,17 @@ void RHTreeIndex::Init() {
   }
 }
 
-void RHTreeIndex::Recover() {
-  // TODO
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+void RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::Recover() {
+  // TODO, call ResetLock on every reopened leaf before any operation
 }
 
-status_code_t RHTreeIndex::Insert(const char *key, size_t key_len,
-                                  void *value) {
-  // We place internal_key + value together. Padding additional bytes
-  // after key to make value is 8B aligned
-  size_t mod = (sizeof(uint32_t) + key_len) % 8;
-  size_t padding = (mod == 0 ? 0 : 8 - mod);
-  size_t alloc_size = sizeof(uint32_t) + key_len + padding + sizeof(void *);
-
-  void *dataptr = nvm_allocator_->Allocate(alloc_size);
-  RHTREE_Key_t internalkey(key, key_len, (uint8_t *)dataptr);
-
-  // Set value behind key
-  *reinterpret_cast<void **>((char *)dataptr + alloc_size - sizeof(void *)) =
-      value;
-  persist_data((char *)dataptr, alloc_size);
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+status_code_t RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::Insert(
+    const char *key, size_t key_len, void *value) {
+  // We place internal_key + value together, see NewItem
+  RHTREE_Key_t internalkey = NewItem(nvm_allocator_, key, key_len, value);
+  void *dataptr = (void *)internalkey.Raw();
 
   for (;;) {
     // reaches coresponding node and do insert operation
@@ -80,11 +91,14 @@ status_code_t RHTreeIndex::Insert(const char *key, size_t key_len,
       if (leaf->split_flag.compare_exchange_strong(flag, true)) {
         // Splitting thread has to wait other threads exit current
         // leaf
-        while (leaf->TryWrLock() != 0)
-          ;
+        leaf->WrLock();
         leaf = split(leaf);
         leaf->UnWrLock();
         leaf->split_flag.store(false);
+      } else {
+        // Retrying on the full leaf would keep read locking it and starve
+        // the splitting thread, wait for the split instead
+        WaitSplit(leaf);
       }
       // Top-Down traverse again
       leaf = nullptr;
@@ -98,19 +112,26 @@ status_code_t RHTreeIndex::Insert(const char *key, size_t key_len,
      // a return value
 }
 
-status_code_t RHTreeIndex::Search(const char *key, size_t key_len,
-                                  void **value) {
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+status_code_t RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::Search(
+    const char *key, size_t key_len, void **value) {
   static thread_local uint8_t key_buff[1024];
   RHTREE_Key_t internalkey(key, key_len, key_buff);
 
-  RHTreeLeaf *leaf = find_leaf(internalkey);
-  auto stat = leaf->leaf_search(internalkey, *value);
-  leaf->UnRdLock();
-  return stat;
+  for (;;) {
+    // Searches do not lock the leaf, they retry if a split interfered
+    uint64_t version;
+    RHTreeLeaf *leaf = find_leaf_optimistic(internalkey, &version);
+    auto stat = leaf->leaf_search(internalkey, *value);
+    if (leaf->ReadValidate(version)) {
+      return stat;
+    }
+  }
 }
 
-status_code_t RHTreeIndex::Update(const char *key, size_t key_len,
-                                  void *value) {
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+status_code_t RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::Update(
+    const char *key, size_t key_len, void *value) {
   static thread_local uint8_t key_buff[1024];
   RHTREE_Key_t internalkey(key, key_len, key_buff);
 
@@ -120,26 +141,98 @@ status_code_t RHTreeIndex::Update(const char *key, size_t key_len,
   return stat;
 }
 
-status_code_t RHTreeIndex::Upsert(const char *key, size_t key_len,
-                                  void *value) {
-  // TODO
-  return kOk;
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+status_code_t RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::Upsert(
+    const char *key, size_t key_len, void *value) {
+  static thread_local uint8_t key_buff[1024];
+  RHTREE_Key_t internalkey(key, key_len, key_buff);
+
+  for (;;) {
+    // The leaf copies key into a new item only if it does not exist
+    RHTreeLeaf *leaf = find_leaf(internalkey);
+    auto stat = leaf->leaf_upsert(internalkey, value, nvm_allocator_);
+    leaf->UnRdLock();
+
+    if (stat != kNeedSplit) {
+      return stat;
+    }
+    // Same as insert: one thread splits the full leaf, others retry
+    bool flag = false;
+    if (leaf->split_flag.compare_exchange_strong(flag, true)) {
+      leaf->WrLock();
+      leaf = split(leaf);
+      leaf->UnWrLock();
+      leaf->split_flag.store(false);
+    } else {
+      WaitSplit(leaf);
+    }
+  }
 }
 
-status_code_t RHTreeIndex::ScanCount(const char *startkey, size_t key_len,
-                                     size_t count, void **vec) {
-  // TODO
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+status_code_t RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::ScanCount(
+    const char *startkey, size_t key_len, size_t count, void **vec) {
+  static thread_local uint8_t key_buff[1024];
+  RHTREE_Key_t internalkey(startkey, key_len, key_buff);
+  PadScanKey(key_buff, sizeof(key_buff), key_len);
+
+  scan(internalkey, nullptr, count, vec);
   return kOk;
 }
 
-status_code_t RHTreeIndex::Scan(const char *startkey, size_t startkey_len,
-                                const char *endkey, size_t endkey_len,
-                                void **vec) {
-  // TODO
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+status_code_t RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::Scan(
+    const char *startkey, size_t startkey_len, const char *endkey,
+    size_t endkey_len, void **vec) {
+  static thread_local uint8_t start_buff[1024];
+  static thread_local uint8_t end_buff[1024];
+  RHTREE_Key_t start(startkey, startkey_len, start_buff);
+  PadScanKey(start_buff, sizeof(start_buff), startkey_len);
+  RHTREE_Key_t end(endkey, endkey_len, end_buff);
+
+  scan(start, &end, SIZE_MAX, vec);
   return kOk;
 }
 
-RHTreeLeaf *RHTreeIndex::split(RHTreeLeaf *leaf) {
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+size_t RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::scan(
+    const RHTREE_Key_t &start, const RHTREE_Key_t *end, size_t count,
+    void **vec) {
+  uint64_t items[RHTreeLeaf::kSlotNumPerLeaf];
+  size_t off = 0;
+
+  RHTreeLeaf *leaf = find_leaf(start);
+  while (off < count) {
+    size_t n = leaf->leaf_scan(start, end, items);
+    for (size_t i = 0; i < n && off < count; ++i) {
+      vec[off++] = *ValueAddr(RHTREE_Key_t(items[i]));
+    }
+
+    RHTreeLeaf *next = leaf->Next();
+    if (off == count || next == nullptr) {
+      break;
+    }
+    // Leaves are read locked hand over hand, thus the next pointer of a
+    // leaf can not be changed by a split before the next leaf is locked
+    next->RdLock();
+    leaf->UnRdLock();
+    leaf = next;
+
+    if (end != nullptr && leaf->LowerBoundNotLess(*end)) {
+      break;
+    }
+  }
+  leaf->UnRdLock();
+  return off;
+}
+
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+auto RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::split(RHTreeLeaf *leaf)
+    -> RHTreeLeaf * {
+  // Leaf occupancy when it can not take one more key
+  split_num_.fetch_add(1, std::memory_order_relaxed);
+  split_slot_num_.fetch_add(leaf->ValidSlotNum(), std::memory_order_relaxed);
+
   if (FETCH_PTR_NUM(leaf->meta) == 0) {
     return levelsplit(leaf);
   } else {
@@ -147,7 +240,9 @@ RHTreeLeaf *RHTreeIndex::split(RHTreeLeaf *leaf) {
   }
 }
 
-RHTreeLeaf *RHTreeIndex::normalsplit(RHTreeLeaf *leaf) {
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+auto RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::normalsplit(
+    RHTreeLeaf *leaf) -> RHTreeLeaf * {
   // Calculate basic information
   uint64_t meta = leaf->meta;
   uint8_t new_ptr_num = FETCH_PTR_NUM(meta) - 1;
@@ -187,7 +282,9 @@ RHTreeLeaf *RHTreeIndex::normalsplit(RHTreeLeaf *leaf) {
   return leaf;
 }
 
-RHTreeLeaf *RHTreeIndex::levelsplit(RHTreeLeaf *leaf) {
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+auto RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::levelsplit(RHTreeLeaf *leaf)
+    -> RHTreeLeaf * {
   uint64_t meta = leaf->meta;
 
   InternalNode *new_inode = AllocINode(), *parent = leaf->parent;
@@ -241,5 +338,10 @@ RHTreeLeaf *RHTreeIndex::levelsplit(RHTreeLeaf *leaf) {
   return leaf;
 }
 
+// Configurations named in rhtree.hpp
+template class RHTreeIndexT<16, 128>;
+template class RHTreeIndexT<32, 128>;
+template class RHTreeIndexT<64, 64>;
+
 };  // namespace RHTREE
 };  // namespace PIE
\ No newline at end of file
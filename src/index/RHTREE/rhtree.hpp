@@ -8,15 +8,24 @@
 namespace PIE {
 namespace RHTREE {
 
-using RHTreeLeaf = LeafNode;
+// A RHTree whose leaves have kBucketNumPerLeaf hash buckets and whose root
+// initially points to kInitLeafNum leaves. The configurations in use are
+// instantiated in rhtree.cc and named at the end of this file
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+class RHTreeIndexT : public Index {
+  static_assert(kInitLeafNum >= 2 && kInitLeafNum <= kChildNumber &&
+                    (kInitLeafNum & (kInitLeafNum - 1)) == 0,
+                "a leaf covers a power of two children of the root, and "
+                "at most 128 of them");
+
+  using RHTreeLeaf = LeafNode<kBucketNumPerLeaf>;
 
-class RHTreeIndex : public Index {
  public:
   // Create a RHTree index
   // The input parameter recover means rebulding or recover
   // from pmem pool specified by nvm_allocator
-  RHTreeIndex(Allocator *dram_allocator, Allocator *nvm_allocator,
-              bool recover = false)
+  RHTreeIndexT(Allocator *dram_allocator, Allocator *nvm_allocator,
+               bool recover = false)
       : dram_allocator_(dram_allocator), nvm_allocator_(nvm_allocator) {
     if (recover) {
       Recover();
@@ -25,11 +34,11 @@ class RHTreeIndex : public Index {
     }
   }
 
-  RHTreeIndex() = delete;
-  RHTreeIndex(const RHTreeIndex &) = delete;
-  RHTreeIndex &operator=(const RHTreeIndex &) = delete;
+  RHTreeIndexT() = delete;
+  RHTreeIndexT(const RHTreeIndexT &) = delete;
+  RHTreeIndexT &operator=(const RHTreeIndexT &) = delete;
 
-  ~RHTreeIndex();
+  ~RHTreeIndexT();
 
  private:
   // Recover from given pmem pool
@@ -55,24 +64,41 @@ class RHTreeIndex : public Index {
 
   void Print() override {
     std::cout << "[INode Size: " << sizeof(InternalNode) << "]"
-              << "[Leaf Size: " << sizeof(LeafNode) << "]\n"
+              << "[Leaf Size: " << sizeof(RHTreeLeaf) << "]"
+              << "[Init Leaf Num: " << kInitLeafNum << "]\n"
               << "[Leaf is cacheline Aligned: "
-              << (sizeof(LeafNode) % kCacheLineSize == 0) << "]\n";
+              << (sizeof(RHTreeLeaf) % kCacheLineSize == 0) << "]\n";
+    uint64_t splits = split_num_.load();
+    if (splits != 0) {
+      std::cout << "[Leaf Splits: " << splits << "]"
+                << "[Load Factor at Split: "
+                << (double)split_slot_num_.load() /
+                       (splits * RHTreeLeaf::kSlotNumPerLeaf)
+                << "]\n";
+    }
   }
 
  private:
   // splitting a target leaf node and return the splitted
   // node. Newly created leaf node can be accessed with
   // next pointer in leaf.meta
-  LeafNode *split(LeafNode *);
+  RHTreeLeaf *split(RHTreeLeaf *);
+
+  // Wait until the thread splitting leaf has finished. Leaves are never
+  // freed, thus leaf stays accessible
+  void WaitSplit(RHTreeLeaf *leaf) {
+    for (int spin = 0; leaf->split_flag.load(); ++spin) {
+      LockBackoff(spin);
+    }
+  }
 
   // Do normal split for target leaf node. Return value is
   // the same as split function above;
-  LeafNode *normalsplit(LeafNode *);
+  RHTreeLeaf *normalsplit(RHTreeLeaf *);
 
   // Do level split for target leaf node. Return value is
   // the same as split function above
-  LeafNode *levelsplit(LeafNode *);
+  RHTreeLeaf *levelsplit(RHTreeLeaf *);
 
   // Allocate an inner node with dram allocator and
   // do initializations
@@ -99,13 +125,27 @@ class RHTreeIndex : public Index {
                              int height);
   RHTreeLeaf *find_leaf(const RHTREE_Key_t &key);
 
+  // Same as find_leaf, but the leaf is not locked. The returned version must
+  // be checked with ReadValidate after the leaf has been read
+  RHTreeLeaf *find_leaf_optimistic(const RHTREE_Key_t &key, uint64_t *version);
+
+  // Collect values of the first "count" keys within [start, end) to vec in
+  // key order and return their number. Without end the range is unbounded
+  size_t scan(const RHTREE_Key_t &start, const RHTREE_Key_t *end,
+              size_t count, void **vec);
+
  private:
   InternalNode *root_;  // The root of the whole tree structure
   Allocator *dram_allocator_, *nvm_allocator_;
+
+  // Number of leaf splits and the sum of their leaves' valid slots
+  std::atomic_uint64_t split_num_{0};
+  std::atomic_uint64_t split_slot_num_{0};
 };
 
-inline RHTreeLeaf *RHTreeIndex::decend_to_leaf(const RHTREE_Key_t &key,
-                                               InternalNode *root, int height) {
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+inline auto RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::decend_to_leaf(
+    const RHTREE_Key_t &key, InternalNode *root, int height) -> RHTreeLeaf * {
   Node *curr = root;
   while (!curr->IsLeaf()) {
     uint8_t token = key[height++];
@@ -113,12 +153,13 @@ inline RHTreeLeaf *RHTreeIndex::decend_to_leaf(const RHTREE_Key_t &key,
   }
 
   RHTreeLeaf *leaf = reinterpret_cast<RHTreeLeaf *>(curr);
-  while (leaf->TryRdLock())
-    ;  // spin to acquire read lock
+  leaf->RdLock();
   return leaf;
 }
 
-inline RHTreeLeaf *RHTreeIndex::find_leaf(const RHTREE_Key_t &key) {
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+inline auto RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::find_leaf(
+    const RHTREE_Key_t &key) -> RHTreeLeaf * {
   InternalNode *root = root_;
   int height = 0;
   RHTreeLeaf *leaf = decend_to_leaf(key, root, height);
@@ -131,6 +172,33 @@ inline RHTreeLeaf *RHTreeIndex::find_leaf(const RHTREE_Key_t &key) {
   return leaf;
 }
 
+template <size_t kBucketNumPerLeaf, size_t kInitLeafNum>
+inline auto RHTreeIndexT<kBucketNumPerLeaf, kInitLeafNum>::find_leaf_optimistic(
+    const RHTREE_Key_t &key, uint64_t *version) -> RHTreeLeaf * {
+  InternalNode *root = root_;
+  int height = 0;
+  for (;;) {
+    Node *curr = root;
+    int curr_height = height;
+    while (!curr->IsLeaf()) {
+      uint8_t token = key[curr_height++];
+      curr = reinterpret_cast<InternalNode *>(curr)->children[token];
+    }
+
+    RHTreeLeaf *leaf = reinterpret_cast<RHTreeLeaf *>(curr);
+    *version = leaf->ReadBegin();
+    InternalNode *old_root = root;
+    if (leaf->PrefixMatch(key, &height, &root)) {
+      return leaf;
+    }
+    // The leaf was read in the middle of a split, start over from the top
+    if (root == old_root) {
+      root = root_;
+      height = 0;
+    }
+  }
+}
+
 // inline RHTreeLeaf *RHTreeIndex::decend_to_leaf(const RHTREE_Key_t &key) {
 //   InternalNode *root = root_;
 //   int height = 0;
@@ -157,6 +225,13 @@ inline RHTreeLeaf *RHTreeIndex::find_leaf(const RHTREE_Key_t &key) {
 //   return leaf;
 // }
 
+// Preinstantiated configurations, SingleScheme picks one with
+// Options::rhtree_leaf
+using RHTreeIndex =
+    RHTreeIndexT<kDefaultBucketNumPerLeaf, kDefaultInitLeafNum>;  // 2KB leaf
+using RHTreeSmallLeafIndex = RHTreeIndexT<16, 128>;               // 1KB leaf
+using RHTreeLargeLeafIndex = RHTreeIndexT<64, 64>;                // 4KB leaf
+
 };  // namespace RHTREE
 };  // namespace PIE
 
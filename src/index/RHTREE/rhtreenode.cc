@@ -2,18 +2,107 @@
 
 #include "persist.h"
 
+// Use -DRHTREE_SIMD together with -mavx2 or -mavx512f to probe the slots of
+// a hash bucket with SIMD compares. Only this file needs the flags, probes
+// are not inlined into other translation units
+#if defined(RHTREE_SIMD) && (defined(__AVX512F__) || defined(__AVX2__))
+#define RHTREE_SIMD_PROBE
+#include <immintrin.h>
+#endif
+
 namespace PIE {
 namespace RHTREE {
 
+#ifdef RHTREE_SIMD_PROBE
+// A slot keeps cache and signature in its low 16 bits, thus a bucket is
+// probed by masking and comparing all of its eight 8B slots at once
+#ifdef __AVX512F__
+uint32_t HashBucket::MatchMask(uint8_t fp, uint8_t cache) const {
+  const __m512i v = _mm512_loadu_si512(slots);
+  const __m512i low = _mm512_set1_epi64(0xFFFF);
+  const __m512i target =
+      _mm512_set1_epi64(((uint64_t)fp << SIG_BIT) | (cache << CACHE_BIT));
+  return _mm512_cmpeq_epi64_mask(_mm512_and_si512(v, low), target);
+}
+
+uint32_t HashBucket::EmptyMask(uint8_t lbound, uint8_t rbound) const {
+  const __m512i v = _mm512_loadu_si512(slots);
+  const __m512i c = _mm512_and_si512(v, _mm512_set1_epi64(0xFF));
+  __mmask8 free = _mm512_testn_epi64_mask(v, _mm512_set1_epi64(0xFF00));
+  free |= _mm512_cmplt_epu64_mask(c, _mm512_set1_epi64(lbound));
+  free |= _mm512_cmpgt_epu64_mask(c, _mm512_set1_epi64(rbound));
+  return free;
+}
+#else
+uint32_t HashBucket::MatchMask(uint8_t fp, uint8_t cache) const {
+  const __m256i lo = _mm256_loadu_si256((const __m256i *)slots);
+  const __m256i hi = _mm256_loadu_si256((const __m256i *)(slots + 4));
+  const __m256i low = _mm256_set1_epi64x(0xFFFF);
+  const __m256i target =
+      _mm256_set1_epi64x(((uint64_t)fp << SIG_BIT) | (cache << CACHE_BIT));
+  __m256i mlo = _mm256_cmpeq_epi64(_mm256_and_si256(lo, low), target);
+  __m256i mhi = _mm256_cmpeq_epi64(_mm256_and_si256(hi, low), target);
+  return _mm256_movemask_pd(_mm256_castsi256_pd(mlo)) |
+         (_mm256_movemask_pd(_mm256_castsi256_pd(mhi)) << 4);
+}
+
+uint32_t HashBucket::EmptyMask(uint8_t lbound, uint8_t rbound) const {
+  const __m256i sig = _mm256_set1_epi64x(0xFF00);
+  const __m256i byte = _mm256_set1_epi64x(0xFF);
+  const __m256i lb = _mm256_set1_epi64x(lbound);
+  const __m256i rb = _mm256_set1_epi64x(rbound);
+  // cache bytes are zero extended, a signed compare is fine
+  auto free = [&](__m256i v) {
+    __m256i c = _mm256_and_si256(v, byte);
+    __m256i m = _mm256_cmpeq_epi64(_mm256_and_si256(v, sig),
+                                   _mm256_setzero_si256());
+    m = _mm256_or_si256(m, _mm256_cmpgt_epi64(lb, c));
+    m = _mm256_or_si256(m, _mm256_cmpgt_epi64(c, rb));
+    return _mm256_movemask_pd(_mm256_castsi256_pd(m));
+  };
+  return free(_mm256_loadu_si256((const __m256i *)slots)) |
+         (free(_mm256_loadu_si256((const __m256i *)(slots + 4))) << 4);
+}
+#endif
+#else
+uint32_t HashBucket::MatchMask(uint8_t fp, uint8_t cache) const {
+  uint32_t mask = 0;
+  for (auto i = decltype(kSlotNumPerBucket){0}; i < kSlotNumPerBucket; ++i) {
+    if ((FETCH_SIG(slots[i]) == fp) && (FETCH_CACHE(slots[i]) == cache)) {
+      mask |= 1u << i;
+    }
+  }
+  return mask;
+}
+
+uint32_t HashBucket::EmptyMask(uint8_t lbound, uint8_t rbound) const {
+  uint32_t mask = 0;
+  for (auto i = decltype(kSlotNumPerBucket){0}; i < kSlotNumPerBucket; ++i) {
+    // Signature = 0 means this slot has been deleted
+    // or not being occupied
+    // !ValidCache means this slot doesn't match this leaf
+    // node's pattern due to normal split
+    if ((FETCH_SIG(slots[i]) == 0) ||
+        !ValidCache(FETCH_CACHE(slots[i]), lbound, rbound)) {
+      mask |= 1u << i;
+    }
+  }
+  return mask;
+}
+#endif
+
+
 // For any slot stored in current node, use its byte at
 // height position to replace current slot's cache
 // Only replace those slots whoes cache is the same as input
 // parameter old_ptr_start.
-void LeafNode::ReplaceCache(uint8_t old_ptr_start, uint8_t height) {
+template <size_t kBucketNumPerLeaf>
+void LeafNode<kBucketNumPerLeaf>::ReplaceCache(uint8_t old_ptr_start,
+                                               uint8_t height) {
   auto i = decltype(kBucketNumPerLeaf){0};
   auto j = decltype(kSlotNumPerBucket){0};
 
-  for (i = 0; i < kBucketNumPerLeaf; ++i) {
+  for (i = 0; i < kBucketNumPerLeaf + kStashBucketNumPerLeaf; ++i) {
     HashBucket *bucketp = buckets_ + i;
     for (j = 0; j < kSlotNumPerBucket; ++j) {
       auto slot = bucketp->slots[j];
@@ -24,6 +113,7 @@ void LeafNode::ReplaceCache(uint8_t old_ptr_start, uint8_t height) {
         // For those invalid slot, we clear its slot to be
         // zero to prevent it affect next level node insertion
         bucketp->slots[j] = 0;
+        continue;
       }
 
       uint8_t new_cache = static_cast<RHTREE_Key_t>(FETCH_OFFSET(slot))[height];
@@ -35,15 +125,100 @@ void LeafNode::ReplaceCache(uint8_t old_ptr_start, uint8_t height) {
   }
 }
 
-status_code_t LeafNode::leaf_insert(const RHTREE_Key_t &key,
-                                    const RHTREE_Value_t &value,
-                                    Allocator *allocator) {
+template <size_t kBucketNumPerLeaf>
+std::tuple<HashBucket *, int> LeafNode<kBucketNumPerLeaf>::FindSlot(
+    const RHTREE_Key_t &key, uint8_t fp, uint8_t cache, int b1, int b2) {
+  int existslot = buckets_[b1].FindExist(key, fp, cache);
+  if (existslot >= 0) {
+    return std::tuple(buckets_ + b1, existslot);
+  }
+  if (b2 != b1 && (existslot = buckets_[b2].FindExist(key, fp, cache)) >= 0) {
+    return std::tuple(buckets_ + b2, existslot);
+  }
+  for (auto i = kBucketNumPerLeaf;
+       i < kBucketNumPerLeaf + kStashBucketNumPerLeaf; ++i) {
+    if ((existslot = buckets_[i].FindExist(key, fp, cache)) >= 0) {
+      return std::tuple(buckets_ + i, existslot);
+    }
+  }
+  return std::tuple(static_cast<HashBucket *>(nullptr), -1);
+}
+
+template <size_t kBucketNumPerLeaf>
+HashBucket *LeafNode<kBucketNumPerLeaf>::PlaceSlot(uint64_t slot, int b1,
+                                                  int b2, uint8_t lbound,
+                                                  uint8_t rbound) {
+  // Two choices keep the bucket loads even, thus a leaf fills up much
+  // further before its first full bucket forces a split
+  HashBucket *bucketp = buckets_ + b1;
+  uint32_t m = bucketp->EmptyMask(lbound, rbound);
+  if (b2 != b1) {
+    uint32_t m2 = buckets_[b2].EmptyMask(lbound, rbound);
+    if (__builtin_popcount(m2) > __builtin_popcount(m)) {
+      bucketp = buckets_ + b2;
+      m = m2;
+    }
+  }
+  if (m != 0) {
+    bucketp->slots[__builtin_ctz(m)] = slot;
+    return bucketp;
+  }
+
+  // Both choices are full, the stash is shared by all buckets
+  for (auto i = kBucketNumPerLeaf;
+       i < kBucketNumPerLeaf + kStashBucketNumPerLeaf; ++i) {
+    bucketp = buckets_ + i;
+    GetLock()->BucketLock(i);
+    m = bucketp->EmptyMask(lbound, rbound);
+    if (m != 0) {
+      bucketp->slots[__builtin_ctz(m)] = slot;
+      GetLock()->BucketUnLock(i);
+      return bucketp;
+    }
+    GetLock()->BucketUnLock(i);
+  }
+  return nullptr;
+}
+
+template <size_t kBucketNumPerLeaf>
+bool LeafNode<kBucketNumPerLeaf>::HasRoom(int b1, int b2, uint8_t lbound,
+                                          uint8_t rbound) const {
+  if (buckets_[b1].EmptyMask(lbound, rbound) != 0 ||
+      buckets_[b2].EmptyMask(lbound, rbound) != 0) {
+    return true;
+  }
+  for (auto i = kBucketNumPerLeaf;
+       i < kBucketNumPerLeaf + kStashBucketNumPerLeaf; ++i) {
+    if (buckets_[i].EmptyMask(lbound, rbound) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <size_t kBucketNumPerLeaf>
+uint64_t LeafNode<kBucketNumPerLeaf>::ValidSlotNum() const {
+  auto [lbound, rbound] = GetPtrRange();
+  const uint32_t all = (1u << kSlotNumPerBucket) - 1;
+  uint64_t n = 0;
+  for (auto i = decltype(kBucketNumPerLeaf){0};
+       i < kBucketNumPerLeaf + kStashBucketNumPerLeaf; ++i) {
+    n += __builtin_popcount(~buckets_[i].EmptyMask(lbound, rbound) & all);
+  }
+  return n;
+}
+
+template <size_t kBucketNumPerLeaf>
+status_code_t LeafNode<kBucketNumPerLeaf>::leaf_insert(
+    const RHTREE_Key_t &key, const RHTREE_Value_t &value,
+    Allocator *allocator) {
   // Get some basic information about this leaf
   auto height = FETCH_HEIGHT(meta);
   auto [lbound, rbound] = GetPtrRange();
 
   auto hashval = Hash1(key);
-  uint8_t fp = Signature1(hashval), bucketidx = hashval % kBucketNumPerLeaf;
+  uint8_t fp = Signature1(hashval);
+  int b1 = hashval % kBucketNumPerLeaf, b2 = SecondChoice(key);
   uint8_t cache = key[height];
 
   // Use input key as key-value pair pointer
@@ -52,101 +227,80 @@ status_code_t LeafNode::leaf_insert(const RHTREE_Key_t &key,
   SET_SIG(writedata, fp);
   SET_CACHE(writedata, cache);
 
-  HashBucket *bucketp = buckets_ + bucketidx;
-  lock->BucketLock(bucketidx);
   // To solve write-wirte conflict, we use spinlock to prevent any
   // two threads concurrently insert into one bucket
-  // Besides, bucket lock can prevent two threads insert same key
-  auto [existslot, emptyslot] =
-      bucketp->FindEmptyAndExist(key, fp, cache, lbound, rbound);
+  // Besides, locking both choices prevents two threads insert same key
+  LockChoices(b1, b2);
 
   // unique-key check
-  if (existslot >= 0) {
-    lock->BucketUnLock(bucketidx);
+  if (std::get<1>(FindSlot(key, fp, cache, b1, b2)) >= 0) {
+    UnLockChoices(b1, b2);
     return kInsertKeyExist;
   }
 
   // Free slot check
-  if (emptyslot == -1) {
-    lock->BucketUnLock(bucketidx);
+  HashBucket *bucketp = PlaceSlot(writedata, b1, b2, lbound, rbound);
+  UnLockChoices(b1, b2);
+  if (bucketp == nullptr) {
     return kNeedSplit;
   }
 
-  bucketp->slots[emptyslot] = writedata;
-  lock->BucketUnLock(bucketidx);
-
   asm_clwb(bucketp);
   return kOk;
 }
 
-status_code_t LeafNode::leaf_search(const RHTREE_Key_t &key,
-                                    RHTREE_Value_t &value) {
+// Lock-free probe of one bucket, see leaf_search
+static bool SearchBucket(const HashBucket *bucketp,
+                         const RHTREE_Key_t &key, uint8_t fp, uint8_t cache,
+                         RHTREE_Value_t &value) {
+  for (uint32_t m = bucketp->MatchMask(fp, cache); m != 0; m &= m - 1) {
+    uint64_t snapshot =
+        __atomic_load_n(&bucketp->slots[__builtin_ctz(m)], __ATOMIC_ACQUIRE);
+    if ((FETCH_SIG(snapshot) == fp) && (FETCH_CACHE(snapshot) == cache) &&
+        (static_cast<RHTREE_Key_t>(FETCH_OFFSET(snapshot)) == key)) {
+      value = *ValueAddr(RHTREE_Key_t(FETCH_OFFSET(snapshot)));
+      return true;
+    }
+  }
+  return false;
+}
+
+template <size_t kBucketNumPerLeaf>
+status_code_t LeafNode<kBucketNumPerLeaf>::leaf_search(
+    const RHTREE_Key_t &key, RHTREE_Value_t &value) {
   // Get some basic information about this leaf
   auto height = FETCH_HEIGHT(meta);
 
   auto hashval = Hash1(key);
-  uint8_t fp = Signature1(hashval), bucketidx = hashval % kBucketNumPerLeaf;
+  uint8_t fp = Signature1(hashval);
+  int b1 = hashval % kBucketNumPerLeaf;
   uint8_t cache = key[height];
 
-#ifdef SNAPSHOT
-
-  volatile HashBucket *bucketp = buckets_ + bucketidx;  // use volatile to
-                                                        // makesure accessing
-                                                        // memory
-  for (auto i = decltype(kSlotNumPerBucket){0}; i < kSlotNumPerBucket; ++i) {
-    uint64_t snapshot = bucketp->slots[i];  // atomically snapshot
-    if ((FETCH_SIG(snapshot) == fp) && (FETCH_CACHE(snapshot) == cache) &&
-        (static_cast<RHTREE_Key_t>(FETCH_OFFSET(snapshot)) == key)) {
-      // Snapshot does not match
-      if (snapshot != bucketp->slots[i]) {
-        continue;
-      }
-
-      RHTREE_Key_t targetkey = FETCH_OFFSET(bucketp->slots[i]);
-      // Jump over the key content by adding sizeof(uint32_t) and key's
-      // length and padding;
-      // calculating padding information.
-      uint32_t mod = (key.Length() + sizeof(uint32_t)) % 8;
-      uint32_t padding = (mod == 0 ? 0 : 8 - mod);
-      value = *reinterpret_cast<RHTREE_Value_t *>(
-          targetkey.Raw() + sizeof(uint32_t) + key.Length() + padding);
+  // Readers take no bucket lock. Slots are written with single 8B stores and
+  // the key of an item never changes, thus a slot snapshot that matches
+  // holds the key. Items never move between buckets, and a split of this
+  // leaf in between is detected by the caller with ReadValidate
+  if (SearchBucket(buckets_ + b1, key, fp, cache, value)) {
+    return kOk;
+  }
+  // The second hash is only computed when the first choice misses
+  int b2 = SecondChoice(key);
+  if (b2 != b1 && SearchBucket(buckets_ + b2, key, fp, cache, value)) {
+    return kOk;
+  }
+  for (auto i = kBucketNumPerLeaf;
+       i < kBucketNumPerLeaf + kStashBucketNumPerLeaf; ++i) {
+    if (SearchBucket(buckets_ + i, key, fp, cache, value)) {
       return kOk;
     }
   }
   return kNotFound;
-#else
-  HashBucket *bucketp = buckets_ + bucketidx;
-  lock->BucketLock(bucketidx);
-  // To solve write-wirte conflict, we use spinlock to prevent any
-  // two threads concurrently insert into one bucket
-  // Besides, bucket lock can prevent two threads insert same key
-
-  auto existslot = bucketp->FindExist(key, fp, cache);
-
-  if (existslot == -1) {
-    // Target key does not exist
-    lock->BucketUnLock(bucketidx);
-    return kNotFound;
-  }
-
-  // fetch target key's value
-  RHTREE_Key_t targetkey = FETCH_OFFSET(bucketp->slots[existslot]);
-  // Jump over the key content by adding sizeof(uint32_t) and key's
-  // length and padding;
-  // calculating padding information.
-  uint32_t mod = (key.Length() + sizeof(uint32_t)) % 8;
-  uint32_t padding = (mod == 0 ? 0 : 8 - mod);
-  value = *reinterpret_cast<RHTREE_Value_t *>(
-      targetkey.Raw() + sizeof(uint32_t) + key.Length() + padding);
-
-  lock->BucketUnLock(bucketidx);
-  return kOk;
-#endif
 }
 
-status_code_t LeafNode::leaf_update(const RHTREE_Key_t &key,
-                                    const RHTREE_Value_t &value,
-                                    Allocator *allocator) {
+template <size_t kBucketNumPerLeaf>
+status_code_t LeafNode<kBucketNumPerLeaf>::leaf_update(
+    const RHTREE_Key_t &key, const RHTREE_Value_t &value,
+    Allocator *allocator) {
   // update follows almost the same execution path as leaf search
   // does. In this simple implementation, we perform in-place update
   // which means we directly replace existed value with new value
@@ -154,38 +308,115 @@ status_code_t LeafNode::leaf_update(const RHTREE_Key_t &key,
   auto height = FETCH_HEIGHT(meta);
 
   auto hashval = Hash1(key);
-  uint8_t fp = Signature1(hashval), bucketidx = hashval % kBucketNumPerLeaf;
+  uint8_t fp = Signature1(hashval);
+  int b1 = hashval % kBucketNumPerLeaf, b2 = SecondChoice(key);
   uint8_t cache = key[height];
 
-  HashBucket *bucketp = buckets_ + bucketidx;
-  lock->BucketLock(bucketidx);
-  // To solve write-wirte conflict, we use spinlock to prevent any
-  // two threads concurrently insert into one bucket
-  // Besides, bucket lock can prevent two threads insert same key
-
-  auto existslot = bucketp->FindExist(key, fp, cache);
+  // Holding both choices keeps a concurrent insert of the same key out
+  LockChoices(b1, b2);
+  auto [bucketp, existslot] = FindSlot(key, fp, cache, b1, b2);
 
   if (existslot == -1) {
     // Target key does not exist
-    lock->BucketUnLock(bucketidx);
+    UnLockChoices(b1, b2);
     return kNotFound;
   }
 
   // fetch target key's value
   RHTREE_Key_t targetkey = FETCH_OFFSET(bucketp->slots[existslot]);
-  // Jump over the key content by adding sizeof(uint32_t) and key's
-  // length and padding bytes
-  // calculating padding information.
-  uint32_t mod = (key.Length() + sizeof(uint32_t)) % 8;
-  uint32_t padding = (mod == 0 ? 0 : 8 - mod);
-  RHTREE_Value_t *valueptr = reinterpret_cast<RHTREE_Value_t *>(
-      targetkey.Raw() + sizeof(uint32_t) + key.Length() + padding);
+  RHTREE_Value_t *valueptr = ValueAddr(targetkey);
   // Do in-place update
   *valueptr = value;
   asm_clwb(valueptr);
 
-  lock->BucketUnLock(bucketidx);
+  UnLockChoices(b1, b2);
+  return kOk;
+}
+
+template <size_t kBucketNumPerLeaf>
+status_code_t LeafNode<kBucketNumPerLeaf>::leaf_upsert(
+    const RHTREE_Key_t &key, const RHTREE_Value_t &value,
+    Allocator *allocator) {
+  // Get some basic information about this leaf
+  auto height = FETCH_HEIGHT(meta);
+  auto [lbound, rbound] = GetPtrRange();
+
+  auto hashval = Hash1(key);
+  uint8_t fp = Signature1(hashval);
+  int b1 = hashval % kBucketNumPerLeaf, b2 = SecondChoice(key);
+  uint8_t cache = key[height];
+
+  // The locks of both choices keep the lookup valid until the write below
+  LockChoices(b1, b2);
+  auto [existbucket, existslot] = FindSlot(key, fp, cache, b1, b2);
+
+  if (existslot >= 0) {
+    // Do in-place update
+    RHTREE_Value_t *valueptr =
+        ValueAddr(RHTREE_Key_t(FETCH_OFFSET(existbucket->slots[existslot])));
+    *valueptr = value;
+    asm_clwb(valueptr);
+    UnLockChoices(b1, b2);
+    return kOk;
+  }
+
+  // Only a new key costs an item allocation, skip it if the leaf is full.
+  // The stash may still fill up before PlaceSlot, which is rare
+  if (!HasRoom(b1, b2, lbound, rbound)) {
+    UnLockChoices(b1, b2);
+    return kNeedSplit;
+  }
+  RHTREE_Key_t item = NewItem(allocator, (const char *)key.Data(),
+                              key.Length(), value);
+  uint64_t writedata = 0;
+  SET_OFFSET(writedata, item.Raw());
+  SET_SIG(writedata, fp);
+  SET_CACHE(writedata, cache);
+
+  HashBucket *bucketp = PlaceSlot(writedata, b1, b2, lbound, rbound);
+  UnLockChoices(b1, b2);
+  if (bucketp == nullptr) {
+    allocator->Free((void *)item.Raw());
+    return kNeedSplit;
+  }
+
+  asm_clwb(bucketp);
   return kOk;
 }
+
+template <size_t kBucketNumPerLeaf>
+size_t LeafNode<kBucketNumPerLeaf>::leaf_scan(const RHTREE_Key_t &start,
+                                              const RHTREE_Key_t *end,
+                                              uint64_t *items) const {
+  auto [lbound, rbound] = GetPtrRange();
+  size_t n = 0;
+
+  // A slot belongs to this leaf if it is occupied and its cache byte is
+  // within the leaf's pointer range, others are left over by a split
+  const uint32_t all = (1u << kSlotNumPerBucket) - 1;
+  for (auto i = decltype(kBucketNumPerLeaf){0};
+       i < kBucketNumPerLeaf + kStashBucketNumPerLeaf; ++i) {
+    const HashBucket *bucketp = buckets_ + i;
+    for (uint32_t m = ~bucketp->EmptyMask(lbound, rbound) & all; m != 0;
+         m &= m - 1) {
+      RHTREE_Key_t key(FETCH_OFFSET(bucketp->slots[__builtin_ctz(m)]));
+      if (key < start || (end != nullptr && !(key < *end))) {
+        continue;
+      }
+      items[n++] = key.Raw();
+    }
+  }
+
+  // Leaves are ordered, only the keys within one leaf need sorting
+  std::sort(items, items + n, [](uint64_t a, uint64_t b) {
+    return RHTREE_Key_t(a) < RHTREE_Key_t(b);
+  });
+  return n;
+}
+
+// Leaf configurations of RHTreeIndexT, see rhtree.hpp
+template struct LeafNode<16>;
+template struct LeafNode<32>;
+template struct LeafNode<64>;
 };  // namespace RHTREE
 };  // namespace PIE
\ No newline at end of file
@@ -1,11 +1,18 @@
 #ifndef PIE_SRC_INCLUDE_RHTREE_RHTREENODE_HPP__
 #define PIE_SRC_INCLUDE_RHTREE_RHTREENODE_HPP__
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
 #include <tuple>
 
+#include <sys/mman.h>
+
 #include "allocator.hpp"
 #include "index.hpp"
 #include "internal_string.h"
@@ -52,10 +59,16 @@ using RHTREE_Value_t = void *;
 // A bunch of constant value for Tree configurations
 constexpr size_t kCacheLineSize = 64;
 constexpr size_t kBucketSize = 64;
+// An internal node consumes one key byte, thus it always has 256 children
 constexpr size_t kChildNumber = 256;
-constexpr size_t kInitLeafNum = 128;
 constexpr size_t kSlotNumPerBucket = kBucketSize / sizeof(uint64_t);
-constexpr size_t kBucketNumPerLeaf = 32;  // which means a leaf is 2KB
+// Leaf size and initial leaf number are template parameters of LeafNode and
+// RHTreeIndexT, see the configurations in rhtree.hpp
+constexpr size_t kDefaultBucketNumPerLeaf = 32;  // which means a leaf is 2KB
+constexpr size_t kDefaultInitLeafNum = 128;
+// Buckets after the hashed ones take keys whose both bucket choices are
+// full, set to 0 to disable the stash
+constexpr size_t kStashBucketNumPerLeaf = 2;
 
 // RHTree use non-zero signature to validate a hash slot
 // We need two fixed hash value when one key has zero
@@ -63,10 +76,25 @@ constexpr size_t kBucketNumPerLeaf = 32;  // which means a leaf is 2KB
 constexpr uint8_t kDefaultHash1 = 17;
 constexpr uint8_t kDefaultHash2 = 251;
 
+// Failed attempts on a lock before its waiter yields the CPU
+constexpr int kLockSpin = 64;
+
+template <size_t kBucketNumPerLeaf>
 struct RHTreeLock;  // A lightweight lock that provides
                     // both leaf lock in tree and hash bucket
                     // lock within a hash table
 
+// Wait step of spin loops on RHTree locks. A lock holder may have been
+// preempted, thus give up the CPU rather than spin through a whole time
+// slice once spinning took long
+inline void LockBackoff(int spin) {
+  if (spin < kLockSpin) {
+    asm volatile("pause" ::: "memory");
+  } else {
+    std::this_thread::yield();
+  }
+}
+
 // Inline functions for fetching or manipulating slots' data
 inline uint8_t FETCH_CACHE(const uint64_t slot) {
   return slot >> CACHE_BIT & 0xFF;
@@ -146,7 +174,35 @@ inline uint8_t Signature2(uint64_t hash) {
   return (ret == 0) ? 251 : ret;
 }
 
-struct RHTreeLock {
+// A key-value item is placed in NVM as internal key + value. Padding
+// bytes after key make value 8B aligned. Return the address of the value
+// of the item that starts with key
+inline RHTREE_Value_t *ValueAddr(const RHTREE_Key_t &key) {
+  size_t mod = (sizeof(uint32_t) + key.Length()) % 8;
+  size_t padding = (mod == 0 ? 0 : 8 - mod);
+  return reinterpret_cast<RHTREE_Value_t *>(key.Raw() + sizeof(uint32_t) +
+                                            key.Length() + padding);
+}
+
+// Allocate and persist a key-value item, the returned internal key points
+// to the item
+inline RHTREE_Key_t NewItem(Allocator *allocator, const char *key,
+                            size_t key_len, const RHTREE_Value_t &value) {
+  size_t mod = (sizeof(uint32_t) + key_len) % 8;
+  size_t padding = (mod == 0 ? 0 : 8 - mod);
+  size_t alloc_size = sizeof(uint32_t) + key_len + padding + sizeof(void *);
+
+  void *dataptr = allocator->Allocate(alloc_size);
+  RHTREE_Key_t internalkey(key, key_len, (uint8_t *)dataptr);
+  *ValueAddr(internalkey) = value;
+  persist_data((char *)dataptr, alloc_size);
+  return internalkey;
+}
+
+// Locks of neighbouring leaves lie side by side in RHTreeLockTable, thus each
+// one takes whole cache lines
+template <size_t kBucketNumPerLeaf>
+struct alignas(kCacheLineSize) RHTreeLock {
  public:
   // Init all fields to be zero by default
   RHTreeLock() { memset(this, 0, sizeof(RHTreeLock)); }
@@ -174,21 +230,28 @@ struct RHTreeLock {
                                          std::memory_order_acquire) == false) {
       return 1;
     }
-    while (std::atomic_load(&reader_cnt) != 0)
-      ;
+    for (int spin = 0; std::atomic_load(&reader_cnt) != 0; ++spin) {
+      LockBackoff(spin);
+    }
     return 0;
   }
 
   void wr_unlock() { writer_cnt.store((uint16_t)0, std::memory_order_release); }
 
+  bool is_wlocked() const {
+    return writer_cnt.load(std::memory_order_acquire) != 0;
+  }
+
   void rd_unlock() { reader_cnt.fetch_sub(1, std::memory_order_release); }
 
   void BucketLock(int idx) {
     bool expect = false;
-    while (!bucketlocks[idx].compare_exchange_strong(
-        expect, true, std::memory_order_acquire)) {
+    for (int spin = 0; !bucketlocks[idx].compare_exchange_strong(
+             expect, true, std::memory_order_acquire);
+         ++spin) {
       expect = false;
-    }  // simple spin lock
+      LockBackoff(spin);
+    }
   }
 
   void BucketUnLock(int idx) {
@@ -197,7 +260,69 @@ struct RHTreeLock {
 
   std::atomic_uint16_t reader_cnt;
   std::atomic_uint16_t writer_cnt;
-  std::atomic_bool bucketlocks[kBucketNumPerLeaf];
+  std::atomic_bool bucketlocks[kBucketNumPerLeaf + kStashBucketNumPerLeaf];
+};
+
+// Leaf locks are kept in DRAM apart from the persistent leaves. A leaf only
+// stores the ordinal of its lock in this process, the table starts empty
+// after a restart, so recovery has to give every reopened leaf a new lock
+// through ResetLock before it is used. Locks are mapped in chunks, thus
+// creating a leaf never calls the heap and mostly allocates nothing at all.
+// The table is shared by all trees of one configuration, which together
+// hold at most kChunkSize * kMaxChunkNum leaves per process
+template <size_t kBucketNumPerLeaf>
+class RHTreeLockTable {
+  using Lock = RHTreeLock<kBucketNumPerLeaf>;
+
+ public:
+  static constexpr uint64_t kChunkSize = 4096;     // locks per chunk
+  static constexpr uint64_t kMaxChunkNum = 16384;  // i.e. 64M leaves
+
+  // Return the ordinal of a new lock
+  uint64_t New() {
+    uint64_t id = next_.fetch_add(1, std::memory_order_relaxed);
+    Chunk(id / kChunkSize);
+    return id;
+  }
+
+  Lock *Get(uint64_t id) const {
+    return chunks_[id / kChunkSize].load(std::memory_order_acquire) +
+           id % kChunkSize;
+  }
+
+ private:
+  // Return chunk c, map it if it does not exist yet
+  Lock *Chunk(uint64_t c) {
+    if (c >= kMaxChunkNum) {
+      fprintf(stderr, "[RHTreeLockTable] too many leaves\n");
+      exit(1);
+    }
+    Lock *chunk = chunks_[c].load(std::memory_order_acquire);
+    if (chunk != nullptr) {
+      return chunk;
+    }
+    std::lock_guard<std::mutex> guard(mutex_);
+    chunk = chunks_[c].load(std::memory_order_relaxed);
+    if (chunk == nullptr) {
+      void *addr = mmap(nullptr, sizeof(Lock) * kChunkSize,
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+      if (addr == MAP_FAILED) {
+        perror("[RHTreeLockTable] mmap");
+        exit(1);
+      }
+      chunk = static_cast<Lock *>(addr);
+      for (uint64_t i = 0; i < kChunkSize; ++i) {
+        new (chunk + i) Lock();
+      }
+      chunks_[c].store(chunk, std::memory_order_release);
+    }
+    return chunk;
+  }
+
+  std::atomic_uint64_t next_{0};
+  std::mutex mutex_;
+  std::atomic<Lock *> chunks_[kMaxChunkNum] = {};
 };
 
 // A base class to indicate a variety kinds of node
@@ -221,68 +346,130 @@ struct InternalNode : public Node {
   Node *children[kChildNumber];
 };
 
+// A hash bucket of a leaf, it fills exactly one cache line
+struct HashBucket {
+ public:
+  // Bit i of the returned mask is set iff slots[i] has signature fp and
+  // cache byte cache
+  uint32_t MatchMask(uint8_t fp, uint8_t cache) const;
+
+  // Bit i of the returned mask is set iff slots[i] is free for a leaf with
+  // pointer range [lbound, rbound]: it is not occupied or its cache byte
+  // is out of range since a normal split
+  uint32_t EmptyMask(uint8_t lbound, uint8_t rbound) const;
+
+  // search for a target item within a bucket:
+  // match fingerprint(fp)->cache->complete key comparasion
+  // if key does not exist, return -1
+  int FindExist(const RHTREE_Key_t &key, uint8_t fp, uint8_t cache) const;
+
+  // Search for an empty slot and return its idx. The number of
+  // free slot is returned as well
+  // If there is no free slot, return -1; Otherwise return the
+  // free slot with minimal index
+  int FindEmpty(uint8_t lbound, uint8_t rbound, int *free_slot) const;
+
+  // Traverse the bucket, return the index of a slot that matches current
+  // key and return a free slot's index.
+  // We use auto return type to return a pair which contains:
+  //  first the exist key's index and second the free slot index
+  auto FindEmptyAndExist(const RHTREE_Key_t &key, uint8_t fp, uint8_t cache,
+                         uint8_t lbound, uint8_t rbound) const;
+
+ public:
+  // each bucket occupies exactly multiple cache lines
+  uint64_t slots[kSlotNumPerBucket];
+};
+
 // A leaf node class
 // Leaf contains multiple hash buckets, which is similar to
 // segment in CCEH or Dash. LeafNode can be replaced if you
 // have specific optimizations on hash table, but remember
 // do not make leaf too large to support scan range.
+// The leaf size is set by kBucketNumPerLeaf, the configurations in use are
+// instantiated in rhtreenode.cc
+template <size_t kBucketNumPerLeaf>
 struct LeafNode : public Node {
  public:
-  struct HashBucket {
-   public:
-    // search for a target item within a bucket:
-    // match fingerprint(fp)->cache->complete key comparasion
-    // if key does not exist, return -1
-    int FindExist(const RHTREE_Key_t &key, uint8_t fp, uint8_t cache) const;
-
-    // Search for an empty slot and return its idx. The number of
-    // free slot is returned as well
-    // If there is no free slot, return -1; Otherwise return the
-    // free slot with minimal index
-    int FindEmpty(uint8_t lbound, uint8_t rbound, int *free_slot) const;
-
-    // Traverse the bucket, return the index of a slot that matches current
-    // key and return a free slot's index.
-    // We use auto return type to return a pair which contains:
-    //  first the exist key's index and second the free slot index
-    auto FindEmptyAndExist(const RHTREE_Key_t &key, uint8_t fp, uint8_t cache,
-                           uint8_t lbound, uint8_t rbound) const;
-
-   public:
-    // each bucket occupies exactly multiple cache lines
-    uint64_t slots[kSlotNumPerBucket];
-  };
+  static constexpr size_t kSlotNumPerLeaf =
+      (kBucketNumPerLeaf + kStashBucketNumPerLeaf) * kSlotNumPerBucket;
 
  public:
   // Init current leaf, including allocate lock space, init all memory
   // to be zero
   void Init() {
     memset(this, 0, sizeof(LeafNode));
-    // Allocate Lock in DRAM
-    lock = new RHTreeLock();
+    // Take a lock in the DRAM lock table
+    lock_id = lock_table_.New();
     is_leaf = true;
   }
 
+  // Take a new lock for a leaf that was reopened from the pmem pool, its
+  // stored lock_id belongs to an earlier process
+  void ResetLock() { lock_id = lock_table_.New(); }
+
   // A bunch of leaf node operation interface for manipulating hash items in
   // one leaf node, this enables decouple of tree operation and hash table
   // operation
   status_code_t leaf_insert(const RHTREE_Key_t &key,
                             const RHTREE_Value_t &value, Allocator *allocator);
 
+  // Lock-free, the result is valid only if ReadValidate succeeds afterwards
   status_code_t leaf_search(const RHTREE_Key_t &key, RHTREE_Value_t &value);
 
   status_code_t leaf_update(const RHTREE_Key_t &key,
                             const RHTREE_Value_t &value, Allocator *allocator);
 
+  // Update the value of key in place if it exists. Otherwise allocate a new
+  // item with allocator and insert it, key may reside in volatile memory
+  status_code_t leaf_upsert(const RHTREE_Key_t &key,
+                            const RHTREE_Value_t &value, Allocator *allocator);
+
+  // Store the keys of this leaf within [start, end) to items in ascending
+  // order, as raw pointers to their key-value items, and return their
+  // number. Without end the range is unbounded. items must hold SlotNum()
+  // keys
+  size_t leaf_scan(const RHTREE_Key_t &start, const RHTREE_Key_t *end,
+                   uint64_t *items) const;
+
  public:
   // Lock mechanism for concurrency control. These methods only work for leaf
   // node's control in tree: for example, prohibiting two threads splitting
   // the same leaf node, allowing normal operation(insert, search) threads to
   // access the same node
-  int TryRdLock() { return lock->try_rlock(); }
-  int TryWrLock() { return lock->try_wlock(); }
-  void UnRdLock() { lock->rd_unlock(); }
-  void UnWrLock() { lock->wr_unlock(); }
+  int TryRdLock() { return GetLock()->try_rlock(); }
+  int TryWrLock() { return GetLock()->try_wlock(); }
+  // Blocking versions of the above
+  void RdLock() {
+    for (int spin = 0; GetLock()->try_rlock() != 0; ++spin) {
+      LockBackoff(spin);
+    }
+  }
+  void WrLock() {
+    for (int spin = 0; GetLock()->try_wlock() != 0; ++spin) {
+      LockBackoff(spin);
+    }
+  }
+  void UnRdLock() { GetLock()->rd_unlock(); }
+  void UnWrLock() { GetLock()->wr_unlock(); }
+
+  // Optimistic reads, used by search, do not register on the leaf lock. A
+  // split holds the write lock while it modifies the leaf and always
+  // changes meta (the pointer range shrinks or the height grows). Thus a
+  // read that began with no writer present and still sees the same meta
+  // and no writer afterwards observed a leaf no split modified
+  uint64_t ReadBegin() const {
+    while (GetLock()->is_wlocked()) {
+      asm volatile("pause" ::: "memory");
+    }
+    return __atomic_load_n(&meta, __ATOMIC_ACQUIRE);
+  }
+
+  bool ReadValidate(uint64_t version) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return !GetLock()->is_wlocked() &&
+           __atomic_load_n(&meta, __ATOMIC_RELAXED) == version;
+  }
 
   // For any VALID items in current leaf, replace its byte of height
   // position to current slot.By VALID we mean its signature is non-zero
@@ -300,7 +487,19 @@ struct LeafNode : public Node {
   bool PrefixMatch(const RHTREE_Key_t &key, int *height,
                    InternalNode **root) const;
 
-  uint64_t SlotNum() const { return kBucketNumPerLeaf * kSlotNumPerBucket; }
+  // Return true if no key stored in this leaf can be smaller than key,
+  // i.e. leaf's prefix followed by its lowest pointer byte is no smaller
+  bool LowerBoundNotLess(const RHTREE_Key_t &key) const;
+
+  // Next leaf in key order
+  LeafNode *Next() const {
+    return reinterpret_cast<LeafNode *>(FETCH_NEXT(meta));
+  }
+
+  uint64_t SlotNum() const { return kSlotNumPerLeaf; }
+
+  // Number of slots that hold a key of this leaf
+  uint64_t ValidSlotNum() const;
 
   // Return Hash Table position and whole hash table size
   // We need these two methods when copying data for split
@@ -311,16 +510,64 @@ struct LeafNode : public Node {
   uint64_t meta;       // A meta that contains this leaf's meta infomation
   uint8_t prefix[16];  // an prefix array, 16B is basically enough
   std::atomic_bool split_flag;  // prevent two threads splitting one leaf
-  RHTreeLock *lock;             // For concurrency control
+  uint64_t lock_id;             // For concurrency control, see GetLock
   InternalNode *parent;         // points to its parent
-  uint8_t padding[kCacheLineSize - 48];
+  uint8_t padding[kCacheLineSize - 56];  // buckets start at a cache line
+
+  // Multiple Hash Buckets to form a hash table, followed by the stash
+  HashBucket buckets_[kBucketNumPerLeaf + kStashBucketNumPerLeaf];
+
+ private:
+  RHTreeLock<kBucketNumPerLeaf> *GetLock() const {
+    return lock_table_.Get(lock_id);
+  }
+
+  // Locks of all leaves of this configuration
+  inline static RHTreeLockTable<kBucketNumPerLeaf> lock_table_;
+
+  // A key hashes to two buckets: Hash1 picks the first and its
+  // signature, Hash2 picks the second. A key is stored with the same
+  // signature in either bucket or in the stash
+  static int SecondChoice(const RHTREE_Key_t &key) {
+    return Hash2(key) % kBucketNumPerLeaf;
+  }
+
+  // Lock both bucket choices in index order, thus two writers never wait
+  // on each other's bucket. Stash buckets are locked one at a time and
+  // always after the choices
+  void LockChoices(int b1, int b2) {
+    GetLock()->BucketLock(std::min(b1, b2));
+    if (b1 != b2) {
+      GetLock()->BucketLock(std::max(b1, b2));
+    }
+  }
 
-  // Multiple Hash Buckets to form a hash table
-  HashBucket buckets_[kBucketNumPerLeaf];
+  void UnLockChoices(int b1, int b2) {
+    GetLock()->BucketUnLock(b1);
+    if (b1 != b2) {
+      GetLock()->BucketUnLock(b2);
+    }
+  }
+
+  // Look for key in buckets b1, b2 and the stash. Return the bucket and
+  // the slot that hold it, or slot -1 if key does not exist. Caller holds
+  // the locks of b1 and b2, which serialize all writers of key
+  std::tuple<HashBucket *, int> FindSlot(const RHTREE_Key_t &key, uint8_t fp,
+                                         uint8_t cache, int b1, int b2);
+
+  // Store slot in the emptier one of b1 and b2, or in the stash if both
+  // are full. Return the written bucket, or nullptr if the leaf must be
+  // split. Caller holds the locks of b1 and b2
+  HashBucket *PlaceSlot(uint64_t slot, int b1, int b2, uint8_t lbound,
+                        uint8_t rbound);
+
+  // Return true if PlaceSlot would currently find a free slot
+  bool HasRoom(int b1, int b2, uint8_t lbound, uint8_t rbound) const;
 };
 
-inline bool LeafNode::PrefixMatch(const RHTREE_Key_t &key, int *height,
-                                  InternalNode **root) const {
+template <size_t kBucketNumPerLeaf>
+inline bool LeafNode<kBucketNumPerLeaf>::PrefixMatch(
+    const RHTREE_Key_t &key, int *height, InternalNode **root) const {
   int leaf_height = FETCH_HEIGHT(meta);
   // Leaf's prefix is not consistent with target key
   if (leaf_height != 0 && memcmp(prefix, key.Data(), leaf_height) != 0) {
@@ -341,14 +588,34 @@ inline bool LeafNode::PrefixMatch(const RHTREE_Key_t &key, int *height,
   return true;
 }
 
-inline int LeafNode::HashBucket::FindExist(const RHTREE_Key_t &key, uint8_t fp,
-                                           uint8_t cache) const {
-  auto i = decltype(kSlotNumPerBucket){0};
-  for (i = 0; i < kSlotNumPerBucket; ++i) {
-    if ((FETCH_SIG(slots[i]) == fp) && (FETCH_CACHE(slots[i]) == cache) &&
-        (static_cast<RHTREE_Key_t>(FETCH_OFFSET(slots[i])) == key)) {
-      // If both Fingerprint, Cache is matched, we compare the
-      // complete key
+template <size_t kBucketNumPerLeaf>
+inline bool LeafNode<kBucketNumPerLeaf>::LowerBoundNotLess(
+    const RHTREE_Key_t &key) const {
+  size_t leaf_height = FETCH_HEIGHT(meta);
+  auto [lbound, rbound] = GetPtrRange();
+  (void)rbound;
+
+  int cmp = memcmp(prefix, key.Data(), std::min(leaf_height, key.Length()));
+  if (cmp != 0) {
+    return cmp > 0;
+  }
+  // key is a prefix of all keys stored here
+  if (key.Length() <= leaf_height) {
+    return true;
+  }
+  if (lbound != key[leaf_height]) {
+    return lbound > key[leaf_height];
+  }
+  return key.Length() == leaf_height + 1;
+}
+
+inline int HashBucket::FindExist(const RHTREE_Key_t &key, uint8_t fp,
+                                 uint8_t cache) const {
+  // If both Fingerprint, Cache is matched, we compare the
+  // complete key
+  for (uint32_t m = MatchMask(fp, cache); m != 0; m &= m - 1) {
+    int i = __builtin_ctz(m);
+    if (static_cast<RHTREE_Key_t>(FETCH_OFFSET(slots[i])) == key) {
       return i;
     }
   }
@@ -357,46 +624,20 @@ inline int LeafNode::HashBucket::FindExist(const RHTREE_Key_t &key, uint8_t fp,
   return -1;
 }
 
-inline int LeafNode::HashBucket::FindEmpty(uint8_t lbound, uint8_t rbound,
-                                           int *freeslot_cnt) const {
-  int free_cnt = 0, emptyslot = -1;
-  auto i = decltype(kSlotNumPerBucket){0};
-  for (i = 0; i < kSlotNumPerBucket; ++i) {
-    if ((FETCH_SIG(slots[i]) == 0) ||
-        !ValidCache(FETCH_CACHE(slots[i]), lbound, rbound)) {
-      // Signature = 0 means this slot has been deleted
-      // or not being occupied
-      // !ValidCache means this slot doesn't match this leaf
-      // node's pattern due to normal split
-      ++free_cnt;
-      if (emptyslot == -1) {
-        emptyslot = i;
-      }  // replace return value
-    }
-  }
-  *freeslot_cnt = free_cnt;
-  return emptyslot;
+inline int HashBucket::FindEmpty(uint8_t lbound, uint8_t rbound,
+                                 int *freeslot_cnt) const {
+  uint32_t m = EmptyMask(lbound, rbound);
+  *freeslot_cnt = __builtin_popcount(m);
+  // Return the free slot with minimal index
+  return m == 0 ? -1 : __builtin_ctz(m);
 }
 
-inline auto LeafNode::HashBucket::FindEmptyAndExist(const RHTREE_Key_t &key,
-                                                    uint8_t fp, uint8_t cache,
-                                                    uint8_t lbound,
-                                                    uint8_t rbound) const {
-  int existslot = -1, emptyslot = -1;
-  auto i = decltype(kSlotNumPerBucket){0};
-  for (i = 0; i < kSlotNumPerBucket; ++i) {
-    if ((FETCH_SIG(slots[i]) == fp) && (FETCH_CACHE(slots[i] == cache)) &&
-        (static_cast<RHTREE_Key_t>(FETCH_OFFSET(slots[i])) == key)) {
-      existslot = i;
-    }
-
-    if ((FETCH_SIG(slots[i]) == 0) ||
-        !ValidCache(FETCH_CACHE(slots[i]), lbound, rbound)) {
-      if (emptyslot == -1) {
-        emptyslot = i;  // Return the first met empty slot
-      }
-    }
-  }
+inline auto HashBucket::FindEmptyAndExist(const RHTREE_Key_t &key, uint8_t fp,
+                                          uint8_t cache, uint8_t lbound,
+                                          uint8_t rbound) const {
+  int existslot = FindExist(key, fp, cache);
+  uint32_t m = EmptyMask(lbound, rbound);
+  int emptyslot = m == 0 ? -1 : __builtin_ctz(m);  // first met empty slot
   return std::tuple(existslot, emptyslot);
 }
 
@@ -1,14 +1,22 @@
-// A simple correctness test for RHTree
+// A simple correctness test for WORT
+//
+// Keys are inserted and searched, then every value is replaced through
+// Update or Upsert. Finally range scans starting at every key are checked
+// against the sorted key set. With --var_key_len=1 keys have random lengths
+// up to key_len bytes, and some keys extend a shorter key by zero bytes.
 
 #include <getopt.h>
 
 #include <algorithm>
 #include <chrono>
 #include <cstdio>
+#include <iomanip>
 #include <iostream>
 #include <locale>
 #include <random>
+#include <string>
 #include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include "wort.hpp"
@@ -23,7 +31,8 @@ extern char *optarg;
 // Test parameter
 size_t test_size;    // The number of insert operation count
 size_t thread_num;   // The number of created threads
-size_t key_len = 8;  // by default, WORT can only use 8B string value
+size_t key_len = 8;  // keys of any length, 8B by default
+bool var_key_len = false;  // draw key lengths from [1, key_len]
 
 struct ThreadResults {
   uint64_t throughput;
@@ -34,12 +43,18 @@ struct ThreadResults {
 static constexpr size_t max_thread_num =
     32;  // Set maximum running thread number
 
+// Number of values each scan of the scan check collects
+static constexpr size_t scan_len = 16;
+
 // Test framework data unit
 using testpair = std::pair<const char *, size_t>;
 
 // Insert & Search data for correctness test
 std::vector<testpair> thread_data[max_thread_num];
 
+// All keys in key order, scans are checked against it
+std::vector<testpair> sorted_data;
+
 // Evaluation index for insert & search operation
 PIE::Allocator *nvm_allocator, *dram_allocator;
 PIE::Index *test_index;
@@ -51,14 +66,82 @@ std::thread threads[max_thread_num];
 void InitTest();
 void DoInsert();
 void DoSearch();
+void DoUpdate();
+void DoScan();
+
+static std::string generate_string(
+    const std::unordered_set<std::string> &keys);
+
+// Value a key holds after DoUpdate
+static void *UpdatedValue(const testpair &item) {
+  return (void *)(item.first + 1);
+}
+
+// Key order of WORT: bytewise, a prefix sorts first
+static bool KeyLess(const testpair &a, const testpair &b) {
+  int cmp = memcmp(a.first, b.first, std::min(a.second, b.second));
+  return cmp ? cmp < 0 : a.second < b.second;
+}
+
+// Run "work" on every thread and print its throughput and success ratio
+template <typename Work>
+static void RunPhase(const char *phase, Work work) {
+  auto execute = [&](int thread_id) {
+    auto start = std::chrono::high_resolution_clock::now();
+    uint64_t fail_time = work(thread_id);
+    auto end = std::chrono::high_resolution_clock::now();
+    auto dura =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
 
-static const char *generate_string();
+    // Calculate iops for each second
+    double iops = thread_data[thread_id].size() * 1e9 / (dura.count());
+
+    thread_results[thread_id].fail_cnt = fail_time;
+    thread_results[thread_id].pass_time = dura.count();
+    thread_results[thread_id].throughput = iops;
+  };
+
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    threads[i] = std::thread(execute, i);
+  }
+
+  // Wait for all threads exiting
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    threads[i].join();
+  }
+
+  // Calculate total throughput and other information to print
+  uint64_t total_opts = 0, fail_cnt = 0;
+  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
+    total_opts += thread_results[i].throughput;
+    fail_cnt += thread_results[i].fail_cnt;
+  }
+
+  double succ_ratio = (double)(test_size - fail_cnt) / test_size;
+  double mem_use = (double)(nvm_allocator->MemUsage()) / (1024 * 1024);
+  double kops = (double)total_opts / 1000;
+  std::cout << "[WORT Finish " << phase << "]\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n";
+  std::cout << "|    Index   | Thread Number | Throughput(kops/s) | Success "
+               "Ratio | Memory Usage(MB) |\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n";
+  std::cout << "| " << std::setw(strlen("   Index  ")) << "WORT"
+            << " | " << std::setw(strlen("Thread Number")) << thread_num
+            << " | " << std::setw(strlen("Throughput(kops/s)")) << kops << " | "
+            << std::setw(strlen("Success Ratio")) << succ_ratio << " | "
+            << std::setw(strlen("Memory Usage(MB)")) << mem_use << " |\n";
+  std::cout << "---------------------------------------------------------------"
+               "-----------------------\n\n";
+}
 
 int main(int argc, char *argv[]) {
   // Parse parameters
   struct option long_options[] = {{"size", required_argument, nullptr, 1},
                                   {"thread_num", required_argument, nullptr, 2},
-                                  {"key_len", required_argument, nullptr, 3}};
+                                  {"key_len", required_argument, nullptr, 3},
+                                  {"var_key_len", required_argument, nullptr, 4}};
 
   int opt_idx, c;
   while (EOF != (c = getopt_long(argc, argv, "s:t:", long_options, &opt_idx))) {
@@ -72,6 +155,9 @@ int main(int argc, char *argv[]) {
       case 3:
         key_len = atoll(optarg);
         break;
+      case 4:
+        var_key_len = (atoll(optarg) != 0);
+        break;
       default:
         std::cerr << "Invalid Parameter: " << optarg << "\n";
     }
@@ -88,11 +174,18 @@ int main(int argc, char *argv[]) {
   // previously inserted key
   DoSearch();
 
+  // Replace every value, then check that searches see the new one
+  DoUpdate();
+
+  // Check scans starting at every key against the sorted keys
+  DoScan();
+
   return 0;
 }
 
 void InitTest() {
-  assert(test_size > 0 && thread_num > 0);
+  assert(test_size > 0 && thread_num > 0 && thread_num <= max_thread_num);
+  assert(key_len > 0);
 
   const size_t pmem_size = 100ULL * 1024 * 1024 * 1024;
 
@@ -102,31 +195,29 @@ void InitTest() {
 
   test_index = new PIE::WORT::WORTIndex(nvm_allocator);
 
-  // generate test data;
+  // generate test data, keys are unique so that every operation has to
+  // succeed;
   // Apparently, each thread will have relatively average
   // size of test data
+  std::unordered_set<std::string> keys;
   decltype(test_size) cnt = 0;
   while (cnt < test_size) {
-#ifdef STRINGKEY
-    const char *key = generate_string();
-#else
-    uint64_t key = rand() % UINT64_MAX;
-    key_len = 0;
-#endif
-    thread_data[cnt % thread_num].push_back({(const char *)key, key_len});
+    std::string str = generate_string(keys);
+    keys.insert(str);
+    char *key = new char[str.size()];
+    memcpy(key, str.data(), str.size());
+    thread_data[cnt % thread_num].push_back({key, str.size()});
+    sorted_data.push_back({key, str.size()});
     ++cnt;
   }
+  std::sort(sorted_data.begin(), sorted_data.end(), KeyLess);
 
   printf("[Finish Init Test]\n");
 }
 
 void DoInsert() {
-  // A simple per-thread work
-  auto execute = [](int thread_id) {
-    int fail_time = 0;
-
-    auto start = std::chrono::high_resolution_clock::now();
-
+  RunPhase("Insertion", [](int thread_id) {
+    uint64_t fail_time = 0;
     for (const auto &item : thread_data[thread_id]) {
       // The inserted value is the same of key
       // in order to make value check simple
@@ -136,135 +227,113 @@ void DoInsert() {
         fail_time++;
       }
     }
-    auto end = std::chrono::high_resolution_clock::now();
-    auto dura =
-        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
-
-    // Calculate iops for each second
-    double iops = thread_data[thread_id].size() * 1e9 / (dura.count());
-
-    thread_results[thread_id].fail_cnt = fail_time;
-    thread_results[thread_id].pass_time = dura.count();
-    thread_results[thread_id].throughput = iops;
-  };
-
-  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
-    threads[i] = std::thread(execute, i);
-  }
-
-  // Wait for all threads exiting
-  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
-    threads[i].join();
-  }
-
-  // Calculate total throughput and other information to print
-  uint64_t total_opts = 0, pass_time = 0, fail_cnt = 0;
-  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
-    total_opts += thread_results[i].throughput;
-    fail_cnt += thread_results[i].fail_cnt;
-    pass_time = std::max(pass_time, thread_results[i].fail_cnt);
-  }
-
-  double succ_ratio = (double)(test_size - fail_cnt) / test_size;
-  double mem_use = (double)(nvm_allocator->MemUsage()) / (1024 * 1024);
-  double kops = (double)total_opts / 1000;
-  std::cout << "[WORT Finish Insertion]\n";
-  std::cout << "---------------------------------------------------------------"
-               "-----------------------\n";
-  std::cout << "|    Index   | Thread Number | Throughput(kops/s) | Success "
-               "Ratio | Memory Usage(MB) |\n";
-  std::cout << "---------------------------------------------------------------"
-               "-----------------------\n";
-  // std::cout << "| |\n";
-  std::cout << "| " << std::setw(strlen("   Index  ")) << "WORT"
-            << " | " << std::setw(strlen("Thread Number")) << thread_num
-            << " | " << std::setw(strlen("Throughput(kops/s)")) << kops << " | "
-            << std::setw(strlen("Success Ratio")) << succ_ratio << " | "
-            << std::setw(strlen("Memory Usage(MB)")) << mem_use << " |\n";
-
-  // std::cout << "| |\n";
-  std::cout << "---------------------------------------------------------------"
-               "-----------------------\n\n";
+    return fail_time;
+  });
 }
 
 void DoSearch() {
-  // A simple per-thread work
-  auto check = [](int thread_id) {
-    int fail_time = 0;
-
-    auto start = std::chrono::high_resolution_clock::now();
-
+  RunPhase("Check", [](int thread_id) {
+    uint64_t fail_time = 0;
     void *value;
-
     for (const auto &item : thread_data[thread_id]) {
-      // The inserted value is the same of key
-      // in order to make value check simple
       PIE::status_code_t stat =
           test_index->Search(item.first, item.second, &value);
       if (stat != PIE::kOk || value != (void *)(item.first)) {
         fail_time++;
       }
     }
-    auto end = std::chrono::high_resolution_clock::now();
-    auto dura =
-        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
-
-    // Calculate iops for each second
-    double iops = thread_data[thread_id].size() * 1e9 / (dura.count());
-
-    thread_results[thread_id].fail_cnt = fail_time;
-    thread_results[thread_id].pass_time = dura.count();
-    thread_results[thread_id].throughput = iops;
-  };
-
-  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
-    threads[i] = std::thread(check, i);
-  }
-
-  // Wait for all threads exiting
-  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
-    threads[i].join();
-  }
+    return fail_time;
+  });
+}
 
-  // Calculate total throughput and other information to print
-  uint64_t total_opts = 0, pass_time = 0, fail_cnt = 0;
-  for (decltype(thread_num) i = {0}; i < thread_num; ++i) {
-    total_opts += thread_results[i].throughput;
-    fail_cnt += thread_results[i].fail_cnt;
-    pass_time = std::max(pass_time, thread_results[i].fail_cnt);
-  }
+void DoUpdate() {
+  RunPhase("Update", [](int thread_id) {
+    uint64_t fail_time = 0;
+    void *value;
+    size_t pos = 0;
+    for (const auto &item : thread_data[thread_id]) {
+      // Alternate between Update and Upsert of an existing key, both
+      // replace the value in place
+      PIE::status_code_t stat =
+          (pos++ % 2 == 0)
+              ? test_index->Update(item.first, item.second, UpdatedValue(item))
+              : test_index->Upsert(item.first, item.second, UpdatedValue(item));
+      if (stat != PIE::kOk) {
+        fail_time++;
+        continue;
+      }
+      stat = test_index->Search(item.first, item.second, &value);
+      if (stat != PIE::kOk || value != UpdatedValue(item)) {
+        fail_time++;
+      }
+    }
+    return fail_time;
+  });
+}
 
-  double succ_ratio = (double)(test_size - fail_cnt) / test_size;
-  double mem_use = (double)(nvm_allocator->MemUsage()) / (1024 * 1024);
-  double kops = (double)total_opts / 1000;
+void DoScan() {
+  RunPhase("Scan", [](int thread_id) {
+    uint64_t fail_time = 0;
+    void *vec[scan_len + 1];
+    for (const auto &item : thread_data[thread_id]) {
+      size_t pos = std::lower_bound(sorted_data.begin(), sorted_data.end(),
+                                    item, KeyLess) -
+                   sorted_data.begin();
+      size_t expect = std::min(scan_len, sorted_data.size() - pos);
+      bool fail = false;
+
+      // ScanCount returns the values of the next keys, starting key included
+      std::fill(vec, vec + scan_len + 1, nullptr);
+      test_index->ScanCount(item.first, item.second, scan_len, vec);
+      for (size_t i = 0; i < scan_len; ++i) {
+        void *want = i < expect ? UpdatedValue(sorted_data[pos + i]) : nullptr;
+        fail |= (vec[i] != want);
+      }
 
-  std::cout << "[WORT Finish Check]\n";
-  std::cout << "---------------------------------------------------------------"
-               "-----------------------\n";
-  std::cout << "|    Index   | Thread Number | Throughput(kops/s) | Success "
-               "Ratio | Memory Usage(MB) |\n";
-  std::cout << "---------------------------------------------------------------"
-               "-----------------------\n";
-  // std::cout << "| |\n";
-  std::cout << "| " << std::setw(strlen("   Index  ")) << "WORT"
-            << " | " << std::setw(strlen("Thread Number")) << thread_num
-            << " | " << std::setw(strlen("Throughput(kops/s)")) << kops << " | "
-            << std::setw(strlen("Success Ratio")) << succ_ratio << " | "
-            << std::setw(strlen("Memory Usage(MB)")) << mem_use << " |\n";
+      // Scan stops right before its end key
+      if (pos + scan_len < sorted_data.size()) {
+        const testpair &end = sorted_data[pos + scan_len];
+        std::fill(vec, vec + scan_len + 1, nullptr);
+        test_index->Scan(item.first, item.second, end.first, end.second, vec);
+        for (size_t i = 0; i <= scan_len; ++i) {
+          void *want =
+              i < scan_len ? UpdatedValue(sorted_data[pos + i]) : nullptr;
+          fail |= (vec[i] != want);
+        }
+      }
 
-  // std::cout << "| |\n";
-  std::cout << "---------------------------------------------------------------"
-               "-----------------------\n\n";
+      if (fail) {
+        fail_time++;
+      }
+    }
+    return fail_time;
+  });
 }
 
-// randomly generate a string key
-static const char *generate_string() {
-  char *ret = new char[key_len];
-  decltype(key_len) cnt = 0;
-  // randomly write data
-  while (cnt++ < key_len) {
-    auto idx = rand() % key_len;
-    ret[idx] = rand() % 255;
+// randomly generate a string key that is not in "keys" yet. In variable
+// length mode, every eighth key extends an existing key by zero bytes
+static std::string generate_string(
+    const std::unordered_set<std::string> &keys) {
+  static std::mt19937_64 rng(0);
+  static std::vector<std::string> shorter;  // keys that may be extended
+  while (true) {
+    std::string ret;
+    if (var_key_len && !shorter.empty() && rng() % 8 == 0) {
+      ret = shorter[rng() % shorter.size()];
+      ret.resize(std::min(key_len, ret.size() + 1 + rng() % 3), '\0');
+    } else {
+      size_t len = var_key_len ? 1 + rng() % key_len : key_len;
+      ret.resize(len);
+      for (auto &byte : ret) {
+        byte = rng() % 256;
+      }
+    }
+    if (keys.count(ret)) {
+      continue;
+    }
+    if (var_key_len && ret.size() < key_len) {
+      shorter.push_back(ret);
+    }
+    return ret;
   }
-  return reinterpret_cast<const char *>(ret);
-}
\ No newline at end of file
+}
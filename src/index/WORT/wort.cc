@@ -3,196 +3,693 @@
 namespace PIE {
 namespace WORT {
 
-#define WORT_ISLEAF(x) (((uintptr_t)x & 1))
-#define WORT_SETLEAF(x) ((void *)((uintptr_t)x | 1))
-#define WORT_LEAFRAW(x) ((art_leaf *)((void *)((uintptr_t)x & ~1)))
-
-void *WORTIndex::recursive_insert(art_node *n, art_node **ref, const char *key,
-                                  size_t key_len, void *value, int depth,
-                                  int *old, bool replace) {
-  // Create a new leaf if facing an empty subtrie
-  if (!n) {
-    *ref = (art_node *)WORT_SETLEAF(AllocLeaf(key, key_len, value));
-    asm_clwb(ref);  // persist reference position
-    return nullptr;
-  }
-
-  // facing a leaf, may need to check if we need to update this leaf (if key
-  // completely matches) or split this leaf with adding an inner node
-  if (WORT_ISLEAF(n)) {
-    art_leaf *leaf = WORT_LEAFRAW(n);
-    // CONDITION1: Updating current leaf Check if updating an existing value
-    if (!leaf_matches(leaf, key, key_len)) {
-      // if no need to replace this leaf with new value:
-      *old = 1;       // indicate this key already exist
-      if (replace) {  // upsert
-        leaf->value = value;
-        persist_data((char *)leaf, sizeof(art_leaf));  // persist
+namespace {
+
+// The leaf chunk a thread currently carves leaves from. It belongs to the
+// tree whose leaf_pool_id_ equals owner, another tree starts a new chunk
+struct LeafChunk {
+  uint64_t owner = 0;
+  char *cur = nullptr;
+  char *end = nullptr;
+};
+
+thread_local LeafChunk leaf_chunk;
+
+std::atomic<uint64_t> leaf_pool_ids{1};
+
+// Slot lookup of Node4 and Node16. Valid slots form a prefix of children,
+// the pointer of a slot is loaded before its token since it is written after
+template <typename Node>
+WORTIndex::art_node **KeyedChildRef(Node *p, uint8_t c) {
+  constexpr size_t kSlots = sizeof(p->keys);
+  for (size_t i = 0; i < kSlots; ++i) {
+    if (__atomic_load_n(&p->children[i], __ATOMIC_ACQUIRE) == nullptr) {
+      break;
+    }
+    if (p->keys[i] == c) {
+      return &p->children[i];
+    }
+  }
+  return nullptr;
+}
+
+// Append a slot to Node4 or Node16. A crash before the pointer store leaves
+// an invalid slot whose token is overwritten by the next append
+template <typename Node>
+void KeyedAddChild(Node *p, uint8_t c, void *child, bool persist) {
+  size_t slot = 0;
+  while (p->children[slot]) {
+    ++slot;
+  }
+  p->keys[slot] = c;
+  // token and pointer may live in different cachelines, the token has to
+  // be durable first
+  if (persist && ((uintptr_t)&p->keys[slot] >> 6) !=
+                     ((uintptr_t)&p->children[slot] >> 6)) {
+    asm_clwb(&p->keys[slot]);
+    asm_sfence();
+  }
+  __atomic_store_n(&p->children[slot], (WORTIndex::art_node *)child,
+                   __ATOMIC_RELEASE);
+  if (persist) {
+    asm_clwb(&p->children[slot]);
+    asm_sfence();
+  }
+}
+
+// Child lookup of Node4 and Node16 on the read path. A token may be read
+// before its slot is published, the null pointer or the version check of
+// the caller covers that
+template <typename Node>
+WORTIndex::art_node *KeyedFindChild(Node *p, uint8_t c) {
+  constexpr size_t kSlots = sizeof(p->keys);
+  for (size_t i = 0; i < kSlots; ++i) {
+    if (p->keys[i] == c) {
+      WORTIndex::art_node *child =
+          __atomic_load_n(&p->children[i], __ATOMIC_ACQUIRE);
+      if (child) {
+        return child;
+      }
+    }
+  }
+  return nullptr;
+}
+
+template <typename Node>
+void KeyedCopyChildren(const Node *p, WORTIndex::art_node **children) {
+  constexpr size_t kSlots = sizeof(p->keys);
+  for (size_t i = 0; i < kSlots; ++i) {
+    WORTIndex::art_node *child =
+        __atomic_load_n(&p->children[i], __ATOMIC_ACQUIRE);
+    if (!child) {
+      break;
+    }
+    children[p->keys[i]] = child;
+  }
+}
+
+}  // namespace
+
+WORTIndex::art_node **WORTIndex::child_ref(art_node *n, uint16_t c) {
+  if (c == kEndToken) {
+    return __atomic_load_n(&n->end_leaf, __ATOMIC_ACQUIRE) ? &n->end_leaf
+                                                            : nullptr;
+  }
+  switch (n->type) {
+    case kNode4:
+      return KeyedChildRef((art_node4 *)n, c);
+    case kNode16:
+      return KeyedChildRef((art_node16 *)n, c);
+    case kNode48: {
+      art_node48 *p = (art_node48 *)n;
+      uint8_t idx = __atomic_load_n(&p->child_index[c], __ATOMIC_ACQUIRE);
+      return idx ? &p->children[idx - 1] : nullptr;
+    }
+    default: {
+      art_node_full *p = (art_node_full *)n;
+      if (__atomic_load_n(&p->children[c], __ATOMIC_ACQUIRE)) {
+        return &p->children[c];
       }
       return nullptr;
     }
+  }
+}
+
+WORTIndex::art_node *WORTIndex::find_child(art_node *n, uint16_t c) {
+  if (c == kEndToken) {
+    return __atomic_load_n(&n->end_leaf, __ATOMIC_ACQUIRE);
+  }
+  switch (n->type) {
+    case kNode4:
+      return KeyedFindChild((art_node4 *)n, c);
+    case kNode16:
+      return KeyedFindChild((art_node16 *)n, c);
+    case kNode48: {
+      art_node48 *p = (art_node48 *)n;
+      uint8_t idx = __atomic_load_n(&p->child_index[c], __ATOMIC_ACQUIRE);
+      return idx ? __atomic_load_n(&p->children[idx - 1], __ATOMIC_ACQUIRE)
+                 : nullptr;
+    }
+    default:
+      return __atomic_load_n(&((art_node_full *)n)->children[c],
+                             __ATOMIC_ACQUIRE);
+  }
+}
+
+void WORTIndex::add_child(art_node *n, uint16_t c, void *child,
+                          bool persist) {
+  if (c == kEndToken) {
+    __atomic_store_n(&n->end_leaf, (art_node *)child, __ATOMIC_RELEASE);
+    if (persist) {
+      asm_clwb(&n->end_leaf);
+      asm_sfence();
+    }
+    return;
+  }
+  switch (n->type) {
+    case kNode4:
+      KeyedAddChild((art_node4 *)n, c, child, persist);
+      return;
+    case kNode16:
+      KeyedAddChild((art_node16 *)n, c, child, persist);
+      return;
+    case kNode48: {
+      // Readers only reach a slot through child_index, thus the pointer is
+      // persisted before the index byte publishes it
+      art_node48 *p = (art_node48 *)n;
+      int slot = 0;
+      while (p->children[slot]) {
+        ++slot;
+      }
+      __atomic_store_n(&p->children[slot], (art_node *)child,
+                       __ATOMIC_RELEASE);
+      if (persist) {
+        asm_clwb(&p->children[slot]);
+        asm_sfence();
+      }
+      __atomic_store_n(&p->child_index[c], (uint8_t)(slot + 1),
+                       __ATOMIC_RELEASE);
+      if (persist) {
+        asm_clwb(&p->child_index[c]);
+        asm_sfence();
+      }
+      return;
+    }
+    default: {
+      art_node_full *p = (art_node_full *)n;
+      __atomic_store_n(&p->children[c], (art_node *)child, __ATOMIC_RELEASE);
+      if (persist) {
+        asm_clwb(&p->children[c]);
+        asm_sfence();
+      }
+      return;
+    }
+  }
+}
 
-    // CONDITION2: Split leaf with adding an inner node. However we need to
-    // find out the longest common prefix between new key and old key and "push"
-    // them onto the newly created inner node
-    art_node16 *new_node = reinterpret_cast<art_node16 *>(AllocNode());
-    new_node->n.depth = depth;
+void WORTIndex::replace_child(art_node *n, uint16_t c, void *child) {
+  art_node **ref = child_ref(n, c);
+  __atomic_store_n(ref, (art_node *)child, __ATOMIC_RELEASE);
+  asm_clwb(ref);
+  asm_sfence();
+}
 
-    // Create a new leaf to store newly inserted key
-    art_leaf *newleaf = AllocLeaf(key, key_len, value);
+void WORTIndex::copy_children(const art_node *n, art_node **children) {
+  memset((void *)children, 0, sizeof(art_node *) * kNumNodeEntries);
+  switch (n->type) {
+    case kNode4:
+      KeyedCopyChildren((const art_node4 *)n, children);
+      return;
+    case kNode16:
+      KeyedCopyChildren((const art_node16 *)n, children);
+      return;
+    case kNode48: {
+      const art_node48 *p = (const art_node48 *)n;
+      for (uint64_t c = 0; c < kNumNodeEntries; ++c) {
+        uint8_t idx = __atomic_load_n(&p->child_index[c], __ATOMIC_ACQUIRE);
+        if (idx) {
+          children[c] = __atomic_load_n(&p->children[idx - 1], __ATOMIC_ACQUIRE);
+        }
+      }
+      return;
+    }
+    default: {
+      const art_node_full *p = (const art_node_full *)n;
+      for (uint64_t c = 0; c < kNumNodeEntries; ++c) {
+        children[c] = __atomic_load_n(&p->children[c], __ATOMIC_ACQUIRE);
+      }
+      return;
+    }
+  }
+}
 
-    // Determine longest prefix
-    int longest_prefix = longest_common_prefix(leaf, newleaf, depth);
-    new_node->n.partial_len = longest_prefix;
+bool WORTIndex::node_full(const art_node *n) {
+  switch (n->type) {
+    case kNode4:
+      return ((const art_node4 *)n)->children[3] != nullptr;
+    case kNode16:
+      return ((const art_node16 *)n)->children[15] != nullptr;
+    case kNode48: {
+      const art_node48 *p = (const art_node48 *)n;
+      for (int slot = 0; slot < 48; ++slot) {
+        if (!p->children[slot]) {
+          return false;
+        }
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
 
-    // Set the longest common prefix of new inner node
-    for (uint64_t i = 0; i < std::min(kMaxPrefixLen, (uint64_t)longest_prefix); i++) {
-      SetToken((char *)new_node->n.partial, i, TokenAt(key, depth + i));
+WORTIndex::art_node *WORTIndex::grow_node(art_node *n, uint8_t c,
+                                          void *child) {
+  uint8_t type = (kNodeBits == 4 || n->type == kNode48) ? kNodeFull
+                                                         : n->type + 1;
+  art_node *new_node = AllocNode(type);
+  // Copy the 8B header, the version word of the copy starts from zero
+  *((uint64_t *)new_node) = *((uint64_t *)n);
+  new_node->end_leaf = n->end_leaf;
+
+  art_node *children[kNumNodeEntries];
+  copy_children(n, children);
+  for (uint64_t i = 0; i < kNumNodeEntries; ++i) {
+    if (children[i]) {
+      add_child(new_node, i, children[i], false);
     }
+  }
+  add_child(new_node, c, child, false);
+  persist_data((char *)new_node, node_size(type));
+  return new_node;
+}
 
-    // Add child for new node: both old leaf and new leaf
-    add_child(new_node,
-              TokenAt((const char *)leaf->key, depth + longest_prefix),
-              WORT_SETLEAF(leaf));
-    add_child(new_node,
-              TokenAt((const char *)newleaf->key, depth + longest_prefix),
-              WORT_SETLEAF(newleaf));
+uint64_t WORTIndex::NextLeafPoolId() {
+  return leaf_pool_ids.fetch_add(1, std::memory_order_relaxed);
+}
 
-    persist_data((char *)new_node, sizeof(art_node16));
-    persist_data((char *)newleaf, sizeof(art_leaf));
+void *WORTIndex::AllocLeafSlot(size_t size) {
+  size = (size + kLeafAlign - 1) & ~(kLeafAlign - 1);
+  LeafChunk &chunk = leaf_chunk;
+  if (chunk.owner == leaf_pool_id_ && chunk.cur) {
+    // Move to the next cache line rather than straddling two of them, so a
+    // leaf is flushed with a single clwb
+    uintptr_t line_end = ((uintptr_t)chunk.cur | (kCacheLineSize - 1)) + 1;
+    if ((uintptr_t)chunk.cur + size > line_end) {
+      chunk.cur = (char *)line_end;
+    }
+  }
+  if (chunk.owner != leaf_pool_id_ || chunk.cur + size > chunk.end) {
+    // The rest of a previous chunk is left unused
+    chunk.owner = leaf_pool_id_;
+    chunk.cur = reinterpret_cast<char *>(
+        nvmallocator_->AllocateAlign(kLeafChunkSize, kCacheLineSize));
+    chunk.end = chunk.cur + kLeafChunkSize;
+  }
+  void *ret = chunk.cur;
+  chunk.cur += size;
+  return ret;
+}
 
-    // Atomically write to make all above change crash consistent
-    *ref = (art_node *)new_node;
-    asm_clwb(ref);
-    asm_sfence();
+status_code_t WORTIndex::art_insert(const char *key, size_t key_len,
+                                    void *value, bool replace) {
+restart:
+  bool need_restart = false;
+  art_node *n = nullptr, *next = root_, *parent = nullptr;
+  uint64_t version = 0, parent_version = 0;
+  uint16_t token = 0, parent_token = 0;
+  int depth = 0;
 
-    return nullptr;
-  }
-
-  // Facing an inner node: it denotes a subtrie, we need to check if it needs
-  // to do split or else
-  if (n->depth != depth) {
-    // Recover prefix
-  }  // However, in our test, this would never happen
-
-  if (n->partial_len) {
-    // If this inner node has some prefix
-    // Check current key's lookup token matches this node's prefix or not
-    art_leaf *leaf = nullptr;
-    int prefix_diff = prefix_mismatch(n, key, key_len, depth, &leaf);
-    // CONDITION1. matches
-    // Skipped the prefix
-    if ((uint32_t)prefix_diff >= n->partial_len) {
-      depth += n->partial_len;
-      goto RECURSIVE_SEARCH;
-    }
-
-    // Condition2. Paritially match
-    // Create a new node to split common prefix
-    // STEP1. Allocate new inner node and set its first 8B header and pointer
-    art_node16 *new_node = (art_node16 *)AllocNode();
-    new_node->n.depth = depth;
-    new_node->n.partial_len = prefix_diff;
-    // Copy prefix_diff number token from n to newnode
-    auto copytoken_cnt = std::min(kMaxPrefixLen, (uint64_t)prefix_diff);
-    for (auto i = decltype(copytoken_cnt){0}; i < copytoken_cnt; ++i) {
-      SetToken((char *)new_node->n.partial, i,
-               TokenAt((const char *)n->partial, i));
-    }
-
-    // Generate old node update data
-    art_node tmp_path;
-    if (n->partial_len <= kMaxPrefixLen) {
-      add_child(new_node, TokenAt((const char *)n->partial, prefix_diff), n);
-      // Set tmp_path related information
-      tmp_path.partial_len = n->partial_len - (prefix_diff + 1);
-      tmp_path.depth = (depth + prefix_diff + 1);
-      // memcpy(tmp_path.partial, n->partial + prefix_diff + 1,
-      // std::min(kMaxPrefixLen, (uint64_t)tmp_path.partial_len)); tmp path's
-      // prefix needs to be modified
+  while (true) {
+    parent = n;
+    parent_version = version;
+    parent_token = token;
+    n = next;
+    version = n->ReadLockOrRestart(need_restart);
+    if (need_restart) goto restart;
+    // n must still be the child of parent, so that its header below is not
+    // a prefix split in progress
+    if (parent) {
+      parent->CheckOrRestart(parent_version, need_restart);
+      if (need_restart) goto restart;
+    }
+
+    // Facing an inner node: it denotes a subtrie, we need to check if it needs
+    // to do split or else
+    if (n->depth != depth) {
+      // Recover prefix: a crash between STEP2 and STEP3 of a prefix split
+      // leaves n with its new header while the parent still points to n.
+      // Every key below n shares the tokens from depth up to the end of n's
+      // prefix, thus n takes them back from one of its leaves
+      n->UpgradeToWriteLockOrRestart(version, need_restart);
+      if (need_restart) goto restart;
+      art_node *leaf = any_leaf(n);
+      art_node tmp_path;
+      memset((void *)&tmp_path, 0, sizeof(uint64_t));
+      tmp_path.depth = depth;
+      tmp_path.partial_len = n->depth + n->partial_len - depth;
       auto copytoken_cnt =
           std::min(kMaxPrefixLen, (uint64_t)tmp_path.partial_len);
+      for (auto i = decltype(copytoken_cnt){0}; i < copytoken_cnt; ++i) {
+        SetToken((char *)tmp_path.partial, i,
+                 TokenAt(leaf_key(leaf), leaf_key_len(leaf), depth + i));
+      }
+      __atomic_store_n((uint64_t *)n, *((uint64_t *)&tmp_path),
+                       __ATOMIC_RELAXED);
+      asm_clwb((char *)n);
+      asm_sfence();
+      n->WriteUnlock();
+      goto restart;
+    }
 
+    if (n->partial_len) {
+      // If this inner node has some prefix
+      // Check current key's lookup token matches this node's prefix or not
+      art_node *leaf = nullptr;
+      int prefix_diff = prefix_mismatch(n, key, key_len, depth, &leaf);
+      // CONDITION1. matches
+      // Skipped the prefix
+      if ((uint32_t)prefix_diff >= n->partial_len) {
+        depth += n->partial_len;
+        goto RECURSIVE_SEARCH;
+      }
+
+      // Condition2. Paritially match
+      // Both the parent's child pointer and the header of n are modified,
+      // thus lock both of them. The root never has a prefix, so a node with
+      // prefix always has a parent
+      parent->UpgradeToWriteLockOrRestart(parent_version, need_restart);
+      if (need_restart) goto restart;
+      n->UpgradeToWriteLockOrRestart(version, need_restart);
+      if (need_restart) {
+        parent->WriteUnlock();
+        goto restart;
+      }
+
+      // Token i of n's full prefix, taken from a leaf if it is not stored
+      if (n->partial_len > kMaxPrefixLen && !leaf) {
+        leaf = any_leaf(n);
+      }
+      auto prefix_token = [&](int i) -> uint8_t {
+        if (n->partial_len <= kMaxPrefixLen) {
+          return TokenAt((const char *)n->partial, i);
+        }
+        return TokenAt(leaf_key(leaf), leaf_key_len(leaf), depth + i);
+      };
+
+      // Create a new node to split common prefix
+      // STEP1. Allocate new inner node and set its first 8B header and pointer
+      art_node *new_node = AllocNode(kNode4);
+      new_node->depth = depth;
+      new_node->partial_len = prefix_diff;
+      // Copy prefix_diff number token from n to newnode
+      auto copytoken_cnt = std::min(kMaxPrefixLen, (uint64_t)prefix_diff);
+      for (auto i = decltype(copytoken_cnt){0}; i < copytoken_cnt; ++i) {
+        SetToken((char *)new_node->partial, i, prefix_token(i));
+      }
+
+      // Generate old node update data
+      art_node tmp_path;
+      memset((void *)&tmp_path, 0, sizeof(uint64_t));
+      add_child(new_node, prefix_token(prefix_diff), n, false);
+      // Set tmp_path related information
+      tmp_path.partial_len = n->partial_len - (prefix_diff + 1);
+      tmp_path.depth = (depth + prefix_diff + 1);
+      // tmp path's prefix needs to be modified
+      copytoken_cnt = std::min(kMaxPrefixLen, (uint64_t)tmp_path.partial_len);
       for (auto i = decltype(copytoken_cnt){0}; i < copytoken_cnt; ++i) {
         SetToken((char *)tmp_path.partial, i,
-                 TokenAt((const char *)n->partial, prefix_diff + 1 + i));
+                 prefix_token(prefix_diff + 1 + i));
       }
+
+      leaf = AllocLeaf(key, key_len, value);
+      // Add newly created leaf to new create inner node
+      add_child(new_node, TokenAt(key, key_len, depth + prefix_diff), leaf,
+                false);
+      persist_data((char *)new_node, node_size(kNode4));
+
+      // STEP2. Atomically update header of old leaf
+      __atomic_store_n((uint64_t *)n, *((uint64_t *)&tmp_path),
+                       __ATOMIC_RELAXED);
+      asm_clwb((char *)n);
+      asm_mfence();
+
+      // STEP3. Atomically update parent node's pointer to newly created inner
+      // node
+      replace_child(parent, parent_token, new_node);
+
+      n->WriteUnlock();
+      parent->WriteUnlock();
+      return kOk;
     }
 
-    leaf = AllocLeaf(key, key_len, value);
-    // Add newly created leaf to new create inner node
-    add_child(new_node, TokenAt(key, depth + prefix_diff), WORT_SETLEAF(leaf));
-    persist_data((char *)new_node, sizeof(art_node16));
-    persist_data((char *)leaf, sizeof(art_leaf));
+  RECURSIVE_SEARCH:
+    // Search next level node only when:
+    //  1. Successfully jump over last node's prefix
+    //  2. last node has no prefix
+    token = TokenAt(key, key_len, depth);
+    next = find_child(n, token);
+    n->CheckOrRestart(version, need_restart);
+    if (need_restart) goto restart;
 
-    // STEP2. Atomically update header of old leaf
-    *((uint64_t *)n) = *((uint64_t *)&tmp_path);
-    asm_clwb((char *)n);
-    asm_mfence();
+    if (!next) {
+      // Current node has no next level, then make a leaf for it. The end
+      // leaf has a slot of its own
+      if (token != kEndToken && node_full(n)) {
+        // Replace n with a larger copy, which swaps the parent's pointer.
+        // The root is a full node, thus n has a parent
+        parent->UpgradeToWriteLockOrRestart(parent_version, need_restart);
+        if (need_restart) goto restart;
+        n->UpgradeToWriteLockOrRestart(version, need_restart);
+        if (need_restart) {
+          parent->WriteUnlock();
+          goto restart;
+        }
+        art_node *leaf = AllocLeaf(key, key_len, value);
+        art_node *new_node = grow_node(n, token, leaf);
 
-    // STEP3. Atomically update parent node's pointer to newly created inner
-    // node
-    *ref = (art_node *)new_node;
+        // Atomically write
+        replace_child(parent, parent_token, new_node);
 
-    asm_clwb(ref);
-    asm_mfence();
+        n->WriteUnlockObsolete();
+        parent->WriteUnlock();
+        return kOk;
+      }
 
-    return nullptr;
-  }
+      n->UpgradeToWriteLockOrRestart(version, need_restart);
+      if (need_restart) goto restart;
+      art_node *leaf = AllocLeaf(key, key_len, value);
 
-RECURSIVE_SEARCH:
-  // Recursively search next level node only when:
-  //  1. Successfully jump over last node's prefix
-  //  2. last node has no prefix
-  art_node **child = find_child(n, TokenAt(key, depth));
-  if (child) {
-    return recursive_insert(*child, child, key, key_len, value, depth + 1, old,
-                            replace);
-  }
-  // Current node has no next level, then make a leaf for it
-  art_leaf *leaf = AllocLeaf(key, key_len, value);
+      // Atomically write
+      add_child(n, token, leaf, true);
 
-  // Atomically write
-  add_child((art_node16 *)n, TokenAt(key, depth), WORT_SETLEAF(leaf));
-  asm_clwb((char *)&(((art_node16 *)n)->children[TokenAt(key, depth)]));
-  asm_sfence();
+      n->WriteUnlock();
+      return kOk;
+    }
 
-  return nullptr;
+    // facing a leaf, may need to check if we need to update this leaf (if key
+    // completely matches) or split this leaf with adding an inner node
+    if (WORT_ISLEAF(next)) {
+      // CONDITION1: Updating current leaf Check if updating an existing value.
+      // Leaves are never freed and the value is a single 8B word, thus this
+      // needs no lock
+      if (!leaf_matches(next, key, key_len)) {
+        if (replace) {  // upsert
+          art_leaf *leaf = WORT_LEAFRAW(next);
+          __atomic_store_n(&leaf->value, value, __ATOMIC_RELEASE);
+          persist_data((char *)&leaf->value, sizeof(void *));  // persist
+        }
+        return kInsertKeyExist;  // indicate this key already exist
+      }
+
+      // CONDITION2: Split leaf with adding an inner node. However we need to
+      // find out the longest common prefix between new key and old key and
+      // "push" them onto the newly created inner node
+      // Both keys continue past depth, otherwise one of them would sit in
+      // the end leaf of n. Thus their tokens differ at the latest where the
+      // shorter key ends
+      int longest_prefix = longest_common_prefix(next, key, key_len, depth + 1);
+
+      n->UpgradeToWriteLockOrRestart(version, need_restart);
+      if (need_restart) goto restart;
+
+      art_node *new_node = AllocNode(kNode4);
+      new_node->depth = depth + 1;
+
+      // Create a new leaf to store newly inserted key
+      art_node *newleaf = AllocLeaf(key, key_len, value);
+
+      new_node->partial_len = longest_prefix;
+
+      // Set the longest common prefix of new inner node
+      for (uint64_t i = 0;
+           i < std::min(kMaxPrefixLen, (uint64_t)longest_prefix); i++) {
+        SetToken((char *)new_node->partial, i,
+                 TokenAt(key, key_len, depth + 1 + i));
+      }
+
+      // Add child for new node: both old leaf and new leaf
+      add_child(new_node,
+                TokenAt(leaf_key(next), leaf_key_len(next),
+                        depth + 1 + longest_prefix),
+                next, false);
+      add_child(new_node, TokenAt(key, key_len, depth + 1 + longest_prefix),
+                newleaf, false);
+
+      persist_data((char *)new_node, node_size(kNode4));
+
+      // Atomically write to make all above change crash consistent
+      replace_child(n, token, new_node);
+
+      n->WriteUnlock();
+      return kOk;
+    }
+
+    depth++;
+  }
 }
 
-void *WORTIndex::art_search(const char *key, size_t key_len) {
-  art_node **child;
+WORTIndex::art_leaf *WORTIndex::art_search(const char *key, size_t key_len) {
+restart:
+  bool need_restart = false;
+  art_node *child;
   art_node *n = root_;
   int depth = 0;
   uint64_t prefix_len;
 
-  while (n) {
-    if (WORT_ISLEAF(n)) {
-      n = reinterpret_cast<art_node *>(WORT_LEAFRAW(n));
-      // check if current key matches the key stored in leaf
-      if (!leaf_matches((art_leaf *)n, key, key_len)) {
-        return ((art_leaf *)n)->value;
+  uint64_t version = n->ReadLockOrRestart(need_restart);
+  if (need_restart) goto restart;
+
+  while (true) {
+    // fail if the stored prefix does not match. Prefix tokens that are not
+    // stored, or not covered by the header after a crash in a prefix split
+    // (n->depth != depth), are skipped and verified by the leaf
+    if (n->depth == depth && n->partial_len) {
+      prefix_len = check_prefix(n, key, key_len, depth);
+      if (prefix_len != std::min(kMaxPrefixLen, (uint64_t)n->partial_len)) {
+        n->CheckOrRestart(version, need_restart);
+        if (need_restart) goto restart;
+        return nullptr;
       }
+    }
+    depth = n->depth + n->partial_len;
+
+    child = find_child(n, TokenAt(key, key_len, depth));
+    n->CheckOrRestart(version, need_restart);
+    if (need_restart) goto restart;
+
+    if (!child) {
       return nullptr;
     }
 
-    if (n->depth == depth) {
-      // fail if prefix does not match
-      if (n->partial_len) {
-        prefix_len = check_prefix(n, key, key_len, depth);
-        if (prefix_len != std::min(kMaxPrefixLen, (uint64_t)n->partial_len)) {
-          return nullptr;
-        }
-        depth += n->partial_len;
+    if (WORT_ISLEAF(child)) {
+      // check if current key matches the key stored in leaf
+      if (!leaf_matches(child, key, key_len)) {
+        return WORT_LEAFRAW(child);
       }
+      return nullptr;
     }
 
-    child = find_child(n, TokenAt(key, depth));
-    n = (child) ? *child : nullptr;
+    // Couple the child's version with its parent: a prefix split that moved
+    // child away in between must be observed through the parent's version
+    uint64_t child_version = child->ReadLockOrRestart(need_restart);
+    if (need_restart) goto restart;
+    n->CheckOrRestart(version, need_restart);
+    if (need_restart) goto restart;
+
+    n = child;
+    version = child_version;
     depth++;
   }
-  return nullptr;
+}
+
+void WORTIndex::snapshot_node(const art_node *n, node_snapshot *snap) {
+  bool need_restart = false;
+  do {
+    // An obsolete node is never written again, thus a scan that already
+    // reached it may still read it
+    uint64_t version = n->ReadLockOrRestart(need_restart);
+    uint64_t header = __atomic_load_n((const uint64_t *)n, __ATOMIC_RELAXED);
+    memcpy((void *)snap, &header, sizeof(header));
+    snap->end_leaf = __atomic_load_n(&n->end_leaf, __ATOMIC_ACQUIRE);
+    copy_children(n, snap->children);
+    n->CheckOrRestart(version, need_restart);
+  } while (need_restart);
+}
+
+WORTIndex::art_node *WORTIndex::any_leaf(const art_node *n) {
+  while (true) {
+    // The key of the end leaf ends right after n's prefix, which it shares
+    art_node *child = __atomic_load_n(&n->end_leaf, __ATOMIC_ACQUIRE);
+    if (child) {
+      return child;
+    }
+    for (uint64_t c = 0; c < kNumNodeEntries && !child; ++c) {
+      child = find_child((art_node *)n, c);
+    }
+    if (!child) {
+      return nullptr;
+    }
+    if (WORT_ISLEAF(child)) {
+      return child;
+    }
+    n = child;
+  }
+}
+
+bool WORTIndex::art_scan(const art_node *n, int depth, bool bounded,
+                         scan_context *ctx) {
+  node_snapshot snap;
+  snapshot_node(n, &snap);
+
+  if (bounded) {
+    // Compare the tokens from depth to the end of n's prefix with start key.
+    // The stored prefix suffices if it is complete and starts at depth,
+    // otherwise the tokens are fetched from a leaf below n
+    int prefix_end = snap.depth + snap.partial_len;
+    int cmp = 0;
+    if (snap.depth == depth && snap.partial_len <= kMaxPrefixLen) {
+      for (int i = 0; i < snap.partial_len && !cmp; ++i) {
+        cmp = (int)TokenAt((const char *)snap.partial, i) -
+              TokenOrder(TokenAt(ctx->startkey, ctx->startkey_len, depth + i));
+      }
+    } else {
+      art_node *leaf = any_leaf(n);
+      if (leaf) {
+        cmp = compare_tokens(leaf_key(leaf), leaf_key_len(leaf),
+                             ctx->startkey, ctx->startkey_len, depth,
+                             prefix_end);
+      }
+    }
+    if (cmp < 0) {
+      return true;  // every key of this subtrie is smaller than start key
+    }
+    bounded = (cmp == 0);
+  }
+  depth = snap.depth + snap.partial_len;
+
+  // Children are visited in token order, which is the order of keys, and
+  // the end leaf comes first. Only the child on the start key's path stays
+  // bounded, smaller ones are skipped. If the start key ends here, the end
+  // leaf is the only candidate below it and every other child is larger
+  uint16_t start =
+      bounded ? TokenAt(ctx->startkey, ctx->startkey_len, depth) : 0;
+  if (snap.end_leaf && (!bounded || start == kEndToken) &&
+      !scan_leaf(snap.end_leaf, bounded, ctx)) {
+    return false;
+  }
+  uint64_t first = start == kEndToken ? 0 : start;
+  for (uint64_t c = first; c < kNumNodeEntries; ++c) {
+    art_node *child = snap.children[c];
+    if (!child) {
+      continue;
+    }
+    bool child_bounded = bounded && start == c;
+    if (!WORT_ISLEAF(child)) {
+      if (!art_scan(child, depth + 1, child_bounded, ctx)) {
+        return false;
+      }
+      continue;
+    }
+    if (!scan_leaf(child, child_bounded, ctx)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool WORTIndex::scan_leaf(const art_node *leaf, bool bounded,
+                          scan_context *ctx) {
+  if (bounded && leaf_compare(leaf, ctx->startkey, ctx->startkey_len) < 0) {
+    return true;
+  }
+  if (ctx->endkey && leaf_compare(leaf, ctx->endkey, ctx->endkey_len) >= 0) {
+    return false;
+  }
+  ctx->vec[ctx->off++] =
+      __atomic_load_n(&WORT_LEAFRAW(leaf)->value, __ATOMIC_ACQUIRE);
+  return ctx->off < ctx->count;
 }
 
 };  // namespace WORT
-};  // namespace PIE
\ No newline at end of file
+};  // namespace PIE
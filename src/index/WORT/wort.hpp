@@ -3,7 +3,9 @@
 
 #include <byteswap.h>
 
+#include <atomic>
 #include <cstdint>
+#include <thread>
 
 #include "allocator.hpp"
 #include "index.hpp"
@@ -14,13 +16,73 @@
 namespace PIE {
 namespace WORT {
 
-// each node of wort will recognize a token of 4bits
-constexpr uint64_t kNodeBits = 4;
-constexpr uint64_t kMaxDepth = 15;
+// Bits of key recognized per trie level: 4 as in WORT by default, or 8 for a
+// byte-wise trie like WOART. e.g. cmake -DWORT_TOKEN_BITS=8
+#ifndef WORT_TOKEN_BITS
+#define WORT_TOKEN_BITS 4
+#endif
+static_assert(WORT_TOKEN_BITS == 4 || WORT_TOKEN_BITS == 8,
+              "WORT tokens are either 4 or 8 bits");
+
+// each node of wort will recognize a token of kNodeBits
+constexpr uint64_t kNodeBits = WORT_TOKEN_BITS;
 constexpr uint64_t kNumNodeEntries = 0x1UL << kNodeBits;
 constexpr uint64_t kLowBitMask = (0x1UL << kNodeBits) - 1;  // recognize token
-constexpr uint64_t kMaxPrefixLen = 6;
-constexpr uint64_t kMaxHeight = kMaxDepth + 1;
+
+// Hybrid path compression: a node records the full length of its prefix but
+// stores only the first kMaxPrefixLen tokens of it. Searches skip the rest
+// optimistically and the final leaf comparison verifies them, inserts
+// compare them against a leaf below the node
+constexpr uint64_t kPrefixBytes = 4;
+constexpr uint64_t kMaxPrefixLen = kPrefixBytes * 8 / kNodeBits;
+
+// Keys may have any length. Depths and prefix lengths count tokens in 16 bits
+constexpr uint64_t kMaxKeyLen = (UINT16_MAX + 1) * kNodeBits / 8 - 1;
+
+// Every key ends with a virtual token past its last byte, so no key is the
+// token prefix of another one, not even of a key that only appends zero
+// bytes. The end token sorts before every real token. Its child is always a
+// leaf, which is kept in art_node::end_leaf instead of a token slot
+constexpr uint16_t kEndToken = kNumNodeEntries;
+
+// Number of busy-wait rounds on a locked node before yielding the CPU
+constexpr int kLockSpin = 64;
+
+// Leaves are packed into per-thread chunks at kLeafAlign granularity, so the
+// 8B value of a leaf is always aligned. A leaf of at most one cache line never
+// straddles two of them, larger leaves are allocated on their own
+constexpr size_t kLeafChunkSize = 4096;
+constexpr size_t kLeafAlign = 16;
+constexpr size_t kCacheLineSize = 64;
+
+// Keys of at most kSmallKeyLen bytes are stored in a 16B art_small_leaf
+constexpr size_t kSmallKeyLen = 7;
+
+// Leaves are referenced by tagged child pointers: bit 0 marks a leaf and bit
+// 1 marks an art_small_leaf. Both leaf types start with the value, thus
+// WORT_LEAFRAW(x)->value is valid for either of them
+#define WORT_ISLEAF(x) (((uintptr_t)x & 1))
+#define WORT_ISSMALL(x) (((uintptr_t)x & 2))
+#define WORT_SETLEAF(x) ((void *)((uintptr_t)x | 1))
+#define WORT_SETSMALL(x) ((void *)((uintptr_t)x | 3))
+#define WORT_LEAFRAW(x) ((art_leaf *)((void *)((uintptr_t)x & ~(uintptr_t)3)))
+
+// Version word layout for optimistic lock coupling: bit 1 marks a writer,
+// unlocking adds another 0b10 so that every write bumps the version. Bit 0
+// marks a node that has been replaced by a larger copy
+constexpr uint64_t kLockedBit = 0b10;
+constexpr uint64_t kObsoleteBit = 0b01;
+
+// Inner node types. Small nodes keep (token, child) slots that are appended
+// in place and grow into the next type once full, the full node indexes its
+// children by token directly. With 4-bit tokens a full node only has 16
+// slots, thus Node4 grows into it directly
+enum node_type_t : uint8_t {
+  kNode4 = 0,
+  kNode16 = 1,
+  kNode48 = 2,
+  kNodeFull = 3,
+};
 
 class WORTIndex : public Index {
  public:
@@ -28,13 +90,85 @@ class WORTIndex : public Index {
   //  This header can be updated atomically to guarantee
   // Crash consistence
   struct art_node {
-    uint8_t depth;
-    uint8_t partial_len;
-    uint8_t partial[kMaxPrefixLen];
+    uint16_t depth;
+    uint16_t partial_len;
+    uint8_t partial[kPrefixBytes];
+
+    // Version word for optimistic lock coupling. It is kept out of the 8B
+    // header above so that header updates stay failure atomic, and it is
+    // never flushed: a lock bit that reaches PM is meaningless after restart
+    std::atomic<uint64_t> version;
+
+    // Leaf of the key that ends at this node's branching token
+    art_node *end_leaf;
+
+    uint8_t type;  // node_type_t, fixed for the lifetime of a node
+
+    // Wait until no writer holds this node and return the observed version,
+    // restart if the node has been replaced meanwhile
+    uint64_t ReadLockOrRestart(bool &need_restart) const {
+      uint64_t v = version.load(std::memory_order_acquire);
+      for (int spin = 0; v & kLockedBit; ++spin) {
+        if (spin < kLockSpin) {
+          asm volatile("pause" ::: "memory");
+        } else {
+          std::this_thread::yield();
+        }
+        v = version.load(std::memory_order_acquire);
+      }
+      need_restart = (v & kObsoleteBit);
+      return v;
+    }
+
+    // Validate that nothing read since ReadLockOrRestart has been modified
+    void CheckOrRestart(uint64_t v, bool &need_restart) const {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      need_restart = (v != version.load(std::memory_order_relaxed));
+    }
+
+    // Turn an optimistic read into a write lock, fail if any write happened
+    // in between
+    void UpgradeToWriteLockOrRestart(uint64_t v, bool &need_restart) {
+      need_restart = !version.compare_exchange_strong(
+          v, v + kLockedBit, std::memory_order_acquire);
+    }
+
+    void WriteUnlock() {
+      version.fetch_add(kLockedBit, std::memory_order_release);
+    }
+
+    // Unlock a node that has been replaced: the carry clears the lock bit
+    // and the obsolete bit is set, so every later reader or writer restarts
+    void WriteUnlockObsolete() {
+      version.fetch_add(kLockedBit | kObsoleteBit, std::memory_order_release);
+    }
+  };
+
+  // Small nodes append a child by writing its token and then the pointer, a
+  // slot is valid once its pointer is non-null. Slots are never removed
+  struct art_node4 {
+    art_node n;
+    uint8_t keys[4];
+    art_node *children[4];
   };
 
-  // A WORT data store node with 16 child pointers
   struct art_node16 {
+    art_node n;
+    uint8_t keys[16];
+    art_node *children[16];
+  };
+
+  // child_index maps a token to its slot in children plus one, zero means
+  // the token has no child. The pointer is persisted before the index byte
+  struct art_node48 {
+    art_node n;
+    uint8_t child_index[kNumNodeEntries];
+    art_node *children[48];
+  };
+
+  // A WORT data store node with one child pointer per token, which is the
+  // original WORT node with 4-bit tokens
+  struct art_node_full {
     art_node n;
     art_node *children[kNumNodeEntries];
   };
@@ -45,73 +179,189 @@ class WORTIndex : public Index {
     uint8_t key[];  // append key's content here
   };
 
+  // Leaf of a key with at most kSmallKeyLen bytes, which is a single 16B slot
+  // of a leaf chunk
+  struct art_small_leaf {
+    void *value;
+    uint8_t key[kSmallKeyLen];
+    uint8_t key_len;
+  };
+
+  // A consistent copy of an inner node's header and children, taken by scans
+  // so that a node is read only once per traversal
+  struct node_snapshot {
+    uint16_t depth;
+    uint16_t partial_len;
+    uint8_t partial[kPrefixBytes];
+    art_node *end_leaf;
+    art_node *children[kNumNodeEntries];
+  };
+
+  // State of an ordered scan: values of keys within [startkey, endkey) are
+  // appended to vec until count of them have been collected. endkey is
+  // nullptr if the scan is only bounded by count
+  struct scan_context {
+    const char *startkey;
+    size_t startkey_len;
+    const char *endkey;
+    size_t endkey_len;
+    size_t count;
+    size_t off;
+    void **vec;
+  };
+
  public:
   // The only constructor to create an empty tree
   WORTIndex(Allocator *nvmallocator)
-      : nvmallocator_(nvmallocator), root_(nullptr), size_(0) {}
+      : nvmallocator_(nvmallocator),
+        root_(nullptr),
+        size_(0),
+        leaf_pool_id_(NextLeafPoolId()) {
+    InitRoot();
+  }
 
   // Default constructor will use Dram allcator and the whole
   // tree structure will be stored in DRAM
   WORTIndex()
-      : nvmallocator_(new PIEDRAMAllocator()), root_(nullptr), size_(0) {}
+      : nvmallocator_(new PIEDRAMAllocator()),
+        root_(nullptr),
+        size_(0),
+        leaf_pool_id_(NextLeafPoolId()) {
+    InitRoot();
+  }
 
   // Any copyable semantics is not allowed
   WORTIndex(const WORTIndex &) = delete;
   WORTIndex &operator=(const WORTIndex &) = delete;
 
  private:
-  // Allocate an inner node
-  art_node *AllocNode();
+  // Allocate an inner node of the given node_type_t
+  art_node *AllocNode(uint8_t type);
 
   // Allocate a leaf and store target key information. This function is expected
-  // to return a persisted leaf node
-  art_leaf *AllocLeaf(const char *key, size_t key_len, void *value);
+  // to return a persisted leaf node, referenced by a tagged pointer that can
+  // be stored into a child slot directly
+  art_node *AllocLeaf(const char *key, size_t key_len, void *value);
+
+  // Carve size bytes out of the calling thread's leaf chunk of this tree
+  void *AllocLeafSlot(size_t size);
+
+  // Return an id that tells apart the leaf chunks of different trees, it is
+  // never reused so that a chunk of a destroyed tree is never touched again
+  static uint64_t NextLeafPoolId();
+
+  // The root is an inner node that lives as long as the tree, thus every
+  // child pointer swap happens inside a node that can be locked
+  void InitRoot() {
+    root_ = AllocNode(kNodeFull);
+    persist_data((char *)root_, sizeof(art_node_full));
+  }
 
-  // Insert key into subtrie specified by input parameter art_node *n.
-  // Insertion may cause subtrie be replaced, e.g prefix split. art_node **ref
-  // is used to modify coresponding childpointer points to new subtrie
-  void *recursive_insert(art_node *n, art_node **ref, const char *key,
-                         size_t key_len, void *value, int depth, int *old,
-                         bool replace);
+  // Insert key into the tree with optimistic lock coupling: the traversal
+  // only reads version words and a writer locks the node whose child slot or
+  // header it modifies (plus the parent when splitting a prefix). Return
+  // kInsertKeyExist if the key already exists, in which case its value is
+  // overwritten only when replace is set
+  status_code_t art_insert(const char *key, size_t key_len, void *value,
+                           bool replace);
 
  private:
   // Some helper functions
 
+  // Key content and length of the leaf referenced by tagged pointer "leaf"
+  static const char *leaf_key(const art_node *leaf);
+  static size_t leaf_key_len(const art_node *leaf);
+
   // Check if search key matches key stored in input leaf. return zero if
   // matches, otherwise a non-zero value will be returned
-  int leaf_matches(const art_leaf *leaf, const char *key, size_t key_len);
+  int leaf_matches(const art_node *leaf, const char *key, size_t key_len);
 
-  // Calculate the index position of leaf1 and leaf2's longest commmon prefix
-  // since "depth" index position
-  int longest_common_prefix(art_leaf *leaf1, art_leaf *leaf2, int depth);
+  // Calculate the index position of the longest commmon prefix of leaf's key
+  // and key since "depth" index position. Return -1 if their tokens never
+  // differ
+  int longest_common_prefix(const art_node *leaf, const char *key,
+                            size_t key_len, int depth);
 
   // Return the index at which the node's prefix and key's prefix mismatches
-  // the minimum return value is zero, which indicates the doesn't match at all
+  // the minimum return value is zero, which indicates the doesn't match at all.
+  // Tokens beyond the stored prefix are compared against a leaf below n,
+  // which is returned via "leaf" in that case
   int prefix_mismatch(const art_node *n, const char *key, size_t key_len,
-                      int depth, art_leaf **leaf);
+                      int depth, art_node **leaf);
 
-  // Set the c'th child points to input child
-  void add_child(art_node16 *n, uint8_t c, void *child) {
-    n->children[c] = (art_node *)child;
-  }
+  // Add child for token c, which n must not contain yet. c may be kEndToken. The slot becomes
+  // valid with a single 8B store; if "persist" is set, n is reachable and
+  // the stores are flushed in an order that keeps n crash consistent
+  void add_child(art_node *n, uint16_t c, void *child, bool persist);
+
+  // Swap the existing child of token c with a single persisted 8B store
+  void replace_child(art_node *n, uint16_t c, void *child);
+
+  // Return the address of the slot holding the c'th child of n, or nullptr
+  art_node **child_ref(art_node *n, uint16_t c);
 
   // Fetch the c'th child of n
-  art_node **find_child(art_node *n, uint8_t c) {
-    art_node16 *p = (art_node16 *)n;
-    if (p->children[c]) {
-      return &p->children[c];
-    }
-    return nullptr;
-  }
+  art_node *find_child(art_node *n, uint16_t c);
+
+  // Copy all children of n into an array indexed by token, the end leaf is
+  // not included
+  void copy_children(const art_node *n, art_node **children);
+
+  // Check if n has no free slot for another child of a real token
+  bool node_full(const art_node *n);
+
+  // Return a persisted copy of n in the next larger node type that holds
+  // child for token c as well. The copy is published by swapping the
+  // parent's pointer, n itself is never modified
+  art_node *grow_node(art_node *n, uint8_t c, void *child);
+
+  // Size in bytes of an inner node of the given type
+  static size_t node_size(uint8_t type);
 
   // Return the idx "token" of key. In WORT, each token is set to be 4bits
+  // unless WORT_TOKEN_BITS selects byte tokens
   uint8_t TokenAt(const char *key, int idx);
 
-  // Set the idx "token" of key array. In WORT, each token is set to be 4bits
+  // Return the idx "token" of a key of key_len bytes, kEndToken past its end
+  uint16_t TokenAt(const char *key, size_t key_len, int idx);
+
+  // Rank of token c in key order, the end token comes first
+  static int TokenOrder(uint16_t c);
+
+  // Set the idx "token" of key array
   void SetToken(char *key, int idx, uint8_t token);
 
-  // This function is the read interface of original ART implementation
-  void *art_search(const char *key, size_t key_len);
+  // This function is the read interface of original ART implementation and
+  // returns the leaf storing key, or nullptr if key does not exist.
+  // Readers take no lock, they validate node versions and restart instead
+  art_leaf *art_search(const char *key, size_t key_len);
+
+  // Copy header and children of n, retry until no writer interfered
+  void snapshot_node(const art_node *n, node_snapshot *snap);
+
+  // Return the tagged pointer of any leaf of the subtrie n. Every key below n
+  // shares the full prefix of n, thus this leaf recovers prefix tokens that
+  // are not stored
+  art_node *any_leaf(const art_node *n);
+
+  // Compare key against startkey token by token within [from, to) tokens
+  int compare_tokens(const char *key, size_t key_len, const char *startkey,
+                     size_t startkey_len, int from, int to);
+
+  // Lexicographically compare the key of leaf with key
+  int leaf_compare(const art_node *leaf, const char *key, size_t key_len);
+
+  // Traverse subtrie n in key order and collect values into ctx. While
+  // "bounded" is set, the path to n equals the start key up to "depth"
+  // tokens and subtries smaller than the start key are pruned. Return false
+  // once the scan is complete
+  bool art_scan(const art_node *n, int depth, bool bounded,
+                scan_context *ctx);
+
+  // Collect the value of leaf into ctx unless it is smaller than the start
+  // key, which is only checked if "bounded" is set. Return false once the
+  // scan is complete
+  bool scan_leaf(const art_node *leaf, bool bounded, scan_context *ctx);
 
   // Return the number of prefix characters shared between the key and the node
   int check_prefix(const art_node *n, const char *key, size_t key_len,
@@ -119,100 +369,157 @@ class WORTIndex : public Index {
 
  public:
   status_code_t Insert(const char *key, size_t key_len, void *value) override {
-    int old_val = 0;
-    void *old = recursive_insert(root_, &root_, key, key_len, value, 0,
-                                 &old_val, false);
-    // return nullptr means every thing is ok
-    if (old == nullptr) {
-      if (!old_val) {  // value does not exist
-        size_++;
-        return kOk;
-      } else {
-        return kInsertKeyExist;
-      }
+    if (key_len > kMaxKeyLen) {
+      return kFailed;
+    }
+    status_code_t stat = art_insert(key, key_len, value, false);
+    if (stat == kOk) {
+      size_.fetch_add(1, std::memory_order_relaxed);
     }
-    return kNotDefined;
+    return stat;
   }
 
   status_code_t Search(const char *key, size_t key_len, void **value) override {
-    auto searchval = art_search(key, key_len);
-    if (searchval == nullptr) {
+    art_leaf *leaf = art_search(key, key_len);
+    if (leaf == nullptr) {
       return kNotFound;
     }
-    *value = searchval;
+    *value = __atomic_load_n(&leaf->value, __ATOMIC_ACQUIRE);
     return kOk;
   }
 
+  // Leaves are never freed and the value is a single 8B word, thus the new
+  // value is swapped in and persisted without locking
   status_code_t Update(const char *key, size_t key_len, void *value) override {
-    // TODO
+    art_leaf *leaf = art_search(key, key_len);
+    if (leaf == nullptr) {
+      return kNotFound;
+    }
+    __atomic_store_n(&leaf->value, value, __ATOMIC_RELEASE);
+    asm_clwb((char *)&leaf->value);
+    asm_sfence();
     return kOk;
   }
 
   status_code_t Upsert(const char *key, size_t key_len, void *value) override {
-    int old_val = 0;
-    void *old =
-        recursive_insert(root_, &root_, key, key_len, value, 0, &old_val, true);
-    if (old == nullptr) {
-      return kOk;  // Upsert always succeed
+    if (key_len > kMaxKeyLen) {
+      return kFailed;
     }
-    return kNotDefined;
+    status_code_t stat = art_insert(key, key_len, value, true);
+    if (stat == kOk) {
+      size_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return stat == kFailed ? kFailed : kOk;
   }
 
+  // WORT keeps keys in order, thus values are returned SORTED by key
   status_code_t ScanCount(const char *startkey, size_t key_len, size_t count,
                           void **vec) override {
-    // TODO
+    scan_context ctx = {startkey, key_len, nullptr, 0, count, 0, vec};
+    if (count) {
+      art_scan(root_, 0, true, &ctx);
+    }
     return kOk;
   }
 
   status_code_t Scan(const char *startkey, size_t startkey_len,
                      const char *endkey, size_t endkey_len,
                      void **vec) override {
-    // TODO
+    scan_context ctx = {startkey, startkey_len, endkey, endkey_len,
+                        SIZE_MAX, 0, vec};
+    art_scan(root_, 0, true, &ctx);
     return kOk;
   }
 
-  void Print() override { std::cout << "[WORT][Key Num: " << size_ << "]\n"; }
+  void Print() override {
+    std::cout << "[WORT][Key Num: " << size_.load() << "]\n";
+  }
 
  private:
-  Allocator *nvmallocator_;  // allocator for memory management
-  art_node *root_;           // root of the radix tree
-  uint64_t size_;            // record the number of different keys
+  Allocator *nvmallocator_;     // allocator for memory management
+  art_node *root_;              // root of the radix tree
+  std::atomic<uint64_t> size_;  // record the number of different keys
+  const uint64_t leaf_pool_id_;  // owner id of this tree's leaf chunks
 };
 
-inline WORTIndex::art_node *WORTIndex::AllocNode() {
+inline size_t WORTIndex::node_size(uint8_t type) {
+  switch (type) {
+    case kNode4:
+      return sizeof(art_node4);
+    case kNode16:
+      return sizeof(art_node16);
+    case kNode48:
+      return sizeof(art_node48);
+    default:
+      return sizeof(art_node_full);
+  }
+}
+
+inline WORTIndex::art_node *WORTIndex::AllocNode(uint8_t type) {
   // Allocate cacheline aligned memory
+  size_t size = node_size(type);
   art_node *ret = reinterpret_cast<art_node *>(
-      nvmallocator_->AllocateAlign(sizeof(art_node16), 64));
+      nvmallocator_->AllocateAlign(size, 64));
   // Init memory to zero to avoid invalid pointer error,
   // e.g segment fault
-  memset((void *)ret, 0, sizeof(art_node16));
+  memset((void *)ret, 0, size);
+  ret->type = type;
   return ret;
 }
 
-inline WORTIndex::art_leaf *WORTIndex::AllocLeaf(const char *key,
+inline WORTIndex::art_node *WORTIndex::AllocLeaf(const char *key,
                                                  size_t key_len, void *value) {
+  if (key_len <= kSmallKeyLen) {
+    art_small_leaf *leaf = reinterpret_cast<art_small_leaf *>(
+        AllocLeafSlot(sizeof(art_small_leaf)));
+    leaf->value = value;
+    memcpy(leaf->key, key, key_len);
+    leaf->key_len = key_len;
+    persist_data((char *)leaf, sizeof(art_small_leaf));  // persist
+    return (art_node *)WORT_SETSMALL(leaf);
+  }
+
   // Allocate space for both key content and leaf struct
-  size_t alloc_size = sizeof(art_leaf) + key_len;
+  size_t alloc_size = offsetof(art_leaf, key) + key_len;
   art_leaf *leaf = reinterpret_cast<art_leaf *>(
-      nvmallocator_->AllocateAlign(alloc_size, 64));
+      alloc_size <= kCacheLineSize
+          ? AllocLeafSlot(alloc_size)
+          : nvmallocator_->AllocateAlign(alloc_size, kCacheLineSize));
 
   leaf->value = value;
   leaf->key_len = key_len;
   memcpy(leaf->key, key, key_len);
 
   persist_data((char *)leaf, alloc_size);  // persist
-  return leaf;
+  return (art_node *)WORT_SETLEAF(leaf);
+}
+
+inline const char *WORTIndex::leaf_key(const art_node *leaf) {
+  if (WORT_ISSMALL(leaf)) {
+    return (const char *)((art_small_leaf *)WORT_LEAFRAW(leaf))->key;
+  }
+  return (const char *)WORT_LEAFRAW(leaf)->key;
 }
 
-inline int WORTIndex::leaf_matches(const art_leaf *leaf, const char *key,
+inline size_t WORTIndex::leaf_key_len(const art_node *leaf) {
+  if (WORT_ISSMALL(leaf)) {
+    return ((art_small_leaf *)WORT_LEAFRAW(leaf))->key_len;
+  }
+  return WORT_LEAFRAW(leaf)->key_len;
+}
+
+inline int WORTIndex::leaf_matches(const art_node *leaf, const char *key,
                                    size_t key_len) {
-  if (leaf->key_len != key_len) {
+  if (leaf_key_len(leaf) != key_len) {
     return 1;
   }
-  return memcmp(key, leaf->key, key_len);
+  return memcmp(key, leaf_key(leaf), key_len);
 }
 
 inline uint8_t WORTIndex::TokenAt(const char *key, int idx) {
+  if (kNodeBits == 8) {
+    return key[idx];
+  }
   // calculate the byte position which the "idx" token belongs to
   uint8_t byte = key[idx / 2];
   // If idx is even, e.g: 0, fetch the high 4 bits, otherwise
@@ -220,7 +527,22 @@ inline uint8_t WORTIndex::TokenAt(const char *key, int idx) {
   return (idx & 1) ? (byte & 0x0F) : ((byte >> 4) & 0x0F);
 }
 
+inline uint16_t WORTIndex::TokenAt(const char *key, size_t key_len, int idx) {
+  if ((size_t)idx * kNodeBits >= key_len * 8) {
+    return kEndToken;
+  }
+  return TokenAt(key, idx);
+}
+
+inline int WORTIndex::TokenOrder(uint16_t c) {
+  return c == kEndToken ? -1 : c;
+}
+
 inline void WORTIndex::SetToken(char *key, int idx, uint8_t token) {
+  if (kNodeBits == 8) {
+    key[idx] = token;
+    return;
+  }
   uint8_t byte = key[idx / 2];  // modify on target byte position
   if (idx & 1) {
     // Set the lower 4bits of byte
@@ -231,45 +553,82 @@ inline void WORTIndex::SetToken(char *key, int idx, uint8_t token) {
   key[idx / 2] = byte;
 }
 
-inline int WORTIndex::longest_common_prefix(art_leaf *leaf1, art_leaf *leaf2,
+inline int WORTIndex::longest_common_prefix(const art_node *leaf,
+                                            const char *key, size_t key_len,
                                             int depth) {
-  int idx, max_cmp = kMaxHeight - depth;
-  for (idx = 0; idx < max_cmp; ++idx) {
-    if (TokenAt((const char *)leaf1->key, depth + idx) !=
-        TokenAt((const char *)leaf2->key, depth + idx)) {
+  const char *leaf_k = leaf_key(leaf);
+  size_t leaf_len = leaf_key_len(leaf);
+  // The end token of the shorter key differs from the longer key's token
+  int max_cmp = std::min(leaf_len, key_len) * 8 / kNodeBits + 1 - depth;
+  for (int idx = 0; idx < max_cmp; ++idx) {
+    if (TokenAt(leaf_k, leaf_len, depth + idx) !=
+        TokenAt(key, key_len, depth + idx)) {
       return idx;
     }
   }
-  return idx;
+  return -1;
 }
 
 inline int WORTIndex::prefix_mismatch(const art_node *n, const char *key,
                                       size_t key_len, int depth,
-                                      art_leaf **leaf) {
-  int max_cmp = std::min(std::min(kMaxPrefixLen, (uint64_t)n->partial_len),
-                         kMaxHeight - (uint64_t)depth);
+                                      art_node **leaf) {
+  int max_cmp = std::min(kMaxPrefixLen, (uint64_t)n->partial_len);
   int idx = 0;
   for (idx = 0; idx < max_cmp; idx++) {
-    if (TokenAt((const char *)(n->partial), idx) != TokenAt(key, depth + idx)) {
+    if (TokenAt((const char *)(n->partial), idx) !=
+        TokenAt(key, key_len, depth + idx)) {
       return idx;
     }
   }
+  if (n->partial_len > kMaxPrefixLen) {
+    // The rest of the prefix is not stored, but every key below n shares it
+    *leaf = any_leaf(n);
+    for (; idx < n->partial_len; idx++) {
+      if (TokenAt(leaf_key(*leaf), leaf_key_len(*leaf), depth + idx) !=
+          TokenAt(key, key_len, depth + idx)) {
+        return idx;
+      }
+    }
+  }
   return idx;
 }
 
 inline int WORTIndex::check_prefix(const art_node *n, const char *key,
                                    size_t key_len, int depth) {
-  int max_cmp = std::min(std::min((uint64_t)n->partial_len, kMaxPrefixLen),
-                         kMaxHeight - (uint64_t)depth);
+  int max_cmp = std::min((uint64_t)n->partial_len, kMaxPrefixLen);
   int idx;
   for (idx = 0; idx < max_cmp; idx++) {
-    if (TokenAt((const char *)n->partial, idx) != TokenAt(key, depth + idx)) {
+    if (TokenAt((const char *)n->partial, idx) !=
+        TokenAt(key, key_len, depth + idx)) {
       return idx;
     }
   }
   return idx;
 }
 
+inline int WORTIndex::compare_tokens(const char *key, size_t key_len,
+                                    const char *startkey, size_t startkey_len,
+                                    int from, int to) {
+  for (int idx = from; idx < to; ++idx) {
+    int diff = TokenOrder(TokenAt(key, key_len, idx)) -
+               TokenOrder(TokenAt(startkey, startkey_len, idx));
+    if (diff) {
+      return diff;
+    }
+  }
+  return 0;
+}
+
+inline int WORTIndex::leaf_compare(const art_node *leaf, const char *key,
+                                   size_t key_len) {
+  size_t leaf_len = leaf_key_len(leaf);
+  int cmp = memcmp(leaf_key(leaf), key, std::min(leaf_len, key_len));
+  if (cmp) {
+    return cmp;
+  }
+  return (leaf_len > key_len) - (leaf_len < key_len);
+}
+
 };  // namespace WORT
 };  // namespace PIE
 
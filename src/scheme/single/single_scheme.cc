@@ -10,6 +10,7 @@
 #include "single_scheme.hpp"
 #include "index/CCEH/CCEH_MSB.hpp"
 #include "index/FASTFAIR/btree.hpp"
+#include "index/P-CLHT/clht-lb.hpp"
 #include "index/RHTREE/rhtree.hpp"
 #include "index/WORT/wort.hpp"
 #include "index/example/example_index.hpp"
@@ -24,12 +25,20 @@ SingleScheme::SingleScheme(const Options& options)
     } else if (options.index_type == kCCEH) {
         std::cout << "[SingleScheme::SingleScheme - CCEH::CCEHIndex]" << std::endl;
         nvm_allocator_ = new PIENVMAllocator(options.pmem_file_path.c_str(), options.pmem_file_size);
-        index_ = new CCEH::CCEHIndex(nvm_allocator_, 16);
+        index_ = new CCEH::CCEHIndex(nvm_allocator_, 16, options.htm);
     } else if (options.index_type == kRHTREE) {
-        std::cout << "[SingleScheme::SingleScheme - RHTREE::RHTreeIndex]" << std::endl;
         dram_allocator_ = new PIEDRAMAllocator();
         nvm_allocator_ = new PIENVMAllocator(options.pmem_file_path.c_str(), options.pmem_file_size);
-        index_ = new RHTREE::RHTreeIndex(dram_allocator_, nvm_allocator_);
+        if (options.rhtree_leaf == kRHTreeLeaf1KB) {
+            std::cout << "[SingleScheme::SingleScheme - RHTREE::RHTreeSmallLeafIndex]" << std::endl;
+            index_ = new RHTREE::RHTreeSmallLeafIndex(dram_allocator_, nvm_allocator_);
+        } else if (options.rhtree_leaf == kRHTreeLeaf4KB) {
+            std::cout << "[SingleScheme::SingleScheme - RHTREE::RHTreeLargeLeafIndex]" << std::endl;
+            index_ = new RHTREE::RHTreeLargeLeafIndex(dram_allocator_, nvm_allocator_);
+        } else {
+            std::cout << "[SingleScheme::SingleScheme - RHTREE::RHTreeIndex]" << std::endl;
+            index_ = new RHTREE::RHTreeIndex(dram_allocator_, nvm_allocator_);
+        }
     } else if (options.index_type == kFASTFAIR) {
         std::cout << "[SingleScheme::SingleScheme - FASTFAIR::FASTFAIRTree]" << std::endl;
         nvm_allocator_ = new PIENVMAllocator(options.pmem_file_path.c_str(), options.pmem_file_size);
@@ -38,6 +47,10 @@ SingleScheme::SingleScheme(const Options& options)
         std::cout << "[SingleScheme::SingleScheme - WORT::WORTIndex]" << std::endl;
         nvm_allocator_ = new PIENVMAllocator(options.pmem_file_path.c_str(), options.pmem_file_size);
         index_ = new WORT::WORTIndex(nvm_allocator_);
+    } else if (options.index_type == kPCLHT) {
+        std::cout << "[SingleScheme::SingleScheme - CLHT::CLHTLBIndex]" << std::endl;
+        nvm_allocator_ = new PIENVMAllocator(options.pmem_file_path.c_str(), options.pmem_file_size);
+        index_ = new CLHT::CLHTLBIndex(nvm_allocator_, options.pclht_num_buckets);
     } else {
         std::cout << "[SingleScheme::SingleScheme - Unknow Index Type]" << std::endl;
     }
@@ -64,6 +77,8 @@ Status SingleScheme::Search(const Slice& key, void** value)
     status_code_t code = index_->Search(key.data(), key.size(), value);
     if (code == kOk) {
         return Status::OK();
+    } else if (code == kNotFound) {
+        return Status::NotFound("Search Failed.");
     } else {
         return Status::IOError("Search Failed.");
     }
@@ -74,6 +89,8 @@ Status SingleScheme::Update(const Slice& key, void* value)
     status_code_t code = index_->Update(key.data(), key.size(), value);
     if (code == kOk) {
         return Status::OK();
+    } else if (code == kNotFound) {
+        return Status::NotFound("Update Failed.");
     } else {
         return Status::IOError("Update Failed.");
     }
@@ -89,6 +106,20 @@ Status SingleScheme::Upsert(const Slice& key, void* value)
     }
 }
 
+Status SingleScheme::Delete(const Slice& key)
+{
+    status_code_t code = index_->Delete(key.data(), key.size());
+    if (code == kOk) {
+        return Status::OK();
+    } else if (code == kNotFound) {
+        return Status::NotFound("Delete Failed.");
+    } else if (code == kNotDefined) {
+        return Status::NotSupported("Delete Not Supported.");
+    } else {
+        return Status::IOError("Delete Failed.");
+    }
+}
+
 Status SingleScheme::ScanCount(const Slice& startkey, size_t count, void** vec)
 {
     status_code_t code = index_->ScanCount(startkey.data(), startkey.size(), count, vec);
@@ -109,6 +140,18 @@ Status SingleScheme::Scan(const Slice& startkey, const Slice& endkey, void** vec
     }
 }
 
+Status SingleScheme::BulkLoad(Iterator* iter, double fill_factor)
+{
+    status_code_t code = index_->BulkLoad(iter, fill_factor);
+    if (code == kOk) {
+        return Status::OK();
+    } else if (code == kNotDefined) {
+        return Status::NotSupported("BulkLoad Not Supported.");
+    } else {
+        return Status::IOError("BulkLoad Failed.");
+    }
+}
+
 void SingleScheme::Print()
 {
     index_->Print();
@@ -45,6 +45,11 @@ public:
     // occurs
     Status Upsert(const Slice& key, void* value);
 
+    // Remove the key and its value from index.
+    // If the key does not exist in current index, NotFound would
+    // be returned, NotSupported if the index cannot delete keys
+    Status Delete(const Slice& key);
+
     // Scan from start key and return its "count" successors
     // Coresponding values are placed in a void* array specified by "vec"
     // However, values are not guaranteed to be SORTED;
@@ -55,6 +60,11 @@ public:
     // However, values are not guaranteed to be SORTED;
     Status Scan(const Slice& startkey, const Slice& endkey, void** vec);
 
+    // Build an empty index from key-value pairs in ascending key order.
+    // "fill_factor" (0, 1] is the fraction of each node that is filled.
+    // Returns NotSupported if the index has no bulk loading path
+    Status BulkLoad(Iterator* iter, double fill_factor = 1.0);
+
     // Printout Any related index message:
     // such as the height of B+Tree or max height of radix tree
     // The bucket/slot number of hash table